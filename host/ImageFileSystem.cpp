@@ -0,0 +1,132 @@
+/* FATFileSystem on a disk image file, for running the FAT layer on the host
+ */
+#include "ImageFileSystem.h"
+#include "mbed_debug.h"
+
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define IMAGE_SECTOR_SIZE 512
+
+ImageFileSystem::ImageFileSystem(const char *path, const char *name, uint32_t sectors) :
+    FATFileSystem(name), _image(NULL), _sectors(0) {
+    reset_stats();
+
+    _fd = ::open(path, O_RDWR | (sectors > 0 ? O_CREAT : 0), 0644);
+    if (_fd < 0) {
+        debug("Couldn't open image %s\n", path);
+        return;
+    }
+    struct stat st;
+    if (fstat(_fd, &st) != 0) {
+        return;
+    }
+    if (sectors > 0 && (uint64_t)st.st_size < (uint64_t)sectors * IMAGE_SECTOR_SIZE) {
+        if (ftruncate(_fd, (off_t)sectors * IMAGE_SECTOR_SIZE) != 0) {
+            debug("Couldn't grow image %s\n", path);
+            return;
+        }
+        st.st_size = (off_t)sectors * IMAGE_SECTOR_SIZE;
+    }
+    _sectors = st.st_size / IMAGE_SECTOR_SIZE;
+    if (_sectors == 0) {
+        debug("Image %s is empty\n", path);
+        return;
+    }
+    void *image = mmap(NULL, (size_t)_sectors * IMAGE_SECTOR_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (image == MAP_FAILED) {
+        debug("Couldn't map image %s\n", path);
+        _sectors = 0;
+        return;
+    }
+    _image = (uint8_t *)image;
+}
+
+ImageFileSystem::~ImageFileSystem() {
+    if (_image) {
+        msync(_image, (size_t)_sectors * IMAGE_SECTOR_SIZE, MS_SYNC);
+        munmap(_image, (size_t)_sectors * IMAGE_SECTOR_SIZE);
+    }
+    if (_fd >= 0) {
+        ::close(_fd);
+    }
+}
+
+int ImageFileSystem::disk_initialize() {
+    return _image ? 0 : 1;
+}
+
+int ImageFileSystem::disk_status() {
+    return _image ? 0 : 1;
+}
+
+int ImageFileSystem::disk_read(uint8_t *buffer, uint32_t sector, uint32_t count) {
+    if (!_image) {
+        return -1;
+    }
+    if (sector >= _sectors || count > _sectors - sector) {
+        return 1;
+    }
+    memcpy(buffer, _image + (size_t)sector * IMAGE_SECTOR_SIZE, (size_t)count * IMAGE_SECTOR_SIZE);
+    reads++;
+    read_sectors += count;
+    return 0;
+}
+
+int ImageFileSystem::disk_write(const uint8_t *buffer, uint32_t sector, uint32_t count) {
+    if (!_image) {
+        return -1;
+    }
+    if (sector >= _sectors || count > _sectors - sector) {
+        return 1;
+    }
+    memcpy(_image + (size_t)sector * IMAGE_SECTOR_SIZE, buffer, (size_t)count * IMAGE_SECTOR_SIZE);
+    writes++;
+    written_sectors += count;
+    return 0;
+}
+
+int ImageFileSystem::disk_sync() {
+    if (!_image) {
+        return -1;
+    }
+    syncs++;
+    return msync(_image, (size_t)_sectors * IMAGE_SECTOR_SIZE, MS_SYNC) == 0 ? 0 : 1;
+}
+
+uint32_t ImageFileSystem::disk_sectors() {
+    return _sectors;
+}
+
+int ImageFileSystem::disk_erase(uint32_t sector, uint32_t count) {
+    if (!_image) {
+        return -1;
+    }
+    if (sector >= _sectors || count > _sectors - sector) {
+        return 1;
+    }
+    memset(_image + (size_t)sector * IMAGE_SECTOR_SIZE, 0, (size_t)count * IMAGE_SECTOR_SIZE);
+    return 0;
+}
+
+uint32_t ImageFileSystem::partition_offset() {
+    // MBR signature 0x55AA and the start LBA of the first entry. A volume
+    // without partition table starts with the jump of its boot sector
+    if (!_image || _image[510] != 0x55 || _image[511] != 0xAA
+            || _image[0] == 0xEB || _image[0] == 0xE9 || _image[450] == 0) {
+        return 0;
+    }
+    uint8_t *lba = _image + 454;
+    return (lba[0] | lba[1] << 8 | lba[2] << 16 | (uint32_t)lba[3] << 24) * IMAGE_SECTOR_SIZE;
+}
+
+void ImageFileSystem::reset_stats() {
+    reads = 0;
+    writes = 0;
+    read_sectors = 0;
+    written_sectors = 0;
+    syncs = 0;
+}
@@ -0,0 +1,65 @@
+/* FATFileSystem on a disk image file, for running the FAT layer on the host
+ */
+#ifndef MBED_HOST_IMAGEFILESYSTEM_H
+#define MBED_HOST_IMAGEFILESYSTEM_H
+
+#include "FATFileSystem.h"
+
+/** Block device on a disk image file, mapped into memory with mmap()
+ *
+ * Sector reads and writes are memcpy() on the mapping and disk_sync() is
+ * msync(), so timings show the cost of the FAT layer itself. The image is a
+ * plain disk: format() puts a partition table and a FAT volume on it that
+ * Linux can mount through a loop device, see partition_offset().
+ *
+ * @code
+ * ImageFileSystem img("card.img", "sd", 64 * 2048); // 64MB, created if missing
+ * img.format();
+ * FileHandle *fh = img.open("hello.txt", O_WRONLY | O_CREAT);
+ * @endcode
+ */
+class ImageFileSystem : public FATFileSystem {
+public:
+
+    /** Map an image file
+     *
+     * @param path    image file
+     * @param name    The name used to access the virtual filesystem
+     * @param sectors size in 512 byte sectors to create or grow the image to,
+     *                0 to use an existing image as it is
+     */
+    ImageFileSystem(const char *path, const char *name, uint32_t sectors = 0);
+    virtual ~ImageFileSystem();
+
+    virtual int disk_initialize();
+    virtual int disk_status();
+    virtual int disk_read(uint8_t *buffer, uint32_t sector, uint32_t count);
+    virtual int disk_write(const uint8_t *buffer, uint32_t sector, uint32_t count);
+    virtual int disk_sync();
+    virtual uint32_t disk_sectors();
+
+    /** Erased sectors read as 0
+     */
+    virtual int disk_erase(uint32_t sector, uint32_t count);
+
+    /** Byte offset of the first partition from the partition table, for
+     * mount -o loop,offset=..., 0 without a partition table
+     */
+    uint32_t partition_offset();
+
+    void reset_stats();
+
+    uint32_t reads;             // disk_read calls
+    uint32_t writes;            // disk_write calls
+    uint32_t read_sectors;
+    uint32_t written_sectors;
+    uint32_t syncs;
+
+protected:
+
+    int _fd;
+    uint8_t *_image;
+    uint32_t _sectors;
+};
+
+#endif
@@ -0,0 +1,580 @@
+/* Simulated SD card in SPI mode, for running SDFileSystem on the host
+ */
+#include "SDSimTransport.h"
+#include "SDCRC.h"
+#include <string.h>
+
+#define R1_IDLE_STATE           (1 << 0)
+#define R1_ILLEGAL_COMMAND      (1 << 2)
+#define R1_COM_CRC_ERROR        (1 << 3)
+#define R1_ERASE_SEQUENCE_ERROR (1 << 4)
+#define R1_ADDRESS_ERROR        (1 << 5)
+
+#define SIM_BLOCK_SIZE          512
+#define SIM_DATA_ACCEPTED       0x05
+#define SIM_DATA_CRC_ERROR      0x0B
+#define SIM_OCR                 0xC0FF8000  // powered up, CCS (SDHC), 2.7-3.6V
+#define SIM_FOREVER             (1ULL << 62)
+
+// a + b, up to SIM_FOREVER
+static uint64_t add_ns(uint64_t a, uint64_t b) {
+    return a < SIM_FOREVER - b ? a + b : SIM_FOREVER;
+}
+
+// opposite of ext_bits() in SDFileSystem.cpp
+static void set_bits(uint8_t *data, int msb, int lsb, uint32_t bits, int bytes = 16) {
+    for (int position = lsb; position <= msb; position++) {
+        int byte = bytes - 1 - (position >> 3);
+        int bit = position & 0x7;
+        if ((bits >> (position - lsb)) & 1) {
+            data[byte] |= 1 << bit;
+        } else {
+            data[byte] &= ~(1 << bit);
+        }
+    }
+}
+
+SDSimTransport::SDSimTransport(uint8_t *image, uint32_t sectors) :
+    clock(&_clock), hz(0), busy_bytes(8), corrupt_every(0), dma(true), dma_poll(true), hang(false), removed(false), bytes(0),
+    ncr_bytes(1), read_us(0), program_us(0), commit_us(0), overwrite_us(0), erase_us(0),
+    au_us(0), open_aus(2), gc_us(0), gc_per_mille(0), seed(1), stalls(0), au_switches(0),
+    _image(image), _sectors(sectors), _blocks_sent(0),
+    _selected(false), _app(false), _ready(false), _crc_on(false), _init_polls(0),
+    _mode(MODE_COMMAND), _multiple(false), _block(0), _erase_start(0), _erase_end(0), _pre_erase(0),
+    _cmd_length(0), _data_length(0), _out_head(0), _out_count(0), _hold_head(0), _holds(0),
+    _hold_running(false), _hold_end(0),
+    _async_tx(NULL), _async_rx(NULL), _async_length(0), _async_start(0), _async_pending(false) {
+
+    // CSD version 2.0 (SDHC)
+    memset(_csd, 0, sizeof(_csd));
+    set_bits(_csd, 127, 126, 1);                // csd_structure
+    set_bits(_csd, 119, 112, 0x0E);             // taac
+    set_bits(_csd, 103, 96, 0x32);              // tran_speed: 25MHz
+    set_bits(_csd, 95, 84, 0x5B5);              // ccc
+    set_bits(_csd, 83, 80, 9);                  // read_bl_len: 512
+    set_bits(_csd, 69, 48, sectors / 1024 - 1); // c_size
+    set_bits(_csd, 25, 22, 9);                  // write_bl_len: 512
+    set_bits(_csd, 0, 0, 1);
+
+    memset(_cid, 0, sizeof(_cid));
+    set_bits(_cid, 127, 120, 0x03);             // mid
+    memcpy(_cid + 1, "SMSDSIM", 7);             // oid, pnm
+    set_bits(_cid, 63, 56, 0x10);               // prv 1.0
+    set_bits(_cid, 55, 24, 0x12345678);         // psn
+    set_bits(_cid, 19, 8, (19 << 4) | 6);       // mdt 2019/6
+    set_bits(_cid, 0, 0, 1);
+
+    // AU of 16KB to 4MB, at most 1/16 of the card like on real cards
+    int au_size = 1;
+    while (au_size < 9 && (32u << au_size) * 16 <= sectors) {
+        au_size++;
+    }
+    memset(_ssr, 0, sizeof(_ssr));
+    set_bits(_ssr, 447, 440, 4, 64);            // speed_class: class 10
+    set_bits(_ssr, 431, 428, au_size, 64);      // au_size
+    set_bits(_ssr, 423, 408, 2, 64);            // erase_size: 2 AUs
+    set_bits(_ssr, 407, 402, 2, 64);            // erase_timeout: 2s
+    set_bits(_ssr, 401, 400, 1, 64);            // erase_offset: 1s
+    _au_sectors = 16 << au_size;
+    for (int i = 0; i < SIM_OPEN_AUS; i++) {
+        _open_au[i] = 0xFFFFFFFF;
+    }
+
+    // a new card, all blocks erased
+    _erased_map = new uint8_t[(sectors + 7) / 8];
+    memset(_erased_map, 0xFF, (sectors + 7) / 8);
+}
+
+SDSimTransport::~SDSimTransport() {
+    delete[] _erased_map;
+}
+
+void SDSimTransport::select(bool selected) {
+    _selected = selected;
+}
+
+void SDSimTransport::frequency(uint32_t hz) {
+    this->hz = hz;
+}
+
+int SDSimTransport::write(int value) {
+    clock->ns += _byte_ns();
+    return _exchange(value);
+}
+
+void SDSimTransport::block(const uint8_t *tx, uint8_t *rx, uint32_t length) {
+    for (uint32_t i = 0; i < length; i++) {
+        uint8_t data = write(tx ? tx[i] : 0xFF);
+        if (rx) {
+            rx[i] = data;
+        }
+    }
+}
+
+int SDSimTransport::block_async(const uint8_t *tx, uint8_t *rx, uint32_t length) {
+    if (!dma || _async_pending) {
+        return 1;
+    }
+    _async_tx = tx;
+    _async_rx = rx;
+    _async_length = length;
+    _async_start = clock->ns;
+    _async_pending = true;
+    return 0;
+}
+
+bool SDSimTransport::dma_complete(int result) {
+    if (!_async_pending) {
+        return false;
+    }
+    // the interrupt comes at the end of the transfer, the host was free meanwhile
+    uint32_t length = result == 0 ? _async_length : _async_length / 2;
+    uint64_t end = _async_start + length * _byte_ns();
+    if (clock->ns < end) {
+        clock->ns = end;
+    }
+    for (uint32_t i = 0; i < length; i++) {
+        uint8_t data = _exchange(_async_tx ? _async_tx[i] : 0xFF);
+        if (_async_rx) {
+            _async_rx[i] = data;
+        }
+    }
+    _async_pending = false;
+    complete(result);
+    return true;
+}
+
+// one turn of the host's wait loop takes a byte time
+void SDSimTransport::poll() {
+    if (!dma_poll || !_async_pending) {
+        return;
+    }
+    clock->ns += _byte_ns();
+    if (clock->ns >= _async_start + _async_length * _byte_ns()) {
+        dma_complete(0);
+    }
+}
+
+// one byte on the bus, at the time on the clock
+int SDSimTransport::_exchange(int value) {
+    bytes++;
+
+    if (removed) {
+        // no power: the card starts idle when it is put back
+        _ready = false;
+        _app = false;
+        _crc_on = false;
+        _init_polls = 0;
+        _mode = MODE_COMMAND;
+        _cmd_length = 0;
+        _out_count = 0;
+        _holds = 0;
+        _hold_running = false;
+        return 0xFF;
+    }
+    // a deselected card leaves MISO floating high and ignores MOSI
+    if (!_selected) {
+        return 0xFF;
+    }
+    int response = _pop();
+    _receive(value & 0xFF);
+    return response;
+}
+
+uint64_t SDSimTransport::_byte_ns() {
+    return hz > 0 ? 8000000000ULL / hz : 0;
+}
+
+int SDSimTransport::_pop() {
+    _hold_expire();
+    if (_out_count == 0 && _holds > 0) {
+        _hold_start();
+        return _hold_value[_hold_head];
+    }
+    if (_out_count == 0 && _mode == MODE_READ) {
+        // the block of a CMD17 read, or the next block of a CMD18 read
+        if (_block < _sectors) {
+            _push(0xFF);
+            _push(0xFE);
+            _push_data(_image + _block * SIM_BLOCK_SIZE, SIM_BLOCK_SIZE);
+            _block++;
+            if (_multiple) {
+                _hold(read_us, 0xFF);
+            } else {
+                _mode = MODE_COMMAND;
+            }
+        } else {
+            _push(0x08); // data error token: out of range
+        }
+    }
+    if (_out_count == 0) {
+        return 0xFF;
+    }
+    int value = _out[_out_head];
+    _out_head = (_out_head + 1) % sizeof(_out);
+    _out_count--;
+    if (_out_count == 0) {
+        _hold_start();
+    }
+    return value;
+}
+
+void SDSimTransport::_push(int value) {
+    if (_out_count < (int)sizeof(_out)) {
+        _out[(_out_head + _out_count) % sizeof(_out)] = value;
+        _out_count++;
+    }
+}
+
+void SDSimTransport::_push_block(const uint8_t *data, uint32_t length) {
+    for (uint32_t i = 0; i < length; i++) {
+        _push(data[i]);
+    }
+}
+
+// data block followed by its CRC16, which the card always sends
+void SDSimTransport::_push_data(const uint8_t *data, uint32_t length) {
+    uint16_t crc = sd_crc16(data, length);
+    _push_block(data, length);
+    if (corrupt_every > 0 && ++_blocks_sent % corrupt_every == 0) {
+        // a bit error on the bus: flip the first data bit after the CRC was taken
+        _out[(_out_head + _out_count - length) % sizeof(_out)] ^= 0x80;
+    }
+    _push(crc >> 8);
+    _push(crc & 0xFF);
+}
+
+void SDSimTransport::_push_busy(uint32_t us) {
+    if (hang) {
+        _hold_time(SIM_FOREVER, 0x00);
+        return;
+    }
+    _hold(us, 0x00);
+    _hold_time(busy_bytes * _byte_ns(), 0x00);
+}
+
+// us the card sends value for, after the queued bytes
+void SDSimTransport::_hold(uint32_t us, int value) {
+    _hold_time(hz > 0 ? us * 1000ULL : 0, value);
+}
+
+// after the holds made before, a hold of the same value grows the last one
+void SDSimTransport::_hold_time(uint64_t ns, int value) {
+    if (ns == 0) {
+        return;
+    }
+    int last = (_hold_head + _holds - 1) % SIM_HOLDS;
+    if (_holds == 0 || (_hold_value[last] != value && _holds < SIM_HOLDS)) {
+        last = (_hold_head + _holds) % SIM_HOLDS;
+        _hold_ns[last] = 0;
+        _hold_value[last] = value;
+        _holds++;
+    } else if (_hold_running && last == _hold_head) {
+        _hold_end = add_ns(_hold_end, ns);
+    }
+    _hold_ns[last] = add_ns(_hold_ns[last], ns);
+    if (_out_count == 0) {
+        _hold_start();
+    }
+}
+
+// the first hold starts once the queued bytes are out
+void SDSimTransport::_hold_start() {
+    if (_holds > 0 && !_hold_running) {
+        _hold_running = true;
+        _hold_end = add_ns(clock->ns, _hold_ns[_hold_head]);
+    }
+}
+
+// holds that are over by now, the next one starts where the last one ended
+void SDSimTransport::_hold_expire() {
+    while (_hold_running && clock->ns > _hold_end) {
+        _hold_head = (_hold_head + 1) % SIM_HOLDS;
+        _holds--;
+        _hold_running = _holds > 0;
+        if (_hold_running) {
+            _hold_end = add_ns(_hold_end, _hold_ns[_hold_head]);
+        }
+    }
+}
+
+// busy time to program a block
+uint32_t SDSimTransport::_program(uint32_t block) {
+    uint32_t us = program_us;
+    if (_pre_erase > 0) {
+        _pre_erase--;
+    } else if (!_erased(block)) {
+        us += overwrite_us;
+    }
+    _set_erased(block, false);
+
+    // open AUs, the most recently written first
+    uint32_t au = block / _au_sectors;
+    int open = open_aus < 1 ? 1 : open_aus > SIM_OPEN_AUS ? SIM_OPEN_AUS : open_aus;
+    int i = 0;
+    while (i < open - 1 && _open_au[i] != au) {
+        i++;
+    }
+    if (_open_au[i] != au) {
+        us += au_us;
+        au_switches++;
+    }
+    for (; i > 0; i--) {
+        _open_au[i] = _open_au[i - 1];
+    }
+    _open_au[0] = au;
+
+    if (gc_per_mille > 0) {
+        // xorshift32
+        if (seed == 0) {
+            seed = 1;
+        }
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        if (seed % 1000 < gc_per_mille) {
+            us += gc_us;
+            stalls++;
+        }
+    }
+    return us;
+}
+
+bool SDSimTransport::_erased(uint32_t block) {
+    return _erased_map[block >> 3] & (1 << (block & 7));
+}
+
+void SDSimTransport::_set_erased(uint32_t block, bool erased) {
+    if (erased) {
+        _erased_map[block >> 3] |= 1 << (block & 7);
+    } else {
+        _erased_map[block >> 3] &= ~(1 << (block & 7));
+    }
+}
+
+int SDSimTransport::_r1() {
+    return _ready ? 0x00 : R1_IDLE_STATE;
+}
+
+void SDSimTransport::_receive(int value) {
+    switch (_mode) {
+        case MODE_TOKEN:
+            if (value == (_multiple ? 0xFC : 0xFE)) {
+                _mode = MODE_DATA;
+                _data_length = 0;
+            } else if (_multiple && value == 0xFD) {
+                // stop tran: one byte, then busy while the card commits
+                _push(0xFF);
+                _push_busy(commit_us);
+                _pre_erase = 0;
+                _mode = MODE_COMMAND;
+            }
+            return;
+
+        case MODE_DATA:
+            _data[_data_length++] = value;
+            if (_data_length == SIM_BLOCK_SIZE + 2) {
+                uint16_t crc = (_data[SIM_BLOCK_SIZE] << 8) | _data[SIM_BLOCK_SIZE + 1];
+                if (_crc_on && crc != sd_crc16(_data, SIM_BLOCK_SIZE)) {
+                    _push(0xE0 | SIM_DATA_CRC_ERROR);
+                } else if (_block < _sectors) {
+                    memcpy(_image + _block * SIM_BLOCK_SIZE, _data, SIM_BLOCK_SIZE);
+                    _push(0xE0 | SIM_DATA_ACCEPTED);
+                    _push_busy(_program(_block) + (_multiple ? 0 : commit_us));
+                    _block++;
+                } else {
+                    _push(0xE0 | 0x0D); // write error
+                }
+                _mode = _multiple ? MODE_TOKEN : MODE_COMMAND;
+            }
+            return;
+
+        default:
+            break;
+    }
+
+    // command frame: 01xxxxxx, argument, crc
+    if (_cmd_length == 0 && (value & 0xC0) != 0x40) {
+        return;
+    }
+    _cmd[_cmd_length++] = value;
+    if (_cmd_length == 6) {
+        _cmd_length = 0;
+        _command();
+    }
+}
+
+void SDSimTransport::_command() {
+    int cmd = _cmd[0] & 0x3F;
+    uint32_t arg = (_cmd[1] << 24) | (_cmd[2] << 16) | (_cmd[3] << 8) | _cmd[4];
+    bool app = _app;
+    _app = false;
+
+    if (_crc_on && _cmd[5] != sd_crc7(_cmd, 5)) {
+        _push(0xFF);
+        _push(_r1() | R1_COM_CRC_ERROR);
+        return;
+    }
+
+    if (cmd == 12 && _mode == MODE_READ) {
+        // stop transmission: drop the block in flight, stuff byte, R1b
+        _out_count = 0;
+        _holds = 0;
+        _hold_running = false;
+        _mode = MODE_COMMAND;
+        _push(0xFF);
+        _push(_r1());
+        return;
+    }
+
+    // NCR, 1 to 8 bytes
+    int ncr = ncr_bytes < 1 ? 1 : ncr_bytes > 8 ? 8 : ncr_bytes;
+    for (int i = 0; i < ncr; i++) {
+        _push(0xFF);
+    }
+    switch (cmd) {
+        case 0:
+            hang = false;
+            _ready = false;
+            _crc_on = false;
+            _init_polls = 0;
+            _mode = MODE_COMMAND;
+            _out_count = 0;
+            _holds = 0;
+            _hold_running = false;
+            _push(0xFF);
+            _push(R1_IDLE_STATE);
+            break;
+
+        case 8:
+            _push(_r1());
+            _push(0x00);
+            _push(0x00);
+            _push((arg >> 8) & 0x0F);
+            _push(arg & 0xFF);
+            break;
+
+        case 9:
+            _push(_r1());
+            _push(0xFF);
+            _push(0xFE);
+            _push_data(_csd, sizeof(_csd));
+            break;
+
+        case 10:
+            _push(_r1());
+            _push(0xFF);
+            _push(0xFE);
+            _push_data(_cid, sizeof(_cid));
+            break;
+
+        case 13:
+            if (!app) {
+                _push(_r1() | R1_ILLEGAL_COMMAND);
+                break;
+            }
+            _push(_r1());
+            _push(0x00);                        // second byte of R2
+            _push(0xFF);
+            _push(0xFE);
+            _push_data(_ssr, sizeof(_ssr));
+            break;
+
+        case 41:
+            if (app && ++_init_polls >= 2) {
+                _ready = true;
+            }
+            _push(app ? _r1() : _r1() | R1_ILLEGAL_COMMAND);
+            break;
+
+        case 55:
+            _app = true;
+            _push(_r1());
+            break;
+
+        case 58:
+            _push(_r1());
+            _push((SIM_OCR >> 24) & 0xFF);
+            _push((SIM_OCR >> 16) & 0xFF);
+            _push((SIM_OCR >> 8) & 0xFF);
+            _push(SIM_OCR & 0xFF);
+            break;
+
+        case 17:
+        case 18:
+            if (arg >= _sectors) {
+                _push(_r1() | R1_ADDRESS_ERROR);
+                break;
+            }
+            _push(_r1());
+            _hold(read_us, 0xFF);
+            _block = arg;
+            _multiple = (cmd == 18);
+            _mode = MODE_READ;
+            break;
+
+        case 24:
+        case 25:
+            if (arg >= _sectors) {
+                _push(_r1() | R1_ADDRESS_ERROR);
+                break;
+            }
+            _push(_r1());
+            _block = arg;
+            _multiple = (cmd == 25);
+            if (!_multiple) {
+                _pre_erase = 0;
+            }
+            _mode = MODE_TOKEN;
+            break;
+
+        case 32:
+        case 33:
+            if (arg >= _sectors) {
+                _push(_r1() | R1_ADDRESS_ERROR);
+                break;
+            }
+            if (cmd == 32) {
+                _erase_start = arg;
+            } else {
+                _erase_end = arg;
+            }
+            _push(_r1());
+            break;
+
+        case 38:
+            if (_erase_end < _erase_start) {
+                _push(_r1() | R1_ERASE_SEQUENCE_ERROR);
+                break;
+            }
+            memset(_image + _erase_start * SIM_BLOCK_SIZE, 0, (_erase_end - _erase_start + 1) * SIM_BLOCK_SIZE);
+            for (uint32_t block = _erase_start; block <= _erase_end; block++) {
+                _set_erased(block, true);
+            }
+            _push(_r1());
+            _push_busy(erase_us);
+            break;
+
+        case 59:
+            _crc_on = arg & 1;
+            _push(_r1());
+            break;
+
+        case 23:
+            // ACMD23: blocks the next CMD25 may pre-erase
+            if (app) {
+                _pre_erase = arg & 0x7FFFFF;
+            }
+            _push(_r1());
+            break;
+
+        case 12:
+        case 16:
+            _push(_r1());
+            break;
+
+        default:
+            _push(_r1() | R1_ILLEGAL_COMMAND);
+            break;
+    }
+}
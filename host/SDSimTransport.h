@@ -0,0 +1,188 @@
+/* Simulated SD card in SPI mode, for running SDFileSystem on the host
+ */
+#ifndef MBED_SDSIMTRANSPORT_H
+#define MBED_SDSIMTRANSPORT_H
+
+#include "SDTransport.h"
+
+#define SIM_OPEN_AUS 4
+#define SIM_HOLDS    4
+
+/** Time of the simulated cards, in ns. Cards driven by one host share one
+ */
+struct SDSimClock {
+    SDSimClock() : ns(0) {}
+    uint64_t ns;
+};
+
+/** Simulated SDHC card in SPI mode, for running SDFileSystem on the host
+ *
+ * The card answers the SPI protocol byte by byte from a RAM image: CMD0, CMD8,
+ * CMD9, CMD10, CMD12, CMD16, CMD17, CMD18, CMD24, CMD25, CMD32, CMD33, CMD38,
+ * CMD55, CMD58, CMD59, ACMD13, ACMD23 and ACMD41. Erased blocks read as 0.
+ * block_async() is held pending, the way the DMA interrupt would arrive later
+ * on the target: poll() finishes it once the clock has reached the end of the
+ * transfer, or the caller finishes it with dma_complete() when dma_poll is
+ * false. With dma false there is no asynchronous path.
+ *
+ * The card keeps time on clock. Each byte the host clocks advances it by one
+ * byte time at the current SPI clock, a block_async() transfer takes its
+ * length without the host. The access time of reads and the busy time of
+ * writes and erases run on the clock, so cards sharing one clock program
+ * while the host talks to the other card. With one card the time is bus
+ * time, bytes * 8 / hz, waits included. The timing model is off by default
+ * and set through the public members:
+ *
+ * - read_us before each data block of a read (NAC)
+ * - program_us busy per written block, plus commit_us at the end of a CMD24
+ *   block or a CMD25 transfer, when the card programs its buffer
+ * - overwrite_us per block that was written since it was last erased, by
+ *   CMD38 or by the ACMD23 pre-erase count before CMD25
+ * - au_us when a write goes to an AU that is not among the open_aus AUs the
+ *   card keeps open, the most recently used are kept
+ * - a gc_us garbage collection stall after gc_per_mille of the written
+ *   blocks, drawn from a generator seeded with seed
+ *
+ * @code
+ * static uint8_t image[1024 * 1024];
+ * SDSimTransport card(image, sizeof(image) / 512);
+ * SDFileSystem sd(card, "sd");
+ * @endcode
+ */
+class SDSimTransport : public SDTransport {
+public:
+
+    /** Create the card
+     *
+     * @param image   card contents, sectors * 512 bytes
+     * @param sectors card size in 512 byte sectors, a multiple of 1024
+     */
+    SDSimTransport(uint8_t *image, uint32_t sectors);
+    virtual ~SDSimTransport();
+
+    virtual void select(bool selected);
+    virtual int write(int value);
+    virtual void block(const uint8_t *tx, uint8_t *rx, uint32_t length);
+    virtual void frequency(uint32_t hz);
+    virtual int block_async(const uint8_t *tx, uint8_t *rx, uint32_t length);
+
+    /** Finish the pending block_async() transfer and call the callback
+     *
+     * @param result passed to the callback. A failed transfer stops half way
+     *               through, like the GPDMA on an error
+     * @returns true when a transfer was pending
+     */
+    bool dma_complete(int result = 0);
+
+    /** Finish a pending block_async() that has ended by now, when dma_poll
+     * is set. Each call takes a byte time, like a turn of a wait loop
+     */
+    virtual void poll();
+
+    SDSimClock *clock;  // the card's own, or one shared with other cards
+    uint32_t hz;        // last clock set by the host
+    int busy_bytes;     // busy bytes the card sends after each programmed block
+    int corrupt_every;  // flip a bit in every n-th data block sent (0: never)
+    bool dma;           // block_async() available, else the host sends in place
+    bool dma_poll;      // poll() finishes block_async(), else only dma_complete()
+    bool hang;          // stay busy after programming a block, until CMD0 clears it
+    bool removed;       // pulled out: no answer, powered up again when put back
+    uint32_t bytes;     // bytes clocked on the bus, bytes * 8 / hz is bus time
+
+    // timing model, all 0 by default
+    int ncr_bytes;          // bytes before a command response, 1 to 8
+    uint32_t read_us;
+    uint32_t program_us;
+    uint32_t commit_us;
+    uint32_t overwrite_us;
+    uint32_t erase_us;      // busy per CMD38
+    uint32_t au_us;
+    int open_aus;           // 1 to SIM_OPEN_AUS
+    uint32_t gc_us;
+    uint32_t gc_per_mille;
+    uint32_t seed;
+
+    uint32_t stalls;        // garbage collection stalls so far
+    uint32_t au_switches;   // writes to an AU that was not open
+
+protected:
+
+    enum Mode {
+        MODE_COMMAND,   // waiting for a command
+        MODE_TOKEN,     // waiting for a data start token (CMD24, CMD25)
+        MODE_DATA,      // receiving a data block
+        MODE_READ       // sending blocks until CMD12 (CMD18)
+    };
+
+    int _exchange(int value);
+    uint64_t _byte_ns();
+    int _pop();
+    void _push(int value);
+    void _push_block(const uint8_t *data, uint32_t length);
+    void _push_data(const uint8_t *data, uint32_t length);
+    void _push_busy(uint32_t us);
+    void _hold(uint32_t us, int value);
+    void _hold_time(uint64_t ns, int value);
+    void _hold_start();
+    void _hold_expire();
+    uint32_t _program(uint32_t block);
+    bool _erased(uint32_t block);
+    void _set_erased(uint32_t block, bool erased);
+    void _receive(int value);
+    void _command();
+    int _r1();
+
+    uint8_t *_image;
+    uint32_t _sectors;
+    uint32_t _blocks_sent;
+    uint8_t _csd[16];
+    uint8_t _cid[16];
+    uint8_t _ssr[64];
+
+    bool _selected;
+    bool _app;          // CMD55 seen, next command is an ACMD
+    bool _ready;        // ACMD41 finished
+    bool _crc_on;       // CMD59
+    int _init_polls;
+
+    Mode _mode;
+    bool _multiple;     // CMD25 rather than CMD24
+    uint32_t _block;    // next block to read or write
+    uint32_t _erase_start;
+    uint32_t _erase_end;
+    uint32_t _pre_erase;    // blocks left of the ACMD23 count
+    uint8_t *_erased_map;   // one bit per block, set when erased
+    uint32_t _au_sectors;
+    uint32_t _open_au[SIM_OPEN_AUS];
+
+    uint8_t _cmd[6];
+    int _cmd_length;
+    uint8_t _data[512 + 2];
+    int _data_length;
+
+    // bytes the card sends next
+    uint8_t _out[1024];
+    int _out_head;
+    int _out_count;
+
+    // what the card sends once _out is empty, for access and busy times.
+    // Holds queue up in the order they were made, the first one runs from
+    // the time _out ran empty
+    uint64_t _hold_ns[SIM_HOLDS];
+    int _hold_value[SIM_HOLDS];
+    int _hold_head;
+    int _holds;
+    bool _hold_running;
+    uint64_t _hold_end;
+
+    SDSimClock _clock;
+
+    // pending block_async()
+    const uint8_t *_async_tx;
+    uint8_t *_async_rx;
+    uint32_t _async_length;
+    uint64_t _async_start;
+    bool _async_pending;
+};
+
+#endif
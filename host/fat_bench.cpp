@@ -0,0 +1,189 @@
+/* FAT layer benchmark on a disk image file
+ *
+ * Formats the image, writes captures the way main.cpp does (a BMP header,
+ * then one fwrite per row, and a line appended to a log file after each
+ * capture like sd_stats.txt), reads them back, lists the directory and mounts
+ * the volume again to check it. The files stay on the image, which Linux can
+ * mount to check them once more:
+ *
+ *   fat_bench [image] [size_mb] [cache_sectors] [preallocate] [fill_percent]
+ *   sudo mount -o loop,offset=<printed offset> fat_bench.img /mnt
+ *
+ * With preallocate 1 the captures get their clusters in one block when they
+ * are created (FATFileSystem::set_preallocate). fill_percent fills the volume
+ * with one file first and mounts it again, so the captures are allocated on
+ * a nearly full volume without a hint where the free space starts.
+ *
+ * Each phase prints its time and the sector traffic it caused. For a profile,
+ * build with make CXXFLAGS="-O2 -g -pg" and run gprof on build/fat_bench.
+ */
+#include "mbed.h"
+#include "ImageFileSystem.h"
+
+#define CAPTURES     20
+#define WIDTH        320
+#define HEIGHT       240
+#define ROW_BYTES    (WIDTH * 3 + WIDTH % 4)
+#define HEADER_BYTES 54
+
+static ImageFileSystem *image;
+static Timer timer;
+
+static void phase_start() {
+    image->reset_stats();
+    if (image->cache()) {
+        image->cache()->reset_stats();
+    }
+    timer.reset();
+}
+
+static void phase_end(const char *name, bool ok) {
+    int us = timer.read_us();
+    printf("%-10s %9d us %7u rd %8u sectors %7u wr %8u sectors %4u sync  %s\n", name, us,
+           image->reads, image->read_sectors, image->writes, image->written_sectors, image->syncs,
+           ok ? "ok" : "FAILED");
+}
+
+static uint8_t pixel(int capture, int row, int i) {
+    return (uint8_t)(capture * 31 + row * 7 + i);
+}
+
+static bool write_capture(int capture) {
+    char name[16];
+    snprintf(name, sizeof(name), "img%03d.bmp", capture);
+    FileHandle *fh = image->open(name, O_WRONLY | O_CREAT | O_TRUNC);
+    if (fh == NULL) {
+        return false;
+    }
+    static uint8_t row[ROW_BYTES];
+    memset(row, 0, HEADER_BYTES);
+    row[0] = 'B';
+    row[1] = 'M';
+    bool ok = fh->write(row, HEADER_BYTES) == HEADER_BYTES;
+    for (int y = 0; y < HEIGHT && ok; y++) {
+        for (int i = 0; i < ROW_BYTES; i++) {
+            row[i] = pixel(capture, y, i);
+        }
+        ok = fh->write(row, ROW_BYTES) == ROW_BYTES;
+    }
+    return fh->close() == 0 && ok;
+}
+
+static bool check_capture(int capture) {
+    char name[16];
+    snprintf(name, sizeof(name), "img%03d.bmp", capture);
+    FileHandle *fh = image->open(name, O_RDONLY);
+    if (fh == NULL) {
+        return false;
+    }
+    static uint8_t row[ROW_BYTES];
+    bool ok = fh->flen() == HEADER_BYTES + HEIGHT * ROW_BYTES
+            && fh->read(row, HEADER_BYTES) == HEADER_BYTES && row[0] == 'B';
+    for (int y = 0; y < HEIGHT && ok; y++) {
+        ok = fh->read(row, ROW_BYTES) == ROW_BYTES;
+        for (int i = 0; i < ROW_BYTES && ok; i++) {
+            ok = row[i] == pixel(capture, y, i);
+        }
+    }
+    fh->close();
+    return ok;
+}
+
+// a line of statistics after each capture, appended like sd_stats.txt
+static bool append_log(int capture) {
+    FileHandle *fh = image->open("log.txt", O_WRONLY | O_CREAT | O_APPEND);
+    if (fh == NULL) {
+        return false;
+    }
+    char line[128];
+    int length = snprintf(line, sizeof(line), "img%03d.bmp %d rows %-80s\n", capture, HEIGHT, "stats");
+    bool ok = fh->write(line, length) == length;
+    return fh->close() == 0 && ok;
+}
+
+static bool check_all() {
+    bool ok = true;
+    for (int c = 0; c < CAPTURES; c++) {
+        ok = check_capture(c) && ok;
+    }
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    const char *path = argc > 1 ? argv[1] : "fat_bench.img";
+    uint32_t size_mb = argc > 2 ? atoi(argv[2]) : 64;
+    int cache_sectors = argc > 3 ? atoi(argv[3]) : 0;
+    bool preallocate = argc > 4 && atoi(argv[4]) != 0;
+    int fill_percent = argc > 5 ? atoi(argv[5]) : 0;
+
+    image = new ImageFileSystem(path, "sd", size_mb * 2048);
+    if (image->disk_initialize() != 0) {
+        return 1;
+    }
+    if (cache_sectors > 0) {
+        image->set_cache(cache_sectors);
+    }
+    if (preallocate) {
+        image->set_preallocate(HEADER_BYTES + HEIGHT * ROW_BYTES);
+    }
+    timer.start();
+    printf("%s: %u MB, %d captures of %d bytes, %d cache sectors%s\n", path, size_mb, CAPTURES,
+           HEADER_BYTES + HEIGHT * ROW_BYTES, cache_sectors, preallocate ? ", preallocated" : "");
+
+    phase_start();
+    bool ok = image->format() == 0 && image->mount() == 0;
+    phase_end("format", ok);
+    if (!ok) {
+        return 1;
+    }
+
+    if (fill_percent > 0) {
+        phase_start();
+        static uint8_t chunk[32 * 1024];
+        uint32_t chunks = (uint64_t)image->disk_sectors() * 512 / 100 * fill_percent / sizeof(chunk);
+        FileHandle *fh = image->open("fill.bin", O_WRONLY | O_CREAT | O_TRUNC);
+        ok = fh != NULL;
+        for (uint32_t i = 0; i < chunks && ok; i++) {
+            ok = fh->write(chunk, sizeof(chunk)) == sizeof(chunk);
+        }
+        ok = ok && fh->close() == 0 && image->unmount() == 0 && image->mount() == 0;
+        phase_end("fill", ok);
+    }
+
+    phase_start();
+    ok = true;
+    for (int c = 0; c < CAPTURES; c++) {
+        ok = write_capture(c) && append_log(c) && ok;
+    }
+    phase_end("write", ok);
+
+    phase_start();
+    ok = check_all();
+    phase_end("read", ok);
+
+    phase_start();
+    int files = 0;
+    DirHandle *dir = image->opendir("/");
+    if (dir) {
+        while (dir->readdir() != NULL) {
+            files++;
+        }
+        dir->closedir();
+    }
+    phase_end("list", files == CAPTURES + 1 + (fill_percent > 0));
+
+    phase_start();
+    ok = image->unmount() == 0 && image->mount() == 0 && check_all();
+    phase_end("remount", ok);
+
+    if (image->cache()) {
+        SectorCache *cache = image->cache();
+        printf("cache: %u hits, %u misses, %u writes, %u flushes\n", cache->hits, cache->misses,
+               cache->writes, cache->flushes);
+    }
+    image->unmount();
+    uint32_t offset = image->partition_offset();
+    delete image;
+    printf("sudo mount -o loop,offset=%u %s /mnt\n", offset, path);
+    return 0;
+}
@@ -0,0 +1,130 @@
+/* Regression tests of the FAT layer on a disk image file
+ *
+ *   fat_test [image]
+ */
+#include "mbed.h"
+#include "ImageFileSystem.h"
+#include "ff.h"
+#include "test.h"
+
+#define IMAGE_SECTORS (8 * 2048)       // 8MB
+
+static ImageFileSystem *image;
+
+static bool write_file(const char *name, uint32_t bytes) {
+    static uint8_t chunk[16 * 1024];
+    FileHandle *fh = image->open(name, O_WRONLY | O_CREAT | O_TRUNC);
+    if (fh == NULL) {
+        return false;
+    }
+    bool ok = true;
+    for (uint32_t done = 0; done < bytes && ok; done += sizeof(chunk)) {
+        size_t n = bytes - done < sizeof(chunk) ? bytes - done : sizeof(chunk);
+        memset(chunk, (uint8_t)(done / sizeof(chunk)), n);
+        ok = fh->write(chunk, n) == (ssize_t)n;
+    }
+    return fh->close() == 0 && ok;
+}
+
+// fills the volume with one file until a write comes back short
+static void fill(const char *name) {
+    static uint8_t chunk[16 * 1024];
+    FileHandle *fh = image->open(name, O_WRONLY | O_CREAT | O_TRUNC);
+    if (fh == NULL) {
+        return;
+    }
+    while (fh->write(chunk, sizeof(chunk)) == sizeof(chunk)) {
+    }
+    fh->close();
+}
+
+static DWORD first_cluster(const char *name) {
+    char path[32];
+    snprintf(path, sizeof(path), "0:/%s", name);
+    FIL fil;
+    if (f_open(&fil, path, FA_READ) != FR_OK) {
+        return 0;
+    }
+    DWORD clst = fil.sclust;
+    f_close(&fil);
+    return clst;
+}
+
+static void format() {
+    CHECK(image->format() == 0);
+    CHECK(image->mount() == 0);
+}
+
+// the free block around the search start reaches the end of the FAT and is
+// too small: f_expand used to search forever after the wrap
+static void expand_no_block() {
+    test_start("expand: free block too small up to the end of the FAT");
+    format();
+    CHECK(write_file("a.bin", 6400 * 1024));
+    CHECK(write_file("b.bin", 16 * 1024));
+    CHECK(image->remove("b.bin") == 0);
+
+    FIL fil;
+    CHECK(f_open(&fil, "0:/c.bin", FA_WRITE | FA_CREATE_ALWAYS) == FR_OK);
+    CHECK(f_expand(&fil, 7 * 1024 * 1024, 1) == FR_DENIED);
+    CHECK(fil.fsize == 0 && fil.sclust == 0);
+    CHECK(f_close(&fil) == FR_OK);
+
+    // open() falls back to a file that grows as it is written
+    image->set_preallocate(7 * 1024 * 1024);
+    FileHandle *fh = image->open("c.bin", O_WRONLY | O_CREAT | O_TRUNC);
+    image->set_preallocate(0);
+    CHECK(fh != NULL);
+    if (fh) {
+        CHECK(fh->flen() == 0);
+        CHECK(fh->write("data", 4) == 4);
+        CHECK(fh->close() == 0);
+    }
+}
+
+// the only block large enough starts before the search start
+static void expand_block_before_start() {
+    test_start("expand: block that starts before the search start");
+    format();
+    CHECK(write_file("a.bin", 1024 * 1024));
+    CHECK(write_file("b.bin", 2 * 1024 * 1024));
+    fill("c.bin");
+    DWORD b = first_cluster("b.bin");
+    CHECK(b >= 2);
+    CHECK(image->remove("b.bin") == 0);
+
+    FATFS *fs = &image->_fs;
+    DWORD clusters = 2 * 1024 * 1024 / (fs->csize * 512);
+    fs->last_clust = b + clusters / 2;
+
+    FIL fil;
+    CHECK(f_open(&fil, "0:/d.bin", FA_WRITE | FA_CREATE_ALWAYS) == FR_OK);
+    CHECK(f_expand(&fil, 2 * 1024 * 1024, 1) == FR_OK);
+    CHECK(fil.sclust == b);
+    CHECK(f_close(&fil) == FR_OK);
+}
+
+// a volume without any free cluster
+static void expand_full() {
+    test_start("expand: full volume");
+    format();
+    fill("a.bin");
+    FIL fil;
+    CHECK(f_open(&fil, "0:/b.bin", FA_WRITE | FA_CREATE_ALWAYS) == FR_OK);
+    CHECK(f_expand(&fil, 64 * 1024, 1) == FR_DENIED);
+    CHECK(f_close(&fil) == FR_OK);
+}
+
+int main(int argc, char **argv) {
+    const char *path = argc > 1 ? argv[1] : "fat_test.img";
+    image = new ImageFileSystem(path, "sd", IMAGE_SECTORS);
+    if (image->disk_initialize() != 0) {
+        return 1;
+    }
+    expand_no_block();
+    expand_block_before_start();
+    expand_full();
+    image->unmount();
+    delete image;
+    return test_result();
+}
@@ -0,0 +1,25 @@
+/* Host stand-in for the mbed DirHandle interface, struct dirent is the one
+ * of the C library
+ */
+#ifndef MBED_HOST_DIRHANDLE_H
+#define MBED_HOST_DIRHANDLE_H
+
+#include <sys/types.h>
+#include <dirent.h>
+
+namespace mbed {
+
+class DirHandle {
+public:
+    virtual ~DirHandle() {}
+
+    virtual int closedir() = 0;
+    virtual struct dirent *readdir() = 0;
+    virtual void rewinddir() = 0;
+    virtual off_t telldir() { return -1; }
+    virtual void seekdir(off_t location) {}
+};
+
+} // namespace mbed
+
+#endif
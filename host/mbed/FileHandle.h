@@ -0,0 +1,25 @@
+/* Host stand-in for the mbed FileHandle interface
+ */
+#ifndef MBED_HOST_FILEHANDLE_H
+#define MBED_HOST_FILEHANDLE_H
+
+#include <sys/types.h>
+
+namespace mbed {
+
+class FileHandle {
+public:
+    virtual ~FileHandle() {}
+
+    virtual ssize_t write(const void *buffer, size_t length) = 0;
+    virtual int close() = 0;
+    virtual ssize_t read(void *buffer, size_t length) = 0;
+    virtual int isatty() = 0;
+    virtual off_t lseek(off_t offset, int whence) = 0;
+    virtual int fsync() = 0;
+    virtual off_t flen() = 0;
+};
+
+} // namespace mbed
+
+#endif
@@ -0,0 +1,36 @@
+/* Host stand-in for the mbed FileSystemLike base class
+ *
+ * On the target the name mounts the filesystem under "/<name>/" for fopen();
+ * on the host it is only kept, files are opened through open().
+ */
+#ifndef MBED_HOST_FILESYSTEMLIKE_H
+#define MBED_HOST_FILESYSTEMLIKE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include "FileHandle.h"
+#include "DirHandle.h"
+
+namespace mbed {
+
+class FileSystemLike {
+public:
+    FileSystemLike(const char *name) : _name(name) {}
+    virtual ~FileSystemLike() {}
+
+    const char *getName() { return _name; }
+
+    virtual FileHandle *open(const char *filename, int flags) = 0;
+    virtual int remove(const char *filename) { return -1; }
+    virtual int rename(const char *oldname, const char *newname) { return -1; }
+    virtual DirHandle *opendir(const char *name) { return NULL; }
+    virtual int mkdir(const char *name, mode_t mode) { return -1; }
+
+protected:
+    const char *_name;
+};
+
+} // namespace mbed
+
+#endif
@@ -0,0 +1,68 @@
+/* Host implementation of the mbed stand-ins in mbed.h
+ */
+#include "mbed.h"
+#include <stdarg.h>
+
+void error(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    exit(1);
+}
+
+void wait(float s) {
+    wait_us((int)(s * 1000000));
+}
+
+void wait_ms(int ms) {
+    wait_us(ms * 1000);
+}
+
+void wait_us(int us) {
+    if (us <= 0) {
+        return;
+    }
+    struct timespec t;
+    t.tv_sec = us / 1000000;
+    t.tv_nsec = (us % 1000000) * 1000L;
+    nanosleep(&t, NULL);
+}
+
+Timer::Timer() : _start_us(0), _total_us(0), _running(false) {}
+
+int64_t Timer::_now_us() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+void Timer::start() {
+    if (!_running) {
+        _start_us = _now_us();
+        _running = true;
+    }
+}
+
+void Timer::stop() {
+    if (_running) {
+        _total_us += _now_us() - _start_us;
+        _running = false;
+    }
+}
+
+void Timer::reset() {
+    _start_us = _now_us();
+    _total_us = 0;
+}
+
+int Timer::read_us() {
+    int64_t us = _total_us;
+    if (_running) {
+        us += _now_us() - _start_us;
+    }
+    return (int)us;
+}
+
+int Timer::read_ms() { return read_us() / 1000; }
+float Timer::read() { return read_us() / 1000000.0f; }
@@ -0,0 +1,136 @@
+/* Host (Linux) stand-in for the parts of the mbed 2 API that the SD card,
+ * FAT and OV7670 libraries use, so they can be built and benchmarked on a PC.
+ *
+ * There is no SPI bus on the host: SDSPITransport compiles without its SSP and
+ * GPDMA paths and reads 0xFF, the cards are SDSimTransport instances. The
+ * I2C bus has one register file behind it, enough for the OV7670 register
+ * code; the camera pins never change.
+ */
+#ifndef MBED_HOST_MBED_H
+#define MBED_HOST_MBED_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include "mbed_debug.h"
+
+using std::min;
+using std::max;
+
+enum PinName {
+    p5 = 5, p6, p7, p8, p9, p10, p11, p12, p13, p14, p15, p16, p17, p18, p19,
+    p20, p21, p22, p23, p24, p25, p26, p27, p28, p29, p30,
+    LED1, LED2, LED3, LED4, USBTX, USBRX,
+    NC = -1
+};
+
+// fatal error, mbed stops here
+void error(const char* format, ...);
+
+void wait(float s);
+void wait_ms(int ms);
+void wait_us(int us);
+
+/** Microsecond timer on CLOCK_MONOTONIC
+ */
+class Timer {
+public:
+    Timer();
+    void start();
+    void stop();
+    void reset();
+    float read();
+    int read_ms();
+    int read_us();
+
+protected:
+    int64_t _now_us();
+    int64_t _start_us;
+    int64_t _total_us;
+    bool _running;
+};
+
+namespace mbed {
+
+/** SPI master without a bus: every byte reads back 0xFF (no card)
+ */
+class SPI {
+public:
+    SPI(PinName mosi, PinName miso, PinName sclk) {}
+    void format(int bits, int mode = 0) {}
+    void frequency(int hz = 1000000) {}
+    int write(int value) { return 0xFF; }
+};
+
+/** I2C master with one device on the bus that stores the bytes written after
+ * a register address and reads them back, the way SCCB devices do
+ */
+class I2C {
+public:
+    I2C(PinName sda, PinName scl) : hz(100000), _count(0), _address(0), _reg(0) {
+        memset(regs, 0, sizeof(regs));
+    }
+    void frequency(int hz) { this->hz = hz; }
+    int start() { _count = 0; return 0; }
+    int stop() { return 0; }
+    int write(int data) {
+        if (_count == 0) {
+            _address = data;
+        } else if (_count == 1) {
+            _reg = (uint8_t)data;
+        } else {
+            regs[_reg++] = (uint8_t)data;
+        }
+        _count++;
+        return 1;
+    }
+    int read(int ack) { return regs[_reg]; }
+
+    uint8_t regs[256];
+    int hz;             // last clock set, mbed starts at 100 kHz
+
+protected:
+    int _count;         // bytes written since start
+    int _address;
+    uint8_t _reg;
+};
+
+class InterruptIn {
+public:
+    InterruptIn(PinName pin) {}
+    template<typename T> void rise(T *object, void (T::*method)()) {}
+    template<typename T> void fall(T *object, void (T::*method)()) {}
+    void rise(void (*function)()) {}
+    void fall(void (*function)()) {}
+};
+
+class BusIn {
+public:
+    BusIn(PinName p0, PinName p1 = NC, PinName p2 = NC, PinName p3 = NC,
+          PinName p4 = NC, PinName p5 = NC, PinName p6 = NC, PinName p7 = NC) {}
+    int read() { return 0; }
+    operator int() { return 0; }
+};
+
+class DigitalOut {
+public:
+    DigitalOut(PinName pin, int value = 0) : _value(value) {}
+    void write(int value) { _value = value; }
+    int read() { return _value; }
+    DigitalOut &operator=(int value) { _value = value; return *this; }
+    operator int() { return _value; }
+
+protected:
+    int _value;
+};
+
+} // namespace mbed
+
+using namespace mbed;
+
+#endif
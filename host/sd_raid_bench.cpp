@@ -0,0 +1,150 @@
+/* Write and read throughput of one simulated SD card against two cards
+ * striped or mirrored by SDRaidFileSystem.
+ *
+ * The cards of a run share one SDSimClock: bytes the host clocks take their
+ * bus time, a DMA transfer runs while the host does something else and the
+ * cards program while the host talks to the other card. The time of a layout
+ * is the time on that clock, so whatever the two cards overlap is what the
+ * driver got out of them. Writes go through disk_write_async() and DMA
+ * completed by SDTransport::poll(), reads are synchronous.
+ *
+ *   sd_raid_bench [busy_bytes]
+ *
+ * busy_bytes is the busy time a card signals after each programmed block, in
+ * bytes of bus time (0.32us each at 25MHz). The card columns are the bus
+ * time of each card while writing.
+ */
+#include "mbed.h"
+#include "SDFileSystem.h"
+#include "SDRaidFileSystem.h"
+#include "SDSimTransport.h"
+
+#define CARD_SECTORS   (64 * 1024)     // 32MB per card
+#define CHUNK_SECTORS  128             // 64KB per disk_write, like a frame
+#define TOTAL_SECTORS  (16 * 1024)     // 8MB per run
+
+static uint8_t *card_image[3];
+
+struct Result {
+    double write_mbps;
+    double read_mbps;
+    double write_ms[2];     // bus time of each card
+    bool ok;
+};
+
+static double bus_seconds(uint32_t bytes, uint32_t hz) {
+    return hz > 0 ? bytes * 8.0 / hz : 0;
+}
+
+static double clock_seconds(SDSimTransport *card, uint64_t start) {
+    return (card->clock->ns - start) / 1e9;
+}
+
+// write and read back TOTAL_SECTORS through disk_write / disk_read
+static void run(FATFileSystem &disk, SDSimTransport *card[], int cards, Result &result) {
+    static uint8_t buffer[CHUNK_SECTORS * 512];
+    static uint8_t check[CHUNK_SECTORS * 512];
+
+    uint32_t start[2];
+    for (int i = 0; i < cards; i++) {
+        start[i] = card[i]->bytes;
+    }
+    uint64_t start_ns = card[0]->clock->ns;
+    result.ok = true;
+    for (uint32_t sector = 0; sector < TOTAL_SECTORS; sector += CHUNK_SECTORS) {
+        for (uint32_t i = 0; i < sizeof(buffer); i++) {
+            buffer[i] = (uint8_t)(sector * 7 + i * 13);
+        }
+        if (disk.disk_write(buffer, sector, CHUNK_SECTORS) != 0) {
+            result.ok = false;
+        }
+    }
+    disk.disk_sync();
+
+    double write_s = clock_seconds(card[0], start_ns);
+    for (int i = 0; i < 2; i++) {
+        result.write_ms[i] = i < cards ? bus_seconds(card[i]->bytes - start[i], card[i]->hz) * 1000 : 0;
+    }
+
+    start_ns = card[0]->clock->ns;
+    for (uint32_t sector = 0; sector < TOTAL_SECTORS; sector += CHUNK_SECTORS) {
+        if (disk.disk_read(check, sector, CHUNK_SECTORS) != 0) {
+            result.ok = false;
+        }
+        for (uint32_t i = 0; i < sizeof(check); i++) {
+            if (check[i] != (uint8_t)(sector * 7 + i * 13)) {
+                result.ok = false;
+                break;
+            }
+        }
+    }
+    double read_s = clock_seconds(card[0], start_ns);
+
+    double mb = TOTAL_SECTORS * 512.0 / 1000000;
+    result.write_mbps = write_s > 0 ? mb / write_s : 0;
+    result.read_mbps = read_s > 0 ? mb / read_s : 0;
+}
+
+static void print(const char *name, Result &result) {
+    printf("%-22s %8.2f %8.2f %10.1f %10.1f  %s\n", name, result.write_mbps, result.read_mbps,
+           result.write_ms[0], result.write_ms[1], result.ok ? "ok" : "FAILED");
+}
+
+int main(int argc, char **argv) {
+    int busy_bytes = argc > 1 ? atoi(argv[1]) : 200;
+    for (int i = 0; i < 3; i++) {
+        card_image[i] = (uint8_t *)calloc(CARD_SECTORS, 512);
+    }
+
+    printf("%d sectors in %d sector writes, %d busy bytes per block\n", TOTAL_SECTORS, CHUNK_SECTORS, busy_bytes);
+    printf("%-22s %8s %8s %10s %10s\n", "layout", "write", "read", "card0", "card1");
+    printf("%-22s %8s %8s %10s %10s\n", "", "MB/s", "MB/s", "write ms", "write ms");
+
+    for (int streaming = 0; streaming < 2; streaming++) {
+        // one card
+        {
+            SDSimTransport card(card_image[0], CARD_SECTORS);
+            card.busy_bytes = busy_bytes;
+            SDFileSystem sd(card, "sd");
+            sd.disk_initialize();
+            sd.set_streaming(streaming);
+            SDSimTransport *cards[1] = { &card };
+            Result result;
+            run(sd, cards, 1, result);
+            print(streaming ? "single, streaming" : "single", result);
+        }
+
+        // two cards
+        const int layouts[3][2] = {
+            { SD_RAID_STRIPE, 64 }, { SD_RAID_STRIPE, 16 }, { SD_RAID_MIRROR, 0 }
+        };
+        for (int l = 0; l < 3; l++) {
+            SDSimTransport card0(card_image[1], CARD_SECTORS);
+            SDSimTransport card1(card_image[2], CARD_SECTORS);
+            card0.busy_bytes = card1.busy_bytes = busy_bytes;
+            card1.clock = card0.clock;
+            SDFileSystem sd0(card0, NULL);
+            SDFileSystem sd1(card1, NULL);
+            SDRaidFileSystem raid(sd0, sd1, "raid", layouts[l][0], layouts[l][1]);
+            raid.disk_initialize();
+            sd0.set_streaming(streaming);
+            sd1.set_streaming(streaming);
+            SDSimTransport *cards[2] = { &card0, &card1 };
+            Result result;
+            run(raid, cards, 2, result);
+
+            char name[32];
+            if (layouts[l][0] == SD_RAID_MIRROR) {
+                snprintf(name, sizeof(name), "mirror%s", streaming ? ", streaming" : "");
+            } else {
+                snprintf(name, sizeof(name), "stripe %d%s", layouts[l][1], streaming ? ", streaming" : "");
+            }
+            print(name, result);
+        }
+    }
+
+    for (int i = 0; i < 3; i++) {
+        free(card_image[i]);
+    }
+    return 0;
+}
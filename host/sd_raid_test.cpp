@@ -0,0 +1,127 @@
+/* Tests of SDRaidFileSystem on two simulated cards
+ *
+ * A card fails by being pulled out (SDSimTransport::removed) and comes back
+ * with the data it had then, so reads show which card the mirror trusts.
+ *
+ *   sd_raid_test
+ */
+#include "mbed.h"
+#include "SDFileSystem.h"
+#include "SDRaidFileSystem.h"
+#include "SDSimTransport.h"
+#include "test.h"
+
+#define CARD_SECTORS (8 * 1024)     // 4MB
+#define SECTOR       100
+#define COUNT        64
+
+static uint8_t card_image[2][CARD_SECTORS * 512];
+
+static bool write(FATFileSystem &disk, uint8_t gen) {
+    static uint8_t buffer[COUNT * 512];
+    test_pattern(buffer, SECTOR, COUNT, gen);
+    return disk.disk_write(buffer, SECTOR, COUNT) == 0 && disk.disk_sync() == 0;
+}
+
+static bool check(FATFileSystem &disk, uint8_t gen) {
+    return test_check(disk, SECTOR, COUNT, gen);
+}
+
+// two new cards
+struct Mirror {
+    Mirror() : card0(card_image[0], CARD_SECTORS), card1(card_image[1], CARD_SECTORS),
+        sd0(card0, NULL), sd1(card1, NULL), raid(sd0, sd1, NULL, SD_RAID_MIRROR) {
+        card1.clock = card0.clock;
+    }
+    SDSimTransport card0;
+    SDSimTransport card1;
+    SDFileSystem sd0;
+    SDFileSystem sd1;
+    SDRaidFileSystem raid;
+};
+
+static void failover() {
+    test_start("mirror: a card fails and stays out until rebuilt");
+    memset(card_image, 0, sizeof(card_image));
+    Mirror m;
+    CHECK(m.raid.disk_initialize() == 0);
+    CHECK(m.raid.failed() == 0);
+    CHECK(write(m.raid, 1));
+
+    // writes carry on with one card
+    m.card1.removed = true;
+    CHECK(write(m.raid, 2));
+    CHECK(m.raid.failed() == 2);
+    CHECK(check(m.raid, 2));
+
+    // back with the old data: not trusted after a reinit or a restart
+    m.card1.removed = false;
+    CHECK(m.raid.disk_initialize() == 0);
+    CHECK(m.raid.failed() == 2);
+    CHECK(check(m.raid, 2));
+    CHECK(check(m.sd1, 1));
+    {
+        SDRaidFileSystem restarted(m.sd0, m.sd1, NULL, SD_RAID_MIRROR);
+        CHECK(restarted.disk_initialize() == 0);
+        CHECK(restarted.failed() == 2);
+        CHECK(check(restarted, 2));
+    }
+
+    CHECK(m.raid.rebuild(0) == -1);
+    CHECK(m.raid.rebuild(1) == 0);
+    CHECK(m.raid.failed() == 0);
+    CHECK(check(m.sd1, 2));
+
+    // the rebuilt card carries the mirror alone
+    m.card0.removed = true;
+    CHECK(check(m.raid, 2));
+    CHECK(m.raid.failed() == 1);
+    CHECK(write(m.raid, 3));
+    CHECK(check(m.sd1, 3));
+}
+
+static void degraded_start() {
+    test_start("mirror: started without one card");
+    memset(card_image, 0, sizeof(card_image));
+    Mirror m;
+    m.card1.removed = true;
+    CHECK(m.raid.disk_initialize() == 0);
+    CHECK(m.raid.failed() == 2);
+    CHECK(write(m.raid, 1));
+    CHECK(check(m.raid, 1));
+
+    // a blank card is not taken in as it is
+    m.card1.removed = false;
+    CHECK(m.raid.disk_initialize() == 0);
+    CHECK(m.raid.failed() == 2);
+    CHECK(m.raid.rebuild(1) == 0);
+    CHECK(m.raid.failed() == 0);
+    CHECK(check(m.sd1, 1));
+}
+
+static void both_fail() {
+    test_start("mirror: both cards fail");
+    memset(card_image, 0, sizeof(card_image));
+    Mirror m;
+    CHECK(m.raid.disk_initialize() == 0);
+    CHECK(write(m.raid, 1));
+    m.card1.removed = true;
+    CHECK(write(m.raid, 2));
+    m.card0.removed = true;
+    CHECK(!write(m.raid, 3));
+    CHECK(m.raid.failed() == 3);
+
+    // the card that left last has the data
+    m.card0.removed = false;
+    m.card1.removed = false;
+    CHECK(m.raid.disk_initialize() == 0);
+    CHECK(m.raid.failed() == 2);
+    CHECK(check(m.raid, 2));
+}
+
+int main() {
+    failover();
+    degraded_start();
+    both_fail();
+    return test_result();
+}
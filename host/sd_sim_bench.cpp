@@ -0,0 +1,287 @@
+/* Write strategies of the SD driver on a simulated card with a timing model
+ *
+ * The card needs time to access and program blocks, pays for overwriting
+ * blocks that were not erased and for switching AUs, and stalls now and then
+ * for garbage collection (see SDSimTransport). Every workload runs in every
+ * driver mode on a new card with the same seed. Times are bus time: bytes
+ * clocked * 8 / SPI clock, which includes all waits for the card.
+ *
+ *   sd_sim_bench [gc_per_mille] [seed]
+ *
+ * For each run it prints the throughput, the median, 99th percentile and
+ * longest time of one call (disk_write, or fwrite for the captures), the
+ * garbage collection stalls and the AU switches.
+ */
+#include "mbed.h"
+#include "SDFileSystem.h"
+#include "SDSimTransport.h"
+#include "test.h"
+
+#include <algorithm>
+
+#define CARD_SECTORS   (128 * 1024)    // 64MB, 4MB AUs
+#define REGION_SECTORS (64 * 1024)     // raw workloads stay in the first 32MB, 8 AUs
+#define MAX_CALLS      16384
+
+#define CAPTURES       10
+#define ROW_BYTES      960             // 320 pixels RGB888, like main.cpp
+#define ROWS           240
+#define HEADER_BYTES   54
+#define ERASED         0xFF
+
+static uint8_t *card_image;
+static uint8_t generation[REGION_SECTORS];  // last pattern written per sector, ERASED
+static uint32_t gc_per_mille = 2;
+static uint32_t seed = 1;
+
+// card that takes its time, roughly a class 10 card with a small controller
+static void card_model(SDSimTransport &card) {
+    card.dma = false;
+    card.busy_bytes = 1;
+    card.ncr_bytes = 2;
+    card.read_us = 300;
+    card.program_us = 20;
+    card.commit_us = 700;
+    card.overwrite_us = 250;
+    card.erase_us = 3000;
+    card.au_us = 4000;
+    card.open_aus = 2;
+    card.gc_us = 60000;
+    card.gc_per_mille = gc_per_mille;
+    card.seed = seed;
+}
+
+// times of the calls of one run
+struct Run {
+    SDSimTransport *card;
+    uint32_t start;
+    uint32_t us;
+    uint32_t call_start;
+    uint32_t calls;
+    uint32_t call_us[MAX_CALLS];
+    uint32_t stalls;
+    uint32_t au_switches;
+    uint32_t bytes;             // payload
+    bool ok;
+};
+
+static Run run;
+
+static uint32_t bus_us(uint32_t bytes) {
+    return run.card->hz > 0 ? (uint32_t)((uint64_t)bytes * 8000000 / run.card->hz) : 0;
+}
+
+static void run_start(SDSimTransport *card) {
+    run.card = card;
+    run.calls = 0;
+    run.bytes = 0;
+    run.ok = true;
+    run.stalls = card->stalls;
+    run.au_switches = card->au_switches;
+    run.start = card->bytes;
+}
+
+static void call_start() {
+    run.call_start = run.card->bytes;
+}
+
+static void call_end(bool ok) {
+    if (run.calls < MAX_CALLS) {
+        run.call_us[run.calls++] = bus_us(run.card->bytes - run.call_start);
+    }
+    run.ok = run.ok && ok;
+}
+
+static void run_stop() {
+    run.us = bus_us(run.card->bytes - run.start);
+}
+
+static void run_end(const char *workload, const char *mode) {
+    uint32_t us = run.us;
+    std::sort(run.call_us, run.call_us + run.calls);
+    uint32_t p50 = run.calls ? run.call_us[run.calls / 2] : 0;
+    uint32_t p99 = run.calls ? run.call_us[run.calls * 99 / 100] : 0;
+    uint32_t max = run.calls ? run.call_us[run.calls - 1] : 0;
+    printf("%-10s %-16s %7.2f %8.2f %8.2f %8.2f %6u %6u  %s\n", workload, mode,
+           us ? run.bytes / (double)us : 0, p50 / 1000.0, p99 / 1000.0, max / 1000.0,
+           run.card->stalls - run.stalls, run.card->au_switches - run.au_switches,
+           run.ok ? "ok" : "FAILED");
+}
+
+static void pattern(uint8_t *buffer, uint32_t sector, uint32_t count, uint8_t gen) {
+    test_pattern(buffer, sector, count, gen);
+    memset(generation + sector, gen, count);
+}
+
+static bool verify(SDFileSystem &sd) {
+    static uint8_t buffer[128 * 512];
+    static uint8_t expect[512];
+    for (uint32_t sector = 0; sector < REGION_SECTORS; sector += 128) {
+        if (sd.disk_read(buffer, sector, 128) != 0) {
+            return false;
+        }
+        for (uint32_t s = 0; s < 128; s++) {
+            if (generation[sector + s] == ERASED) {
+                memset(expect, 0, sizeof(expect));
+            } else {
+                pattern(expect, sector + s, 1, generation[sector + s]);
+            }
+            if (memcmp(expect, buffer + s * 512, 512) != 0) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+enum Mode {
+    MODE_SINGLE,        // one disk_write per sector (CMD24)
+    MODE_MULTI,         // one disk_write per call (ACMD23, CMD25)
+    MODE_STREAM,        // contiguous calls continue one CMD25
+    MODE_ERASE_STREAM,  // erase the region first (CMD38), then stream
+    MODES
+};
+
+static const char *mode_names[MODES] = { "single", "multi", "stream", "erase+stream" };
+
+enum Workload {
+    SEQ_64K,            // 2MB in 64KB calls
+    SEQ_4K,             // 2MB in 4KB calls
+    RANDOM_4K,          // 1MB in 4KB calls at random places
+    WORKLOADS
+};
+
+static const char *workload_names[WORKLOADS] = { "seq 64K", "seq 4K", "rand 4K" };
+
+static void raw(Workload workload, Mode mode) {
+    static uint8_t buffer[128 * 512];
+    memset(card_image, 0, (size_t)CARD_SECTORS * 512);
+    SDSimTransport card(card_image, CARD_SECTORS);
+    card_model(card);
+    SDFileSystem sd(card, NULL);
+    sd.disk_initialize();
+
+    // a used card: the region was written before
+    sd.set_streaming(true);
+    for (uint32_t sector = 0; sector < REGION_SECTORS; sector += 128) {
+        pattern(buffer, sector, 128, 0);
+        sd.disk_write(buffer, sector, 128);
+    }
+    sd.set_streaming(false);
+    sd.disk_sync();
+
+    uint32_t chunk = workload == SEQ_64K ? 128 : 8;
+    uint32_t total = workload == RANDOM_4K ? 2048 : 4096;
+    uint32_t start = 8192;
+    uint32_t random = 12345;
+
+    run_start(&card);
+    if (mode == MODE_ERASE_STREAM) {
+        // the sectors the workload writes, all of the region for random writes
+        uint32_t first = workload == RANDOM_4K ? 0 : start;
+        uint32_t count = workload == RANDOM_4K ? REGION_SECTORS : total;
+        call_start();
+        call_end(sd.disk_erase(first, count) == 0);
+        memset(generation + first, ERASED, count);
+    }
+    sd.set_streaming(mode == MODE_STREAM || mode == MODE_ERASE_STREAM);
+    for (uint32_t done = 0; done < total; done += chunk) {
+        uint32_t sector = start + done;
+        if (workload == RANDOM_4K) {
+            random ^= random << 13;
+            random ^= random >> 17;
+            random ^= random << 5;
+            sector = random % (REGION_SECTORS / chunk) * chunk;
+        }
+        pattern(buffer, sector, chunk, 1);
+        if (mode == MODE_SINGLE) {
+            for (uint32_t s = 0; s < chunk; s++) {
+                call_start();
+                call_end(sd.disk_write(buffer + s * 512, sector + s, 1) == 0);
+            }
+        } else {
+            call_start();
+            call_end(sd.disk_write(buffer, sector, chunk) == 0);
+        }
+        run.bytes += chunk * 512;
+    }
+    call_start();
+    sd.set_streaming(false);
+    call_end(sd.disk_sync() == 0);
+    run_stop();
+
+    run.ok = run.ok && verify(sd);
+    run_end(workload_names[workload], mode_names[mode]);
+}
+
+static void capture(const char *mode, int cache_sectors, bool streaming, bool preallocate) {
+    memset(card_image, 0, (size_t)CARD_SECTORS * 512);
+    SDSimTransport card(card_image, CARD_SECTORS);
+    card_model(card);
+    SDFileSystem sd(card, "sd");
+    sd.disk_initialize();
+    sd.format();
+    sd.mount();
+    if (cache_sectors > 0) {
+        sd.set_cache(cache_sectors);
+    }
+    sd.set_streaming(streaming);
+    sd.set_preallocate(preallocate ? HEADER_BYTES + ROWS * ROW_BYTES : 0);
+
+    static uint8_t row[ROW_BYTES];
+    run_start(&card);
+    for (int c = 0; c < CAPTURES; c++) {
+        char name[16];
+        snprintf(name, sizeof(name), "img%03d.bmp", c);
+        call_start();
+        FileHandle *fh = sd.open(name, O_WRONLY | O_CREAT | O_TRUNC);
+        call_end(fh != NULL);
+        if (fh == NULL) {
+            continue;
+        }
+        memset(row, 0, HEADER_BYTES);
+        call_start();
+        call_end(fh->write(row, HEADER_BYTES) == HEADER_BYTES);
+        for (int y = 0; y < ROWS; y++) {
+            memset(row, c + y, ROW_BYTES);
+            call_start();
+            call_end(fh->write(row, ROW_BYTES) == ROW_BYTES);
+        }
+        call_start();
+        call_end(fh->close() == 0);
+        run.bytes += HEADER_BYTES + ROWS * ROW_BYTES;
+    }
+    run_stop();
+    run_end("capture", mode);
+    sd.unmount();
+}
+
+int main(int argc, char **argv) {
+    gc_per_mille = argc > 1 ? atoi(argv[1]) : 2;
+    seed = argc > 2 ? atoi(argv[2]) : 1;
+    card_image = (uint8_t *)malloc((size_t)CARD_SECTORS * 512);
+    if (card_image == NULL) {
+        return 1;
+    }
+
+    printf("%d MB card, %u/1000 blocks stall for garbage collection, seed %u\n",
+           CARD_SECTORS / 2048, gc_per_mille, seed);
+    printf("%-10s %-16s %7s %8s %8s %8s %6s %6s\n", "workload", "mode", "MB/s", "p50 ms", "p99 ms",
+           "max ms", "stalls", "AUs");
+
+    for (int w = 0; w < WORKLOADS; w++) {
+        for (int m = 0; m < MODES; m++) {
+            raw((Workload)w, (Mode)m);
+        }
+    }
+
+    capture("direct", 0, false, false);
+    capture("cache 8", 8, false, false);
+    capture("cache 64", 64, false, false);
+    capture("cache 64, stream", 64, true, false);
+    capture("preallocated", 0, false, true);
+    capture("prealloc, stream", 64, true, true);
+
+    free(card_image);
+    return 0;
+}
@@ -0,0 +1,220 @@
+/* Tests of SDFileSystem on a simulated card
+ *
+ * The asynchronous writes run the GPDMA state machine: the test stands in
+ * for the DMA interrupt and calls SDSimTransport::dma_complete() while it
+ * polls disk_async_busy(), the card does not finish transfers on its own.
+ *
+ *   sd_test
+ */
+#include "mbed.h"
+#include "SDFileSystem.h"
+#include "SDSimTransport.h"
+#include "test.h"
+
+#define CARD_SECTORS (8 * 1024)     // 4MB
+#define MAX_SECTORS  64
+
+static uint8_t card_image[CARD_SECTORS * 512];
+
+// polls the write to its end, completing each DMA transfer with result
+static int async_wait(SDFileSystem &sd, SDSimTransport &card, int result, uint32_t *transfers) {
+    while (sd.disk_async_busy()) {
+        if (card.dma_complete(result) && transfers) {
+            (*transfers)++;
+        }
+    }
+    return sd.disk_async_wait();
+}
+
+static void async_complete() {
+    test_start("async: blocks sent by DMA");
+    memset(card_image, 0, sizeof(card_image));
+    SDSimTransport card(card_image, CARD_SECTORS);
+    card.dma_poll = false;
+    SDFileSystem sd(card, NULL);
+    CHECK(sd.disk_initialize() == 0);
+
+    static uint8_t buffer[MAX_SECTORS * 512];
+    uint32_t transfers = 0;
+    test_pattern(buffer, 100, 1, 1);
+    CHECK(sd.disk_write_async(buffer, 100, 1) == 0);
+    CHECK(async_wait(sd, card, 0, &transfers) == 0);
+    test_pattern(buffer, 200, MAX_SECTORS, 1);
+    CHECK(sd.disk_write_async(buffer, 200, MAX_SECTORS) == 0);
+    CHECK(sd.disk_async_busy());
+    CHECK(async_wait(sd, card, 0, &transfers) == 0);
+    CHECK(transfers == 1 + MAX_SECTORS);
+
+    // contiguous writes continue one CMD25 while streaming
+    sd.set_streaming(true);
+    for (uint32_t sector = 300; sector < 300 + 4 * 8; sector += 8) {
+        test_pattern(buffer, sector, 8, 2);
+        CHECK(sd.disk_write_async(buffer, sector, 8) == 0);
+        CHECK(async_wait(sd, card, 0, NULL) == 0);
+    }
+    sd.set_streaming(false);
+    CHECK(sd.disk_sync() == 0);
+
+    CHECK(test_check(sd, 100, 1, 1));
+    CHECK(test_check(sd, 200, MAX_SECTORS, 1));
+    CHECK(test_check(sd, 300, 32, 2));
+}
+
+static void async_error() {
+    test_start("async: DMA error");
+    memset(card_image, 0, sizeof(card_image));
+    SDSimTransport card(card_image, CARD_SECTORS);
+    card.dma_poll = false;
+    SDFileSystem sd(card, NULL);
+    CHECK(sd.disk_initialize() == 0);
+
+    static uint8_t buffer[MAX_SECTORS * 512];
+    test_pattern(buffer, 400, 8, 1);
+    CHECK(sd.disk_write_async(buffer, 400, 8) == 0);
+    card.dma_complete(0);
+    CHECK(sd.disk_async_busy());
+    // the second block fails half way through
+    int result = async_wait(sd, card, 1, NULL);
+    CHECK(result == SD_ERROR);
+    CHECK(!sd.disk_async_busy());
+    CHECK(sd.disk_sync() == 0);
+
+    // a failure nobody collected is reported by the next sync, once
+    CHECK(sd.disk_write_async(buffer, 400, 8) == 0);
+    while (sd.disk_async_busy()) {
+        card.dma_complete(1);
+    }
+    CHECK(sd.disk_sync() == SD_ERROR);
+    CHECK(sd.disk_sync() == 0);
+
+    // the driver gets the card back and the blocks are written again
+    CHECK(sd.disk_write(buffer, 400, 8) == 0);
+    CHECK(sd.disk_sync() == 0);
+    CHECK(test_check(sd, 400, 8, 1));
+}
+
+static void async_timeout() {
+    test_start("async: card stays busy");
+    memset(card_image, 0, sizeof(card_image));
+    SDSimTransport card(card_image, CARD_SECTORS);
+    card.dma_poll = false;
+    SDFileSystem sd(card, NULL);
+    CHECK(sd.disk_initialize() == 0);
+
+    static uint8_t buffer[MAX_SECTORS * 512];
+    test_pattern(buffer, 500, 4, 1);
+    card.hang = true;
+    Timer timer;
+    timer.start();
+    CHECK(sd.disk_write_async(buffer, 500, 4) == 0);
+    CHECK(async_wait(sd, card, 0, NULL) == SD_ERROR_TIMEOUT);
+    CHECK(timer.read_ms() >= 500);
+    CHECK(sd.stats().timeouts > 0);
+
+    // the card recovers after a reset
+    CHECK(sd.disk_write(buffer, 500, 4) == 0);
+    CHECK(sd.disk_sync() == 0);
+    CHECK(test_check(sd, 500, 4, 1));
+}
+
+// the last block of a streamed write keeps the card busy: the stop token
+// never goes out and disk_sync() says so
+static void stream_stop_timeout() {
+    test_start("stream: card stays busy before the stop token");
+    memset(card_image, 0, sizeof(card_image));
+    SDSimTransport card(card_image, CARD_SECTORS);
+    SDFileSystem sd(card, NULL);
+    CHECK(sd.disk_initialize() == 0);
+
+    static uint8_t buffer[MAX_SECTORS * 512];
+    test_pattern(buffer, 600, 1, 1);
+    sd.set_streaming(true);
+    card.hang = true;
+    CHECK(sd.disk_write(buffer, 600, 1) == 0);
+    CHECK(sd.disk_sync() == SD_ERROR_TIMEOUT);
+    sd.set_streaming(false);
+    CHECK(sd.stats().lost_sectors == 0);
+}
+
+// a reset in the middle of a streamed write: the blocks of the earlier calls
+// were never finished by a stop token
+static void stream_reset() {
+    test_start("stream: reset in a multiple block write");
+    memset(card_image, 0, sizeof(card_image));
+    SDSimTransport card(card_image, CARD_SECTORS);
+    SDFileSystem sd(card, NULL);
+    CHECK(sd.disk_initialize() == 0);
+
+    static uint8_t buffer[MAX_SECTORS * 512];
+    sd.set_streaming(true);
+    test_pattern(buffer, 700, 8, 1);
+    CHECK(sd.disk_write(buffer, 700, 8) == 0);
+    card.hang = true;
+    test_pattern(buffer, 708, 8, 1);
+    CHECK(sd.disk_write(buffer, 708, 8) == 0);
+    CHECK(sd.stats().reinits == 1);
+    CHECK(sd.stats().lost_sectors == 8);
+    CHECK(sd.disk_sync() == SD_ERROR);
+    CHECK(sd.disk_sync() == 0);
+    sd.set_streaming(false);
+    CHECK(test_check(sd, 708, 8, 1));
+
+    // a stream that was finished is not lost
+    sd.set_streaming(true);
+    CHECK(sd.disk_write(buffer, 708, 8) == 0);
+    CHECK(sd.disk_sync() == 0);
+    CHECK(sd.disk_initialize() == 0);
+    CHECK(sd.stats().lost_sectors == 8);
+    CHECK(sd.disk_sync() == 0);
+    sd.set_streaming(false);
+}
+
+// CRC errors lower the clock, clean transfers bring it back
+static void crc_backoff() {
+    test_start("crc: clock lowered and restored");
+    memset(card_image, 0, sizeof(card_image));
+    SDSimTransport card(card_image, CARD_SECTORS);
+    SDFileSystem sd(card, NULL);
+    sd.set_crc(true);
+    CHECK(sd.disk_initialize() == 0);
+    uint32_t sck = sd.transfer_sck();
+
+    static uint8_t buffer[512];
+    card.corrupt_every = 1;
+    CHECK(sd.disk_read(buffer, 0, 1) == SD_ERROR_CRC);
+    CHECK(sd.transfer_sck() < sck);
+
+    // an error that is not a bus error keeps the clock
+    card.corrupt_every = 0;
+    uint32_t lowered = sd.transfer_sck();
+    CHECK(sd.disk_read(buffer, CARD_SECTORS, 1) != 0);
+    CHECK(sd.transfer_sck() == lowered);
+
+    int reads = 0;
+    while (sd.transfer_sck() != sck && reads < 1000) {
+        CHECK(sd.disk_read(buffer, reads % 64, 1) == 0);
+        reads++;
+    }
+    CHECK(reads == 64);
+
+    // failing again at the negotiated clock waits twice as long
+    card.corrupt_every = 1;
+    CHECK(sd.disk_read(buffer, 0, 1) == SD_ERROR_CRC);
+    card.corrupt_every = 0;
+    reads = 0;
+    while (sd.transfer_sck() != sck && reads < 1000) {
+        CHECK(sd.disk_read(buffer, reads % 64, 1) == 0);
+        reads++;
+    }
+    CHECK(reads == 128);
+}
+
+int main() {
+    async_complete();
+    async_error();
+    async_timeout();
+    stream_stop_timeout();
+    stream_reset();
+    crc_backoff();
+    return test_result();
+}
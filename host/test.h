@@ -0,0 +1,60 @@
+/* Checks for the host test programs
+ *
+ * CHECK() prints the failed condition with its line and counts it; a test
+ * program returns test_result() from main so that make test stops on it.
+ * test_start() arms an alarm, a test that hangs is killed and fails too.
+ * test_pattern() fills sectors with data that differs per sector and per
+ * generation, test_check() reads them back from a disk and compares.
+ */
+#ifndef MBED_HOST_TEST_H
+#define MBED_HOST_TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "FATFileSystem.h"
+
+static int test_failures = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("%s:%d: FAILED: %s\n", __FILE__, __LINE__, #cond); \
+            test_failures++; \
+        } \
+    } while (0)
+
+static inline void test_start(const char *name, unsigned seconds = 10) {
+    printf("%s\n", name);
+    fflush(stdout);
+    alarm(seconds);
+}
+
+static inline int test_result() {
+    alarm(0);
+    printf("%s\n", test_failures ? "FAILED" : "ok");
+    return test_failures ? 1 : 0;
+}
+
+static inline void test_pattern(uint8_t *buffer, uint32_t sector, uint32_t count, uint8_t gen) {
+    for (uint32_t i = 0; i < count * 512; i++) {
+        buffer[i] = (uint8_t)((sector + i / 512) * 7 + i * 13 + gen * 101);
+    }
+}
+
+// true when the sectors read back as test_pattern() wrote them
+static inline bool test_check(FATFileSystem &disk, uint32_t sector, uint32_t count, uint8_t gen) {
+    uint8_t *buffer = (uint8_t *)malloc(count * 512);
+    uint8_t *expect = (uint8_t *)malloc(count * 512);
+    bool ok = buffer != NULL && expect != NULL;
+    if (ok) {
+        test_pattern(expect, sector, count, gen);
+        ok = disk.disk_read(buffer, sector, count) == 0 && memcmp(buffer, expect, count * 512) == 0;
+    }
+    free(buffer);
+    free(expect);
+    return ok;
+}
+
+#endif
@@ -37,6 +37,20 @@ DSTATUS disk_initialize (
     return (DSTATUS)FATFileSystem::_ffs[pdrv]->disk_initialize();
 }
 
+/*-----------------------------------------------------------------------*/
+/* Result of a block device read or write: -1 is a drive that is not     */
+/* initialised (FatFs initialises and mounts it again on the next        */
+/* access), other values are errors the driver could not recover from    */
+/*-----------------------------------------------------------------------*/
+
+static DRESULT disk_result (int result)
+{
+    if (result == 0)
+        return RES_OK;
+    debug_if(FFS_DBG, "disk error %d\n", result);
+    return result < 0 ? RES_NOTRDY : RES_ERROR;
+}
+
 /*-----------------------------------------------------------------------*/
 /* Read Sector(s)                                                        */
 /*-----------------------------------------------------------------------*/
@@ -49,10 +63,7 @@ DRESULT disk_read (
 )
 {
     debug_if(FFS_DBG, "disk_read(sector %d, count %d) on pdrv [%d]\n", sector, count, pdrv);
-    if (FATFileSystem::_ffs[pdrv]->disk_read((uint8_t*)buff, sector, count))
-        return RES_PARERR;
-    else
-        return RES_OK;
+    return disk_result(FATFileSystem::_ffs[pdrv]->cached_read((uint8_t*)buff, sector, count));
 }
 
 /*-----------------------------------------------------------------------*/
@@ -68,10 +79,7 @@ DRESULT disk_write (
 )
 {
     debug_if(FFS_DBG, "disk_write(sector %d, count %d) on pdrv [%d]\n", sector, count, pdrv);
-    if (FATFileSystem::_ffs[pdrv]->disk_write((uint8_t*)buff, sector, count))
-        return RES_PARERR;
-    else
-        return RES_OK;
+    return disk_result(FATFileSystem::_ffs[pdrv]->cached_write((uint8_t*)buff, sector, count));
 }
 #endif
 
@@ -91,7 +99,7 @@ DRESULT disk_ioctl (
         case CTRL_SYNC:
             if(FATFileSystem::_ffs[pdrv] == NULL) {
                 return RES_NOTRDY;
-            } else if(FATFileSystem::_ffs[pdrv]->disk_sync()) {
+            } else if(FATFileSystem::_ffs[pdrv]->cached_sync()) {
                 return RES_ERROR;
             }
             return RES_OK;
@@ -107,11 +115,28 @@ DRESULT disk_ioctl (
                     return RES_ERROR;
                 }
             }
+#if _USE_TRIM
+        case CTRL_TRIM:
+            if(FATFileSystem::_ffs[pdrv] == NULL) {
+                return RES_NOTRDY;
+            } else {
+                DWORD *range = (DWORD*)buff; // start and end sector
+                if(FATFileSystem::_ffs[pdrv]->cached_erase(range[0], range[1] - range[0] + 1)) {
+                    return RES_ERROR;
+                }
+            }
+            return RES_OK;
+#endif
         case GET_BLOCK_SIZE:
-            *((DWORD*)buff) = 1; // default when not known
+            if(FATFileSystem::_ffs[pdrv] == NULL || FATFileSystem::_ffs[pdrv]->disk_ioctl(cmd, buff)) {
+                *((DWORD*)buff) = 1; // default when not known
+            }
             return RES_OK;
 
     }
+    if(FATFileSystem::_ffs[pdrv] != NULL && FATFileSystem::_ffs[pdrv]->disk_ioctl(cmd, buff) == 0) {
+        return RES_OK;
+    }
     return RES_PARERR;
 }
 #endif
@@ -864,6 +864,80 @@ DWORD get_fat (	/* 0xFFFFFFFF:Disk error, 1:Internal error, 2..0x0FFFFFFF:Cluste
 
 
 
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Free cluster map                                       */
+/*-----------------------------------------------------------------------*/
+#if !_FS_READONLY && _FS_FREEMAP
+
+static
+void freemap_init (
+	FATFS* fs		/* File system object */
+)
+{
+	DWORD bits = (DWORD)_FS_FREEMAP * 8;
+
+
+	fs->fmap_gsize = (fs->n_fatent - 2 + bits - 1) / bits;	/* Clusters per bit */
+	mem_set(fs->fmap, 0xFF, _FS_FREEMAP);	/* Any group may have a free cluster */
+}
+
+
+static
+void freemap_put (
+	FATFS* fs,		/* File system object */
+	DWORD clst,		/* Cluster number that was changed */
+	DWORD val		/* Its new value */
+)
+{
+	DWORD bit = (clst - 2) / fs->fmap_gsize;
+
+
+	if ((val & 0x0FFFFFFF) == 0) {			/* Freed: the group has a free cluster */
+		fs->fmap[bit / 8] |= 1 << (bit % 8);
+	} else if (fs->fmap_gsize == 1) {		/* Allocated, the bit is the cluster */
+		fs->fmap[bit / 8] &= ~(1 << (bit % 8));
+	}
+}
+
+
+static
+DWORD freemap_find (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk error, >=2:Free cluster# */
+	FATFS* fs,		/* File system object */
+	DWORD scl		/* Search after this cluster, wrapping around to it */
+)
+{
+	DWORD ncl, nbit, bit, n, gcl, gend, clst, end, cs;
+	BYTE whole;
+
+
+	nbit = (fs->n_fatent - 2 + fs->fmap_gsize - 1) / fs->fmap_gsize;	/* Bits in use */
+	ncl = scl + 1;
+	if (ncl < 2 || ncl >= fs->n_fatent) ncl = 2;
+	bit = (ncl - 2) / fs->fmap_gsize;
+	for (n = 0; n <= nbit; n++, bit++) {	/* Every group, the first one in two parts */
+		if (bit == nbit) bit = 0;
+		if (!(fs->fmap[bit / 8] & (1 << (bit % 8)))) continue;	/* No free cluster in the group */
+		gcl = 2 + bit * fs->fmap_gsize;		/* Clusters of the group */
+		gend = gcl + fs->fmap_gsize;
+		if (gend > fs->n_fatent) gend = fs->n_fatent;
+		clst = gcl; end = gend;
+		if (n == 0 && ncl > gcl) clst = ncl;		/* From the start point */
+		if (n == nbit && ncl < gend) end = ncl;		/* Up to the start point */
+		whole = (clst == gcl && end == gend);
+		for ( ; clst < end; clst++) {
+			cs = get_fat(fs, clst);
+			if (cs == 0) return clst;		/* Found a free cluster */
+			if (cs == 0xFFFFFFFF || cs == 1) return cs;	/* An error occurred */
+		}
+		if (whole) fs->fmap[bit / 8] &= ~(1 << (bit % 8));	/* The group is full */
+	}
+	return 0;
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* FAT access - Change value of a FAT entry                              */
 /*-----------------------------------------------------------------------*/
@@ -920,6 +994,9 @@ FRESULT put_fat (	/* FR_OK(0):succeeded, !=0:error */
 		default :
 			res = FR_INT_ERR;
 		}
+#if _FS_FREEMAP
+		if (res == FR_OK) freemap_put(fs, clst, val);
+#endif
 	}
 
 	return res;
@@ -1008,6 +1085,10 @@ DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk err
 		scl = clst;
 	}
 
+#if _FS_FREEMAP
+	ncl = freemap_find(fs, scl);	/* Search the groups that may have a free cluster */
+	if (ncl < 2 || ncl == 0xFFFFFFFF) return ncl;	/* No free cluster or an error */
+#else
 	ncl = scl;				/* Start cluster */
 	for (;;) {
 		ncl++;							/* Next cluster */
@@ -1021,6 +1102,7 @@ DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk err
 			return cs;
 		if (ncl == scl) return 0;		/* No free cluster */
 	}
+#endif
 
 	res = put_fat(fs, ncl, 0x0FFFFFFF);	/* Mark the new cluster "last link" */
 	if (res == FR_OK && clst != 0) {
@@ -2326,6 +2408,9 @@ FRESULT find_volume (	/* FR_OK(0): successful, !=0: any error occurred */
 #if !_FS_READONLY
 	/* Initialize cluster allocation information */
 	fs->last_clust = fs->free_clust = 0xFFFFFFFF;
+#if _FS_FREEMAP
+	freemap_init(fs);
+#endif
 
 	/* Get fsinfo if available */
 	fs->fsi_flag = 0x80;
@@ -2563,6 +2648,9 @@ FRESULT f_open (
 			fp->err = 0;						/* Clear error flag */
 			fp->sclust = ld_clust(dj.fs, dir);	/* File start cluster */
 			fp->fsize = LD_DWORD(dir + DIR_FileSize);	/* File size */
+#if _USE_EXPAND
+			fp->vsize = fp->fsize;
+#endif
 			fp->fptr = 0;						/* File pointer */
 			fp->dsect = 0;
 #if _USE_FASTSEEK
@@ -2732,8 +2820,9 @@ FRESULT f_write (
 				if (fp->sclust == 0) fp->sclust = clst;	/* Set start cluster if the first write */
 				
 #if FLUSH_ON_NEW_CLUSTER
-                // We do not need to flush for the first cluster
-                if (fp->fptr != 0) {
+                // We do not need to flush for the first cluster, nor for a
+                // cluster the file already had (e.g. from f_expand)
+                if (fp->fptr != 0 && fp->fptr >= fp->fsize) {
                     need_sync = true;
                 }
 #endif
@@ -2783,7 +2872,11 @@ FRESULT f_write (
 			}
 #else
 			if (fp->dsect != sect) {		/* Fill sector cache with file data */
+#if _USE_EXPAND
+				if (fp->fptr < fp->vsize &&	/* Nothing to keep in a block from f_expand */
+#else
 				if (fp->fptr < fp->fsize &&
+#endif
 					disk_read(fp->fs->drv, fp->buf, sect, 1) != RES_OK)
 						ABORT(fp->fs, FR_DISK_ERR);
 			}
@@ -2804,6 +2897,9 @@ FRESULT f_write (
 	}
 
 	if (fp->fptr > fp->fsize) fp->fsize = fp->fptr;	/* Update file size if needed */
+#if _USE_EXPAND
+	if (fp->fptr > fp->vsize) fp->vsize = fp->fptr;
+#endif
 	fp->flag |= FA__WRITTEN;						/* Set file change flag */
 
 	if (need_sync) {
@@ -3476,6 +3572,51 @@ FRESULT f_getfree (
 
 
 
+#if _USE_TRIM
+/*-----------------------------------------------------------------------*/
+/* Erase Free Clusters                                                   */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_trimfree (
+	const TCHAR* path,	/* Path name of the logical drive number */
+	DWORD* nclst		/* Pointer to a variable to return number of erased clusters */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD clst, scl, stat, nfree, rt[2];
+
+
+	/* Get logical drive number */
+	res = find_volume(&fs, &path, 1);
+	if (res == FR_OK) {
+		nfree = 0; scl = 0;
+		for (clst = 2; clst < fs->n_fatent; clst++) {
+			stat = get_fat(fs, clst);
+			if (stat == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
+			if (stat == 1) { res = FR_INT_ERR; break; }
+			if (stat == 0) {		/* Free cluster: extend the run */
+				if (!scl) scl = clst;
+				nfree++;
+			} else if (scl) {		/* End of a run of free clusters */
+				rt[0] = clust2sect(fs, scl);				/* Start sector */
+				rt[1] = clust2sect(fs, clst - 1) + fs->csize - 1;	/* End sector */
+				disk_ioctl(fs->drv, CTRL_TRIM, rt);			/* Erase the block */
+				scl = 0;
+			}
+		}
+		if (res == FR_OK && scl) {	/* Free clusters up to the end of the volume */
+			rt[0] = clust2sect(fs, scl);
+			rt[1] = clust2sect(fs, fs->n_fatent - 1) + fs->csize - 1;
+			disk_ioctl(fs->drv, CTRL_TRIM, rt);
+		}
+		*nclst = nfree;
+	}
+	LEAVE_FF(fs, res);
+}
+#endif
+
+
 
 /*-----------------------------------------------------------------------*/
 /* Truncate File                                                         */
@@ -3501,6 +3642,9 @@ FRESULT f_truncate (
 	if (res == FR_OK) {
 		if (fp->fsize > fp->fptr) {
 			fp->fsize = fp->fptr;	/* Set file size to current R/W point */
+#if _USE_EXPAND
+			if (fp->vsize > fp->fptr) fp->vsize = fp->fptr;
+#endif
 			fp->flag |= FA__WRITTEN;
 			if (fp->fptr == 0) {	/* When set file size to zero, remove entire cluster chain */
 				res = remove_chain(fp->fs, fp->sclust);
@@ -3532,6 +3676,78 @@ FRESULT f_truncate (
 
 
 
+#if _USE_EXPAND
+/*-----------------------------------------------------------------------*/
+/* Allocate a Contiguous Cluster Block to the File                       */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_expand (
+	FIL* fp,		/* Pointer to the file object */
+	DWORD fsz,		/* File size to be expanded to */
+	BYTE opt		/* 0:Find the block and start the next allocation there, 1:Allocate it to the file */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD n, clst, stcl, scl, ncl, tcl, nprb;
+
+
+	res = validate(fp);						/* Check validity of the object */
+	if (res == FR_OK && fp->err) res = (FRESULT)fp->err;
+	if (res != FR_OK) LEAVE_FF(fp->fs, res);
+	fs = fp->fs;
+	if (fsz == 0 || fp->fsize != 0 || fp->sclust != 0 || !(fp->flag & FA_WRITE))
+		LEAVE_FF(fs, FR_DENIED);			/* Only an empty file opened for writing */
+
+	n = (DWORD)fs->csize * SS(fs);			/* Cluster size */
+	tcl = fsz / n + ((fsz % n) ? 1 : 0);	/* Number of clusters required */
+	if (tcl > fs->n_fatent - 2) LEAVE_FF(fs, FR_DENIED);
+	stcl = fs->last_clust + 1;				/* Search from the suggested start point */
+	if (stcl < 2 || stcl >= fs->n_fatent) stcl = 2;
+
+	/* Probe every cluster once, and after the wrap tcl-1 more, so that a block
+	   starting just before stcl is seen whole */
+	nprb = fs->n_fatent - 3 + tcl;
+	scl = clst = stcl; ncl = 0;
+	for (;;) {								/* Find a contiguous block of free clusters */
+		n = get_fat(fs, clst);
+		if (n == 1) { res = FR_INT_ERR; break; }
+		if (n == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
+		if (n == 0 && ++ncl == tcl) break;	/* Found */
+		if (--nprb == 0) { res = FR_DENIED; break; }	/* Searched all */
+		if (++clst >= fs->n_fatent) clst = 2;	/* A block cannot wrap around the end */
+		if (n != 0 || clst == 2) {			/* Start a new block after a used cluster */
+			scl = clst; ncl = 0;
+		}
+	}
+
+	if (res == FR_OK) {
+		if (opt) {
+			for (clst = scl, n = tcl; n; clst++, n--) {	/* Write the chain in one pass over the FAT */
+				res = put_fat(fs, clst, (n == 1) ? 0x0FFFFFFF : clst + 1);
+				if (res != FR_OK) break;
+			}
+			if (res == FR_OK) {
+				fs->last_clust = scl + tcl - 1;
+				if (fs->free_clust != 0xFFFFFFFF) {	/* Update FSINFO */
+					fs->free_clust -= tcl;
+					fs->fsi_flag |= 1;
+				}
+				fp->sclust = scl;			/* The file owns the block now */
+				fp->fsize = fsz;
+				fp->vsize = 0;
+				fp->flag |= FA__WRITTEN;
+			}
+		} else {
+			fs->last_clust = scl - 1;		/* The next allocation starts at the block */
+		}
+	}
+
+	LEAVE_FF(fs, res);
+}
+#endif
+
+
 
 /*-----------------------------------------------------------------------*/
 /* Delete a File or Directory                                            */
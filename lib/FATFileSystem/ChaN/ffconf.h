@@ -49,6 +49,11 @@
 /* This option switches fast seek feature. (0:Disable or 1:Enable) */
 
 
+#define	_USE_EXPAND		1
+/* This option switches f_expand() function, which allocates a contiguous
+/  cluster block to a file. (0:Disable or 1:Enable) */
+
+
 #define _USE_LABEL		0
 /* This option switches volume label functions, f_getlabel() and f_setlabel().
 /  (0:Disable or 1:Enable) */
@@ -171,7 +176,7 @@
 /  disk_ioctl() function. */
 
 
-#define	_USE_TRIM	0
+#define	_USE_TRIM	1
 /* This option switches ATA-TRIM feature. (0:Disable or 1:Enable)
 /  To enable Trim feature, also CTRL_TRIM command should be implemented to the
 /  disk_ioctl() function. */
@@ -189,6 +194,16 @@
 */
 
 
+#define _FS_FREEMAP		512
+/* Size in bytes of the free cluster map in the file system object (0:Disable).
+/  Cluster allocation searches the map instead of reading the FAT entry by entry.
+/  A bit stands for a group of clusters and is cleared once a search finds none
+/  of them free, put_fat() sets it again when one is freed. All bits are set at
+/  mount, so the map costs no FAT scan. With more clusters than bits a bit
+/  stands for several clusters (e.g. 32 on a 64MB card with 512 byte clusters).
+*/
+
+
 
 /*---------------------------------------------------------------------------/
 / System Configurations
@@ -276,8 +291,8 @@
 /  *3:Some compilers generate LDM/STM for mem_cpy function.
 */
 
-#define FLUSH_ON_NEW_CLUSTER    0   /* Sync the file on every new cluster */
-#define FLUSH_ON_NEW_SECTOR     1   /* Sync the file on every new sector */
+#define FLUSH_ON_NEW_CLUSTER    1   /* Sync the file on every new cluster */
+#define FLUSH_ON_NEW_SECTOR     0   /* Sync the file on every new sector */
 /* Only one of these two defines needs to be set to 1. If both are set to 0
    the file is only sync when closed.
    Clusters are group of sectors (eg: 8 sectors). Flushing on new cluster means
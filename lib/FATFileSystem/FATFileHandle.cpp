@@ -76,6 +76,25 @@ off_t FATFileHandle::lseek(off_t position, int whence) {
     }
 }
 
+int FATFileHandle::expand(off_t size, uint32_t *sector) {
+    FRESULT res = f_expand(&_fh, size, 1);
+    if (res == FR_OK) {
+        res = f_sync(&_fh);
+    }
+    if (res == FR_DENIED) {
+        debug_if(FFS_DBG, "f_expand(%d): no free block that large\n", (int)size);
+        return 1;
+    }
+    if (res) {
+        debug_if(FFS_DBG, "f_expand(%d) failed: %d\n", (int)size, res);
+        return -1;
+    }
+    if (sector) {
+        *sector = _fh.fs->database + (_fh.sclust - 2) * _fh.fs->csize;
+    }
+    return 0;
+}
+
 int FATFileHandle::fsync() {
     FRESULT res = f_sync(&_fh);
     if (res) {
@@ -22,6 +22,7 @@
 #ifndef MBED_FATFILEHANDLE_H
 #define MBED_FATFILEHANDLE_H
 
+#include <stdint.h>
 #include "FileHandle.h"
 
 using namespace mbed;
@@ -41,6 +42,17 @@ public:
     virtual off_t seek(off_t position, int whence) { return lseek(position, whence); }
     virtual off_t size() { return flen(); }
 
+    /**
+     * Allocates contiguous clusters for size bytes to the empty file, writing
+     * the chain in one pass over the FAT, and syncs the directory entry. The
+     * file is size bytes long from then on and writing it only writes data
+     * sectors, one after the other. Sets sector to the first sector of the
+     * file on the disk when not NULL. Returns 0 on success, 1 when the file
+     * is not empty or there is no free block that large (the file is left as
+     * it was), -1 on a disk error
+     */
+    int expand(off_t size, uint32_t *sector = NULL);
+
 protected:
     
     FIL _fh;
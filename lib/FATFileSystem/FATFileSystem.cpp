@@ -42,8 +42,13 @@ DWORD get_fattime(void) {
 
 FATFileSystem *FATFileSystem::_ffs[_VOLUMES] = {0};
 
-FATFileSystem::FATFileSystem(const char* n) : FileSystemLike(n) {
-    debug_if(FFS_DBG, "FATFileSystem(%s)\n", n);
+FATFileSystem::FATFileSystem(const char* n) : FileSystemLike(n), _cache(NULL), _preallocate(0) {
+    debug_if(FFS_DBG, "FATFileSystem(%s)\n", n ? n : "");
+    _fsid[0] = '\0';
+    if (n == NULL) {
+        // a disk of a composite device (SDRaidFileSystem), no FatFs drive
+        return;
+    }
     for(int i=0; i<_VOLUMES; i++) {
         if(_ffs[i] == 0) {
             _ffs[i] = this;
@@ -58,6 +63,7 @@ FATFileSystem::FATFileSystem(const char* n) : FileSystemLike(n) {
 }
 
 FATFileSystem::~FATFileSystem() {
+    set_cache(0);
     for (int i=0; i<_VOLUMES; i++) {
         if (_ffs[i] == this) {
             _ffs[i] = 0;
@@ -97,7 +103,19 @@ FileHandle *FATFileSystem::open(const char* name, int flags) {
     if (flags & O_APPEND) {
         f_lseek(&fh, fh.fsize);
     }
-    return new FATFileHandle(fh);
+    FATFileHandle *handle = new FATFileHandle(fh);
+    if (_preallocate > 0 && (flags & O_CREAT) && (flags & O_TRUNC)) {
+        int res = handle->expand(_preallocate);
+        if (res < 0) {
+            debug("Couldn't preallocate %s\n", name);
+            handle->close();
+            return NULL;
+        }
+        if (res > 0) {
+            debug("No free block of %d bytes for %s, it grows as it is written\n", (int)_preallocate, name);
+        }
+    }
+    return handle;
 }
 
 int FATFileSystem::open(FileHandle **file, const char *name, int flags) {
@@ -167,8 +185,69 @@ int FATFileSystem::mount() {
 }
 
 int FATFileSystem::unmount() {
-    if (disk_sync())
+    if (cached_sync())
         return -1;
     FRESULT res = f_mount(NULL, _fsid, 0);
     return res == 0 ? 0 : -1;
 }
+
+int FATFileSystem::set_cache(int sectors) {
+    if (_cache) {
+        if (_cache->flush())
+            return -1;
+        delete _cache;
+        _cache = NULL;
+    }
+    if (sectors > 0) {
+        _cache = new SectorCache(this, sectors);
+        if (!_cache->valid()) {
+            debug_if(FFS_DBG, "set_cache(%d) out of memory\n", sectors);
+            delete _cache;
+            _cache = NULL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int FATFileSystem::cached_read(uint8_t *buffer, uint32_t sector, uint32_t count) {
+    if (_cache)
+        return _cache->read(buffer, sector, count);
+    return disk_read(buffer, sector, count);
+}
+
+int FATFileSystem::cached_write(const uint8_t *buffer, uint32_t sector, uint32_t count) {
+    if (_cache)
+        return _cache->write(buffer, sector, count);
+    return disk_write(buffer, sector, count);
+}
+
+int FATFileSystem::cached_sync() {
+    if (_cache && _cache->flush())
+        return -1;
+    return disk_sync();
+}
+
+int FATFileSystem::cached_erase(uint32_t sector, uint32_t count) {
+    if (_cache)
+        _cache->discard(sector, count);
+    return disk_erase(sector, count);
+}
+
+int FATFileSystem::erase_free_space() {
+#if _USE_TRIM
+    char n[4];
+    sprintf(n, "%s:", _fsid);
+    DWORD clusters;
+    FRESULT res = f_trimfree(n, &clusters);
+    if (res) {
+        debug_if(FFS_DBG, "f_trimfree() failed: %d\n", res);
+        return -1;
+    }
+    if (cached_sync())
+        return -1;
+    return clusters;
+#else
+    return -1;
+#endif
+}
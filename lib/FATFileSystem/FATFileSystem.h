@@ -25,6 +25,7 @@
 #include "FileSystemLike.h"
 #include "FileHandle.h"
 #include "ff.h"
+#include "SectorCache.h"
 #include <stdint.h>
 
 using namespace mbed;
@@ -35,6 +36,10 @@ using namespace mbed;
 class FATFileSystem : public FileSystemLike {
 public:
 
+    /**
+     * Takes the next free FatFs drive. Without a name (NULL) the object is a
+     * disk only, used through the disk_* functions by a device on top of it
+     */
     FATFileSystem(const char* n);
     virtual ~FATFileSystem();
 
@@ -84,12 +89,51 @@ public:
      */
     virtual int unmount();
 
+    /**
+     * Erases all free clusters, returns the number of clusters or -1
+     */
+    int erase_free_space();
+
+    /**
+     * Files opened with O_CREAT | O_TRUNC (fopen "w") from now on get size
+     * bytes of contiguous clusters, see FATFileHandle::expand(). Without a
+     * free block that large the file grows as usual; open() fails when the
+     * allocation hits a disk error. 0 switches it off
+     */
+    void set_preallocate(off_t size) { _preallocate = size; }
+
     virtual int disk_initialize() { return 0; }
     virtual int disk_status() { return 0; }
     virtual int disk_read(uint8_t *buffer, uint32_t sector, uint32_t count) = 0;
     virtual int disk_write(const uint8_t *buffer, uint32_t sector, uint32_t count) = 0;
     virtual int disk_sync() { return 0; }
     virtual uint32_t disk_sectors() = 0;
+    virtual int disk_erase(uint32_t sector, uint32_t count) { return -1; }
+
+    /**
+     * Driver specific disk_ioctl codes (GET_BLOCK_SIZE, MMC_GET_*), returns 0
+     * when handled
+     */
+    virtual int disk_ioctl(int cmd, void *buffer) { return -1; }
+
+    /**
+     * Puts a write-back cache of 512 byte sectors in front of the disk_* functions,
+     * 0 sectors removes it. Returns 0 on success
+     */
+    int set_cache(int sectors);
+    SectorCache *cache() { return _cache; }
+
+    /**
+     * Sector access used by diskio.cpp, through the cache when there is one
+     */
+    int cached_read(uint8_t *buffer, uint32_t sector, uint32_t count);
+    int cached_write(const uint8_t *buffer, uint32_t sector, uint32_t count);
+    int cached_sync();
+    int cached_erase(uint32_t sector, uint32_t count);
+
+protected:
+    SectorCache *_cache;
+    off_t _preallocate;
 
 };
 
@@ -30,43 +30,53 @@ namespace mbed
             }
         }
     
-        // read a sector in to the buffer, return 0 if ok
-        virtual int disk_read(char *buffer, int sector) {
-            if(sectors[sector] == 0) {
-                // nothing allocated means sector is empty
-                memset(buffer, 0, 512);
-            } else {
-                memcpy(buffer, sectors[sector], 512);
+        // read sectors in to the buffer, return 0 if ok
+        virtual int disk_read(uint8_t *buffer, uint32_t sector, uint32_t count) {
+            if(sector >= disk_sectors() || count > disk_sectors() - sector) {
+                return 1;
+            }
+            for(; count > 0; count--, sector++, buffer += 512) {
+                if(sectors[sector] == 0) {
+                    // nothing allocated means sector is empty
+                    memset(buffer, 0, 512);
+                } else {
+                    memcpy(buffer, sectors[sector], 512);
+                }
             }
             return 0;
         }
     
-        // write a sector from the buffer, return 0 if ok
-        virtual int disk_write(const char *buffer, int sector) {
-            // if buffer is zero deallocate sector
+        // write sectors from the buffer, return 0 if ok
+        virtual int disk_write(const uint8_t *buffer, uint32_t sector, uint32_t count) {
+            if(sector >= disk_sectors() || count > disk_sectors() - sector) {
+                return 1;
+            }
             char zero[512];
             memset(zero, 0, 512);
-            if(memcmp(zero, buffer, 512)==0) {
-                if(sectors[sector] != 0) {
-                    free(sectors[sector]);
-                    sectors[sector] = 0;
+            for(; count > 0; count--, sector++, buffer += 512) {
+                // if buffer is zero deallocate sector
+                if(memcmp(zero, buffer, 512)==0) {
+                    if(sectors[sector] != 0) {
+                        free(sectors[sector]);
+                        sectors[sector] = 0;
+                    }
+                    continue;
                 }
-                return 0;
-            }
-            // else allocate a sector if needed, and write
-            if(sectors[sector] == 0) {
-                char *sec = (char*)malloc(512);
-                if(sec==0) {
-                    return 1; // out of memory
+                // else allocate a sector if needed, and write
+                if(sectors[sector] == 0) {
+                    char *sec = (char*)malloc(512);
+                    if(sec==0) {
+                        return 1; // out of memory
+                    }
+                    sectors[sector] = sec;
                 }
-                sectors[sector] = sec;
+                memcpy(sectors[sector], buffer, 512);
             }
-            memcpy(sectors[sector], buffer, 512);
             return 0;
         }
     
         // return the number of sectors
-        virtual int disk_sectors() {
+        virtual uint32_t disk_sectors() {
             return sizeof(sectors)/sizeof(sectors[0]);
         }
     
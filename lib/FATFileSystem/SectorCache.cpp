@@ -0,0 +1,223 @@
+/* Write-back sector cache between FatFs and the disk
+ */
+#include "mbed.h"
+#include "mbed_debug.h"
+
+#include "ffconf.h"
+#include "SectorCache.h"
+#include "FATFileSystem.h"
+
+#define SECTOR_SIZE  512
+#define SECTOR_WORDS (SECTOR_SIZE / sizeof(uint32_t))
+
+SectorCache::SectorCache(FATFileSystem *backend, int sectors) :
+    _backend(backend), _count(sectors), _clock(0) {
+    _slots = (Slot *)malloc(sizeof(Slot) * sectors);
+    _pool = (uint32_t *)malloc(SECTOR_SIZE * sectors);
+    if (_slots == NULL || _pool == NULL) {
+        free(_slots);
+        free(_pool);
+        _slots = NULL;
+        _pool = NULL;
+        _count = 0;
+    }
+    invalidate();
+    reset_stats();
+}
+
+SectorCache::~SectorCache() {
+    free(_slots);
+    free(_pool);
+}
+
+bool SectorCache::valid() {
+    return _count > 0;
+}
+
+void SectorCache::invalidate() {
+    for (int i = 0; i < _count; i++) {
+        _slots[i].valid = false;
+        _slots[i].dirty = false;
+    }
+}
+
+void SectorCache::discard(uint32_t sector, uint32_t count) {
+    for (int i = 0; i < _count; i++) {
+        if (_slots[i].valid && _slots[i].sector - sector < count) {
+            _slots[i].valid = false;
+            _slots[i].dirty = false;
+        }
+    }
+}
+
+void SectorCache::reset_stats() {
+    hits = 0;
+    misses = 0;
+    writes = 0;
+    flushes = 0;
+    flushed = 0;
+}
+
+int SectorCache::read(uint8_t *buffer, uint32_t sector, uint32_t count) {
+    for (uint32_t i = 0; i < count; ) {
+        int slot = _find(sector + i);
+        if (slot >= 0) {
+            memcpy(buffer + i * SECTOR_SIZE, _data(slot), SECTOR_SIZE);
+            _slots[slot].used = ++_clock;
+            hits++;
+            i++;
+            continue;
+        }
+
+        // read the run of uncached sectors with one backend call
+        uint32_t n = 1;
+        while (i + n < count && _find(sector + i + n) < 0) {
+            n++;
+        }
+        int result = _backend->disk_read(buffer + i * SECTOR_SIZE, sector + i, n);
+        if (result) {
+            return result;
+        }
+        misses += n;
+
+        // keep single sectors (FAT, directory), not bulk file data
+        if (count == 1) {
+            slot = _victim();
+            if (slot < 0) {
+                return 1;
+            }
+            memcpy(_data(slot), buffer, SECTOR_SIZE);
+            _slots[slot].sector = sector;
+            _slots[slot].used = ++_clock;
+            _slots[slot].valid = true;
+            _slots[slot].dirty = false;
+        }
+        i += n;
+    }
+    return 0;
+}
+
+int SectorCache::write(const uint8_t *buffer, uint32_t sector, uint32_t count) {
+    if (count == 1) {
+        int slot = _find(sector);
+        if (slot < 0 && (slot = _victim()) < 0) {
+            return 1;
+        }
+        memcpy(_data(slot), buffer, SECTOR_SIZE);
+        _slots[slot].sector = sector;
+        _slots[slot].used = ++_clock;
+        _slots[slot].valid = true;
+        _slots[slot].dirty = true;
+        writes++;
+        return 0;
+    }
+
+    // bulk file data goes straight to the backend, cached copies follow it
+    int result = _backend->disk_write(buffer, sector, count);
+    if (result) {
+        return result;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        int slot = _find(sector + i);
+        if (slot >= 0) {
+            memcpy(_data(slot), buffer + i * SECTOR_SIZE, SECTOR_SIZE);
+            _slots[slot].dirty = false;
+        }
+    }
+    return 0;
+}
+
+int SectorCache::flush() {
+    // ascending sector order lines contiguous runs up in the pool
+    _sort();
+
+    int result = 0;
+    for (int i = 0; i < _count; ) {
+        if (!_slots[i].valid || !_slots[i].dirty) {
+            i++;
+            continue;
+        }
+        int n = 1;
+        while (i + n < _count && _slots[i + n].valid && _slots[i + n].dirty
+                && _slots[i + n].sector == _slots[i].sector + n) {
+            n++;
+        }
+        debug_if(FFS_DBG, "cache flush(sector %d, count %d)\n", _slots[i].sector, n);
+        int r = _backend->disk_write(_data(i), _slots[i].sector, n);
+        if (r) {
+            result = r;
+        } else {
+            for (int j = i; j < i + n; j++) {
+                _slots[j].dirty = false;
+            }
+            flushes++;
+            flushed += n;
+        }
+        i += n;
+    }
+    return result;
+}
+
+int SectorCache::_find(uint32_t sector) {
+    for (int i = 0; i < _count; i++) {
+        if (_slots[i].valid && _slots[i].sector == sector) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// slot to reuse: a free one, or the least recently used one after writing
+// back the dirty sectors
+int SectorCache::_victim() {
+    if (_count == 0) {
+        return -1;
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        int victim = 0;
+        for (int i = 0; i < _count; i++) {
+            if (!_slots[i].valid) {
+                return i;
+            }
+            if (_slots[i].used < _slots[victim].used) {
+                victim = i;
+            }
+        }
+        if (!_slots[victim].dirty) {
+            return victim;
+        }
+        // flush() reorders the slots, so pick again afterwards
+        if (flush()) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+// insertion sort of the slots by sector, invalid slots last
+void SectorCache::_sort() {
+    for (int i = 1; i < _count; i++) {
+        for (int j = i; j > 0; j--) {
+            Slot &a = _slots[j - 1];
+            Slot &b = _slots[j];
+            bool swap = b.valid && (!a.valid || b.sector < a.sector);
+            if (!swap) {
+                break;
+            }
+            Slot slot = a;
+            a = b;
+            b = slot;
+            uint32_t *pa = _pool + (j - 1) * SECTOR_WORDS;
+            uint32_t *pb = _pool + j * SECTOR_WORDS;
+            for (uint32_t k = 0; k < SECTOR_WORDS; k++) {
+                uint32_t word = pa[k];
+                pa[k] = pb[k];
+                pb[k] = word;
+            }
+        }
+    }
+}
+
+uint8_t *SectorCache::_data(int slot) {
+    return (uint8_t *)(_pool + slot * SECTOR_WORDS);
+}
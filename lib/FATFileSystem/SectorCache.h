@@ -0,0 +1,83 @@
+/* Write-back sector cache between FatFs and the disk
+ */
+#ifndef MBED_SECTORCACHE_H
+#define MBED_SECTORCACHE_H
+
+#include <stdint.h>
+
+class FATFileSystem;
+
+/** Write-back sector cache between FatFs and a FATFileSystem backend
+ *
+ * Single sector accesses (FAT, directory and partial data sectors) are kept
+ * in a fixed number of slots with LRU replacement, and writes to them only
+ * mark the slot dirty. Multi sector transfers of file data go straight to
+ * the backend. flush() writes the dirty sectors in ascending order, each
+ * contiguous run as one multi sector write.
+ */
+class SectorCache {
+public:
+
+    /** Create the cache
+     *
+     * @param backend the disk_* functions to cache
+     * @param sectors number of 512 byte slots
+     */
+    SectorCache(FATFileSystem *backend, int sectors);
+    ~SectorCache();
+
+    /** @returns true when the slots could be allocated
+     */
+    bool valid();
+
+    /** Read or write through the cache
+     *
+     * @returns 0 on success, else the result of the failed backend call
+     */
+    int read(uint8_t *buffer, uint32_t sector, uint32_t count);
+    int write(const uint8_t *buffer, uint32_t sector, uint32_t count);
+
+    /** Write all dirty sectors to the backend
+     *
+     * @returns 0 on success, else the result of the last failed backend call
+     */
+    int flush();
+
+    /** Drop all slots without writing them
+     */
+    void invalidate();
+
+    /** Drop the slots of erased sectors, dirty or not
+     */
+    void discard(uint32_t sector, uint32_t count);
+
+    void reset_stats();
+
+    uint32_t hits;      // sectors served from the cache
+    uint32_t misses;    // sectors read from the backend
+    uint32_t writes;    // sector writes absorbed by the cache
+    uint32_t flushes;   // backend writes issued by flush()
+    uint32_t flushed;   // sectors written by flush()
+
+protected:
+
+    struct Slot {
+        uint32_t sector;
+        uint32_t used;  // LRU stamp
+        bool valid;
+        bool dirty;
+    };
+
+    int _find(uint32_t sector);
+    int _victim();
+    void _sort();
+    uint8_t *_data(int slot);
+
+    FATFileSystem *_backend;
+    int _count;
+    Slot *_slots;
+    uint32_t *_pool;
+    uint32_t _clock;
+};
+
+#endif
@@ -10,20 +10,44 @@
 #define OV7670_NOACK (0)
 #define OV7670_REGMAX (201) // レジスタ範囲の最大値
 #define OV7670_I2CFREQ (50000)
+#ifndef OV7670_XCLK
+#define OV7670_XCLK (12000000) // FIFO モジュール上の発振器 (Hz)
+#endif
+#define OV7670_PCLK_MAX (24000000) // センサの最大 PCLK (Hz)
+#define OV7670_PID (0x76)
+#define OV7670_VER (0x73)
 
 class OV7670 {
 public:
 
-    I2C camera;
-    InterruptIn vsync,href;
+    I2C *sccb;      // SCCB bus owned by this instance (NULL when shared)
+    I2C &camera;
+    DigitalOut *sccbEnable; // SCCB select for a shared bus (NULL: always selected)
+    int sccbEnableOn;       // level of sccbEnable that selects this camera
+    int sccbAddress;
+    InterruptIn vsync;
+    InterruptIn *href; // NULL: not wired, no line counting
     DigitalOut writeReset, wen;
     BusIn data;
     DigitalOut rrst,oe,rclk;
     volatile int LineCounter;
     volatile int LastLines;
+    volatile int FrameCounter;
+    int WindowWidth;
+    int WindowHeight;
+    int SensorWidth;
+    int SensorHeight;
+    int HScale;
+    int VScale;
+    int BytesPerPixel;
+    int ClockPrescaler;
+    int ClockPll;
     volatile bool CaptureReq;
     volatile bool Busy;
     volatile bool Done;
+    volatile bool Capturing;
+    OV7670 *SyncFollower;   // camera whose FIFO write follows this camera's VSYNC (NULL: none)
+    bool SyncedToLeader;    // FIFO write started and stopped by another camera's VSYNC
 
     OV7670 (
             PinName sda,// Camera I2C port
@@ -43,16 +67,87 @@ public:
             PinName o,  // /OE
             PinName rc,  // RCLK
             PinName wrst  // WRST
-    ) : camera(sda,scl), vsync(vs), href(hr), wen(we), data(d0,d1,d2,d3,d4,d5,d6,d7), rrst(rt), oe(o), rclk(rc), writeReset(wrst)
+    ) : sccb(new I2C(sda,scl)), camera(*sccb), vsync(vs), writeReset(wrst), wen(we), data(d0,d1,d2,d3,d4,d5,d6,d7), rrst(rt), oe(o), rclk(rc)
     {
         camera.stop();
         camera.frequency(OV7670_I2CFREQ);
+        Init(hr, NC, OV7670_WRITE);
+    }
+
+    // camera on a shared SCCB bus (multi camera), D7-D0 may be shared between FIFOs via /OE.
+    // Cameras on one bus answer the same address, so each needs an SCCB enable:
+    // a pin driven high while it is accessed, or its own /OE pin (o), driven low,
+    // for a bus switch on SIOC that is enabled by the FIFO output enable.
+    // The bus is left as it is: set it up once before the first access with
+    // bus.stop() and bus.frequency(OV7670_I2CFREQ), mbed starts it at 100 kHz
+    OV7670 (
+            I2C &bus,   // shared SCCB bus
+            PinName en, // SCCB enable (NC: none, only one camera on the bus)
+            int address,// SCCB write address
+            PinName vs, // VSYNC
+            PinName hr, // HREF (NC: not wired)
+            PinName we, // WEN
+            PinName d7, // D7
+            PinName d6, // D6
+            PinName d5, // D5
+            PinName d4, // D4
+            PinName d3, // D3
+            PinName d2, // D2
+            PinName d1, // D1
+            PinName d0, // D0
+            PinName rt, // /RRST
+            PinName o,  // /OE
+            PinName rc,  // RCLK
+            PinName wrst  // WRST
+    ) : sccb(NULL), camera(bus), vsync(vs), writeReset(wrst), wen(we), data(d0,d1,d2,d3,d4,d5,d6,d7), rrst(rt), oe(o), rclk(rc)
+    {
+        Init(hr, en == o ? NC : en, address);
+        if (en != NC && en == o) {
+            sccbEnable = &oe;
+            sccbEnableOn = 0;
+        }
+    }
+
+    virtual ~OV7670()
+    {
+        delete href;
+        if (sccbEnable != &oe) {
+            delete sccbEnable;
+        }
+        delete sccb;
+    }
+
+    void Init(PinName hr, PinName en, int address)
+    {
+        sccbAddress = address;
+        sccbEnable = NULL;
+        sccbEnableOn = 1;
+        if (en != NC) {
+            sccbEnable = new DigitalOut(en, 0);
+        }
+        SyncFollower = NULL;
+        SyncedToLeader = false;
+        href = NULL;
+        if (hr != NC) {
+            href = new InterruptIn(hr);
+            href->rise(this,&OV7670::HrefHandler);
+        }
         vsync.fall(this,&OV7670::VsyncHandler);
-        href.rise(this,&OV7670::HrefHandler);
         CaptureReq = false;
         Busy = false;
         Done = false;
+        Capturing = false;
         LineCounter = 0;
+        FrameCounter = 0;
+        SensorWidth = WINDOW_WIDTH_MAX;
+        SensorHeight = WINDOW_HEIGHT_MAX;
+        HScale = 1;
+        VScale = 1;
+        WindowWidth = WINDOW_WIDTH_MAX;
+        WindowHeight = WINDOW_HEIGHT_MAX;
+        BytesPerPixel = 2;
+        ClockPrescaler = 1;
+        ClockPll = 1;
         rrst = 1;
         oe = 1;
         rclk = 1;
@@ -80,17 +175,54 @@ public:
         return result;
     }
 
+    // wait for next VSYNC
+    void WaitNextFrame(void)
+    {
+        int frame = FrameCounter;
+        while (FrameCounter == frame);
+    }
+
+    // wait for next VSYNC with timeout (false: no VSYNC)
+    bool WaitNextFrame(int timeoutMs)
+    {
+        Timer timer;
+        int frame = FrameCounter;
+        timer.start();
+        while (FrameCounter == frame) {
+            if (timer.read_ms() >= timeoutMs) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // wait until the capture frame has started (FIFO write enabled)
+    void WaitCaptureStart(void)
+    {
+        while (Busy && !Capturing);
+    }
+
+    // wait until lines [0, lines) are in the FIFO (read while the sensor is still writing)
+    void WaitLinesWritten(int lines)
+    {
+        // HREF of line n starts -> lines before n are complete
+        // without HREF, wait for the whole frame
+        while (Busy && !(href != NULL && Capturing && LineCounter > lines));
+    }
+
     // write to camera
     void WriteReg(int addr,int data)
     {
+        SccbSelect(true);
         // WRITE 0x42,ADDR,DATA
         camera.start();
-        camera.write(OV7670_WRITE);
+        camera.write(sccbAddress);
         wait_us(OV7670_WRITEWAIT);
         camera.write(addr);
         wait_us(OV7670_WRITEWAIT);
         camera.write(data);
         camera.stop();
+        SccbSelect(false);
     }
 
     // read from camera
@@ -98,9 +230,10 @@ public:
     {
         int data;
 
+        SccbSelect(true);
         // WRITE 0x42,ADDR
         camera.start();
-        camera.write(OV7670_WRITE);
+        camera.write(sccbAddress);
         wait_us(OV7670_WRITEWAIT);
         camera.write(addr);
         camera.stop();
@@ -108,14 +241,23 @@ public:
 
         // WRITE 0x43,READ
         camera.start();
-        camera.write(OV7670_READ);
+        camera.write(sccbAddress | 1);
         wait_us(OV7670_WRITEWAIT);
         data = camera.read(OV7670_NOACK);
         camera.stop();
+        SccbSelect(false);
 
         return data;
     }
 
+    // select this camera on a shared SCCB bus
+    void SccbSelect(bool select)
+    {
+        if (sccbEnable != NULL) {
+            *sccbEnable = select ? sccbEnableOn : !sccbEnableOn;
+        }
+    }
+
     // print register
     void PrintRegister(void) {
         printf("AD : +0 +1 +2 +3 +4 +5 +6 +7 +8 +9 +A +B +C +D +E +F");
@@ -133,6 +275,117 @@ public:
     void Reset(void) {
         WriteReg(REG_COM7,COM7_RESET); // RESET CAMERA
         wait_ms(200); // wait for 200ms
+        ClockPrescaler = 1;
+        ClockPll = 1;
+    }
+
+    // reset and poll until the sensor answers again (instead of a fixed wait)
+    bool ResetWait(int timeoutMs) {
+        Timer timer;
+
+        WriteReg(REG_COM7,COM7_RESET); // RESET CAMERA
+        ClockPrescaler = 1;
+        ClockPll = 1;
+
+        timer.start();
+        while (timer.read_ms() < timeoutMs) {
+            wait_ms(1);
+            if ((ReadReg(REG_COM7) & COM7_RESET) == 0 && CheckProductId()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool CheckProductId(void) {
+        return ReadReg(REG_PID) == OV7670_PID && ReadReg(REG_VER) == OV7670_VER;
+    }
+
+    // FNV-1a hash of the registers which define format, window, scaling and clock
+    uint32_t ConfigSignature(void) {
+        static const uint8_t regs[] = {
+            REG_COM7, REG_COM3, REG_COM8, REG_COM13, REG_COM14, REG_COM15, REG_TSLB, REG_RGB444,
+            REG_HSTART, REG_HSTOP, REG_HREF, REG_VSTART, REG_VSTOP,
+            REG_SCALING_DCWCTR, REG_SCALING_PCLK_DIV, REG_CLKRC, REG_DBLV,
+            0x7a, 0x89, 0xc9, // first/last gamma curve value, misc
+        };
+        uint32_t sig = 2166136261u;
+
+        for (unsigned int i = 0; i < sizeof(regs); i++) {
+            sig = (sig ^ ReadReg(regs[i])) * 16777619u;
+        }
+        sig = (sig ^ (ReadReg(REG_VREF) & 0x0f)) * 16777619u; // upper bits are AGC
+        return sig;
+    }
+
+    // rebuild driver state from the registers (warm restart without re-initialising)
+    void LoadState(void) {
+        int hstart, hstop, vstart, vstop;
+        int reg_com7 = ReadReg(REG_COM7);
+        int reg_clkrc = ReadReg(REG_CLKRC);
+        int reg_dblv = ReadReg(REG_DBLV) & DBLV_PLL_MASK;
+
+        BytesPerPixel = ((reg_com7 & COM7_PBAYER) == COM7_BAYER) ? 1 : 2;
+
+        GetHorizontalWindow(&hstart, &hstop);
+        GetVerticalWindow(&vstart, &vstop);
+        SensorWidth = (hstop - hstart + WINDOW_HTOTAL) % WINDOW_HTOTAL;
+        SensorHeight = vstop - vstart;
+        if (ReadReg(REG_COM14) & COM14_DCWEN) {
+            int reg_dcwctr = ReadReg(REG_SCALING_DCWCTR);
+            HScale = 1 << (reg_dcwctr & 0x03);
+            VScale = 1 << ((reg_dcwctr >> DCWCTR_VSHIFT) & 0x03);
+        } else {
+            HScale = 1;
+            VScale = 1;
+        }
+        UpdateWindowSize();
+
+        ClockPrescaler = (reg_clkrc & CLK_EXT) ? 1 : (reg_clkrc & CLK_SCALE) + 1;
+        switch (reg_dblv) {
+            case DBLV_PLL_4X: ClockPll = 4; break;
+            case DBLV_PLL_6X: ClockPll = 6; break;
+            case DBLV_PLL_8X: ClockPll = 8; break;
+            default: ClockPll = 1; break;
+        }
+    }
+
+    // exposure: AECHH[5:0], AECH[7:0], COM1[1:0]
+    int GetExposure(void) {
+        return ((ReadReg(REG_AECHH) & 0x3f) << 10) | (ReadReg(REG_AECH) << 2) | (ReadReg(REG_COM1) & 0x03);
+    }
+
+    // gain: VREF[7:6], GAIN[7:0]
+    int GetGain(void) {
+        return ((ReadReg(REG_VREF) & 0xc0) << 2) | ReadReg(REG_GAIN);
+    }
+
+    // wait until AEC/AGC/AWB results stay unchanged for stableFrames frames
+    bool WaitSettled(int stableFrames, int timeoutMs) {
+        Timer timer;
+        int last[4] = {-1, -1, -1, -1};
+        int stable = 0;
+
+        timer.start();
+        while (timer.read_ms() < timeoutMs) {
+            if (!WaitNextFrame(timeoutMs)) {
+                return false;
+            }
+            int now[4] = {GetExposure(), GetGain(), ReadReg(REG_BLUE), ReadReg(REG_RED)};
+            int tolerance[4] = {(now[0] >> 4) + 1, 1, 2, 2};
+            bool same = true;
+            for (int i = 0; i < 4; i++) {
+                if (abs(now[i] - last[i]) > tolerance[i]) {
+                    same = false;
+                }
+                last[i] = now[i];
+            }
+            stable = same ? stable + 1 : 0;
+            if (stable >= stableFrames) {
+                return true;
+            }
+        }
+        return false;
     }
 
     void InitForFIFOWriteReset(void) {
@@ -143,9 +396,14 @@ public:
     }
 
     void InitSetColorbar(void)  {
-        int reg_com7 = ReadReg(REG_COM7);
+        int reg_com17 = ReadReg(REG_COM17);
         // color bar
-        WriteReg(REG_COM17, reg_com7|COM17_CBAR);
+        WriteReg(REG_COM17, reg_com17|COM17_CBAR);
+    }
+
+    void ClearColorbar(void)  {
+        int reg_com17 = ReadReg(REG_COM17);
+        WriteReg(REG_COM17, reg_com17 & ~COM17_CBAR);
     }
 
     void InitDefaultReg(void) {
@@ -309,6 +567,7 @@ public:
 
     void InitRGB444(void){
         int reg_com7 = ReadReg(REG_COM7);
+        BytesPerPixel = 2;
 
         WriteReg(REG_COM7, reg_com7|COM7_RGB);
         WriteReg(REG_RGB444, RGB444_ENABLE|RGB444_XBGR);
@@ -329,6 +588,7 @@ public:
 
     void InitRGB555(void){
         int reg_com7 = ReadReg(REG_COM7);
+        BytesPerPixel = 2;
 
         WriteReg(REG_COM7, reg_com7|COM7_RGB);
         WriteReg(REG_RGB444, RGB444_DISABLE);
@@ -349,6 +609,7 @@ public:
 
     void InitRGB565(void){
         int reg_com7 = ReadReg(REG_COM7);
+        BytesPerPixel = 2;
 
         WriteReg(REG_COM7, reg_com7|COM7_RGB);
         WriteReg(REG_RGB444, RGB444_DISABLE);
@@ -369,6 +630,7 @@ public:
 
     void InitYUV(void){
         int reg_com7 = ReadReg(REG_COM7);
+        BytesPerPixel = 2;
 
         WriteReg(REG_COM7, reg_com7|COM7_YUV);
         WriteReg(REG_RGB444, RGB444_DISABLE);
@@ -392,6 +654,7 @@ public:
 
     void InitBayerRGB(void){
         int reg_com7 = ReadReg(REG_COM7);
+        BytesPerPixel = 1;
 
         // odd line BGBG... even line GRGR...
         WriteReg(REG_COM7, reg_com7|COM7_BAYER);
@@ -427,58 +690,222 @@ public:
         WriteReg(REG_SCALING_DCWCTR, SCALING_DCWCTR_VGA);
         WriteReg(REG_SCALING_PCLK_DIV, SCALING_PCLK_DIV_VGA);
         WriteReg(REG_SCALING_PCLK_DELAY, SCALING_PCLK_DELAY_VGA);
+
+        SensorWidth = 640;
+        SensorHeight = 480;
+        HScale = 1;
+        VScale = 1;
+        UpdateWindowSize();
     }
 
     void InitFIFO_2bytes_color_nealy_limit_size(void) {
         // nealy FIFO limit 544x360
-        int reg_com7 = ReadReg(REG_COM7);
+        InitVGA();
+        SetWindow(32, 64, 544, 360);
+    }
 
-        WriteReg(REG_COM7,reg_com7|COM7_VGA);
+    void InitVGA_3_4(void) {
+        // VGA 3/4 -> 480x360
+        InitVGA();
+        SetWindow(64, 64, 480, 360);
+    }
 
-        WriteReg(REG_HSTART,HSTART_VGA);
-        WriteReg(REG_HSTOP,HSTOP_VGA);
-        WriteReg(REG_HREF,HREF_VGA);
-        WriteReg(REG_VSTART,VSTART_VGA);
-        WriteReg(REG_VSTOP,VSTOP_VGA);
-        WriteReg(REG_VREF,VREF_VGA);
-        WriteReg(REG_COM3, COM3_VGA);
-        WriteReg(REG_COM14, COM14_VGA);
-        WriteReg(REG_SCALING_XSC, SCALING_XSC_VGA);
-        WriteReg(REG_SCALING_YSC, SCALING_YSC_VGA);
-        WriteReg(REG_SCALING_DCWCTR, SCALING_DCWCTR_VGA);
-        WriteReg(REG_SCALING_PCLK_DIV, SCALING_PCLK_DIV_VGA);
-        WriteReg(REG_SCALING_PCLK_DELAY, SCALING_PCLK_DELAY_VGA);
+    // window (ROI) in VGA pixel coordinates, returns delivered size in WindowWidth/WindowHeight
+    void SetWindow(int x, int y, int w, int h) {
+        // clip to sensor area, width must be even (YUV422 / Bayer pairs)
+        x = min(max(x, 0), WINDOW_WIDTH_MAX - 2) & ~1;
+        y = min(max(y, 0), WINDOW_HEIGHT_MAX - 1);
+        w = min(max(w, 2), WINDOW_WIDTH_MAX - x) & ~1;
+        h = min(max(h, 1), WINDOW_HEIGHT_MAX - y);
+
+        // the right part of the VGA window starts after the end of the line count
+        int hstart = (WINDOW_HSTART_VGA + x) % WINDOW_HTOTAL;
+        int vstart = WINDOW_VSTART_VGA + y;
+        SetHorizontalWindow(hstart, (hstart + w) % WINDOW_HTOTAL);
+        SetVerticalWindow(vstart, vstart + h);
+
+        SensorWidth = w;
+        SensorHeight = h;
+        UpdateWindowSize();
+    }
 
-        WriteReg(REG_HSTART, 0x17);
-        WriteReg(REG_HSTOP, 0x5b);
-        WriteReg(REG_VSTART, 0x12);
-        WriteReg(REG_VSTOP, 0x6c);
+    // delivered size = sensor window / down sampling rate
+    void UpdateWindowSize(void) {
+        WindowWidth = SensorWidth / HScale;
+        WindowHeight = SensorHeight / VScale;
     }
 
-    void InitVGA_3_4(void) {
-        // VGA 3/4 -> 480x360
-        int reg_com7 = ReadReg(REG_COM7);
+    // down sampling (1,2,4,8) for each direction, PCLK is divided by the horizontal rate
+    void SetScaling(int hdiv, int vdiv) {
+        int hlog = ScaleToLog2(hdiv);
+        int vlog = ScaleToLog2(vdiv);
+        int reg_com3 = ReadReg(REG_COM3);
+
+        if (hlog == 0 && vlog == 0) {
+            WriteReg(REG_COM3, reg_com3 & ~COM3_DCWEN);
+            WriteReg(REG_COM14, COM14_VGA);
+            WriteReg(REG_SCALING_DCWCTR, SCALING_DCWCTR_VGA);
+            WriteReg(REG_SCALING_PCLK_DIV, SCALING_PCLK_DIV_VGA);
+        } else {
+            WriteReg(REG_COM3, reg_com3 | COM3_DCWEN);
+            WriteReg(REG_COM14, COM14_DCWEN | COM14_MANUAL | hlog);
+            WriteReg(REG_SCALING_DCWCTR, (vlog << DCWCTR_VSHIFT) | hlog);
+            WriteReg(REG_SCALING_PCLK_DIV, PCLK_DIV_MAGIC | hlog);
+        }
 
-        WriteReg(REG_COM7,reg_com7|COM7_VGA);
+        HScale = 1 << hlog;
+        VScale = 1 << vlog;
+        UpdateWindowSize();
+    }
 
-        WriteReg(REG_HSTART,HSTART_VGA);
-        WriteReg(REG_HSTOP,HSTOP_VGA);
-        WriteReg(REG_HREF,HREF_VGA);
-        WriteReg(REG_VSTART,VSTART_VGA);
-        WriteReg(REG_VSTOP,VSTOP_VGA);
-        WriteReg(REG_VREF,VREF_VGA);
-        WriteReg(REG_COM3, COM3_VGA);
-        WriteReg(REG_COM14, COM14_VGA);
-        WriteReg(REG_SCALING_XSC, SCALING_XSC_VGA);
-        WriteReg(REG_SCALING_YSC, SCALING_YSC_VGA);
-        WriteReg(REG_SCALING_DCWCTR, SCALING_DCWCTR_VGA);
-        WriteReg(REG_SCALING_PCLK_DIV, SCALING_PCLK_DIV_VGA);
-        WriteReg(REG_SCALING_PCLK_DELAY, SCALING_PCLK_DELAY_VGA);
+    int ScaleToLog2(int div) {
+        int n = 0;
+        while (n < 3 && (1 << (n + 1)) <= div) {
+            n++;
+        }
+        return n;
+    }
+
+    // internal clock = XCLK x pll / prescaler (pll: 1,4,6,8  prescaler: 1-64)
+    void SetClock(int prescaler, int pll) {
+        int dblv = ReadReg(REG_DBLV) & ~DBLV_PLL_MASK;
+
+        switch (pll) {
+            case 4: dblv |= DBLV_PLL_4X; break;
+            case 6: dblv |= DBLV_PLL_6X; break;
+            case 8: dblv |= DBLV_PLL_8X; break;
+            default: pll = 1; break;
+        }
+        prescaler = min(max(prescaler, 1), CLK_SCALE + 1);
+
+        // bit 7 of CLKRC is reserved, keep it
+        int clkrc = ReadReg(REG_CLKRC) & ~(CLK_EXT | CLK_SCALE);
+
+        WriteReg(REG_DBLV, dblv);
+        WriteReg(REG_CLKRC, clkrc | (prescaler - 1));
+        ClockPrescaler = prescaler;
+        ClockPll = pll;
+    }
+
+    int GetInternalClock(void) {
+        return (int)((long long)OV7670_XCLK * ClockPll / ClockPrescaler);
+    }
 
-        WriteReg(REG_HSTART, 0x1b);
-        WriteReg(REG_HSTOP, 0x57);
-        WriteReg(REG_VSTART, 0x12);
-        WriteReg(REG_VSTOP, 0x6c);
+    // PCLK seen by the FIFO write port
+    int GetPclk(void) {
+        return GetInternalClock() / HScale;
+    }
+
+    // frame period is 784 x 510 tp, tp = PCLK x bytes per pixel at full resolution
+    float GetFrameRate(void) {
+        return (float)GetInternalClock() / (BytesPerPixel * WINDOW_HTOTAL * WINDOW_VTOTAL);
+    }
+
+    // time to read one frame of the current window out of the FIFO (us)
+    // reads whatever the FIFO holds, call it while no capture is running
+    int MeasureDrainUs(void) {
+        uint8_t buffer[64];
+        int length = WindowWidth * WindowHeight * BytesPerPixel;
+        Timer timer;
+
+        ReadStart();
+        timer.start();
+        for (int done = 0; done < length; done += sizeof(buffer)) {
+            ReadBytes(buffer, min(length - done, (int)sizeof(buffer)));
+        }
+        int us = timer.read_us();
+        ReadStop();
+        return us;
+    }
+
+    // select the clock from the time a frame takes to drain from the FIFO (drainUs)
+    // overlapped (early readout): the capture ends when both the write and the drain are done,
+    // so the slowest clock whose frame fits in the drain time is as fast as any; otherwise the
+    // fastest clock. PCLK stays below maxPclk (FIFO write limit)
+    // returns frame rate, 0 if the write and the drain take longer than maxFrameMs
+    float AutoClock(int maxPclk, int maxFrameMs, int drainUs, bool overlapped) {
+        static const int plls[] = {8, 6, 4, 1};
+        long long frameTp = (long long)BytesPerPixel * WINDOW_HTOTAL * WINDOW_VTOTAL;
+        int fastest = 0, fastestPrescaler = 1, fastestPll = 1;
+
+        for (int i = 0; i < 4; i++) {
+            for (int pre = 1; pre <= CLK_SCALE + 1; pre++) {
+                int clock = (int)((long long)OV7670_XCLK * plls[i] / pre);
+                if (clock > OV7670_PCLK_MAX || clock / HScale > maxPclk) {
+                    continue;
+                }
+                if (clock > fastest) {
+                    fastest = clock;
+                    fastestPrescaler = pre;
+                    fastestPll = plls[i];
+                }
+                break; // larger prescaler is only slower
+            }
+        }
+        if (fastest == 0) {
+            return 0;
+        }
+
+        long long frameUs = frameTp * 1000000 / fastest;
+        int bestClock = fastest, bestPrescaler = fastestPrescaler, bestPll = fastestPll;
+        if (overlapped && frameUs < drainUs) {
+            for (int i = 0; i < 4; i++) {
+                for (int pre = 1; pre <= CLK_SCALE + 1; pre++) {
+                    int clock = (int)((long long)OV7670_XCLK * plls[i] / pre);
+                    if (clock > fastest) {
+                        continue;
+                    }
+                    if (frameTp * 1000000 > (long long)drainUs * clock) {
+                        break; // larger prescaler is only slower
+                    }
+                    if (clock < bestClock) {
+                        bestClock = clock;
+                        bestPrescaler = pre;
+                        bestPll = plls[i];
+                    }
+                }
+            }
+            frameUs = frameTp * 1000000 / bestClock;
+        }
+
+        SetClock(bestPrescaler, bestPll);
+        long long captureUs = overlapped ? max(frameUs, (long long)drainUs) : frameUs + drainUs;
+        if (captureUs > (long long)maxFrameMs * 1000) {
+            return 0;
+        }
+        return GetFrameRate();
+    }
+
+    // horizontal window (HSTART/HSTOP are 11 bits, low 3 bits in REG_HREF)
+    void SetHorizontalWindow(int hstart, int hstop) {
+        int reg_href = ReadReg(REG_HREF);
+
+        WriteReg(REG_HSTART, (hstart >> 3) & 0xff);
+        WriteReg(REG_HSTOP, (hstop >> 3) & 0xff);
+        WriteReg(REG_HREF, (reg_href & 0xc0) | ((hstop & 0x07) << 3) | (hstart & 0x07));
+    }
+
+    void GetHorizontalWindow(int *hstart, int *hstop) {
+        int reg_href = ReadReg(REG_HREF);
+
+        *hstart = (ReadReg(REG_HSTART) << 3) | (reg_href & 0x07);
+        *hstop = (ReadReg(REG_HSTOP) << 3) | ((reg_href >> 3) & 0x07);
+    }
+
+    // vertical window (VSTART/VSTOP are 10 bits, low 2 bits in REG_VREF)
+    void SetVerticalWindow(int vstart, int vstop) {
+        int reg_vref = ReadReg(REG_VREF);
+
+        WriteReg(REG_VSTART, (vstart >> 2) & 0xff);
+        WriteReg(REG_VSTOP, (vstop >> 2) & 0xff);
+        WriteReg(REG_VREF, (reg_vref & 0xf0) | ((vstop & 0x03) << 2) | (vstart & 0x03));
+    }
+
+    void GetVerticalWindow(int *vstart, int *vstop) {
+        int reg_vref = ReadReg(REG_VREF);
+
+        *vstart = (ReadReg(REG_VSTART) << 2) | (reg_vref & 0x03);
+        *vstop = (ReadReg(REG_VSTOP) << 2) | ((reg_vref >> 2) & 0x03);
     }
 
     void InitQVGA(void) {
@@ -500,6 +927,12 @@ public:
         WriteReg(REG_SCALING_DCWCTR, SCALING_DCWCTR_QVGA);
         WriteReg(REG_SCALING_PCLK_DIV, SCALING_PCLK_DIV_QVGA);
         WriteReg(REG_SCALING_PCLK_DELAY, SCALING_PCLK_DELAY_QVGA);
+
+        SensorWidth = 640;
+        SensorHeight = 480;
+        HScale = 2;
+        VScale = 2;
+        UpdateWindowSize();
     }
 
     void InitQQVGA(void) {
@@ -521,18 +954,35 @@ public:
         WriteReg(REG_SCALING_DCWCTR, SCALING_DCWCTR_QQVGA);
         WriteReg(REG_SCALING_PCLK_DIV, SCALING_PCLK_DIV_QQVGA);
         WriteReg(REG_SCALING_PCLK_DELAY, SCALING_PCLK_DELAY_QQVGA);
+
+        SensorWidth = 640;
+        SensorHeight = 480;
+        HScale = 4;
+        VScale = 4;
+        UpdateWindowSize();
     }
 
     // vsync handler
     void VsyncHandler(void)
+    {
+        if (!SyncedToLeader) {
+            FrameStart();
+        }
+        FrameCounter++;
+    }
+
+    // start or stop the FIFO write at a frame boundary, then that of the follower
+    void FrameStart(void)
     {
         // Capture Enable
         if (CaptureReq) {
             wen = 1;
+            Capturing = true;
             Done = false;
             CaptureReq = false;
         } else {
             wen = 0;
+            Capturing = false;
             if (Busy) {
                 Busy = false;
                 Done = true;
@@ -542,6 +992,10 @@ public:
         // Hline Counter
         LastLines = LineCounter;
         LineCounter = 0;
+
+        if (SyncFollower != NULL) {
+            SyncFollower->FrameStart();
+        }
     }
 
     // href handler
@@ -551,7 +1005,7 @@ public:
     }
 
     // Data Read
-    int ReadOneByte(void)
+    virtual int ReadOneByte(void)
     {
         int result;
         rclk = 1;
@@ -561,6 +1015,20 @@ public:
         return result;
     }
 
+    // Data Read (length bytes)
+    virtual void ReadBytes(uint8_t *buffer, int length)
+    {
+        for (int i = 0; i < length; i++) {
+            buffer[i] = (uint8_t) OV7670::ReadOneByte();
+        }
+    }
+
+    // drive the (shared) data bus from this FIFO
+    void SelectOutput(bool select)
+    {
+        oe = select ? 0 : 1;
+    }
+
     // Data Start
     void ReadStart(void)
     {
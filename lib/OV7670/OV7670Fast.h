@@ -0,0 +1,101 @@
+#ifndef OV7670_OV7670FAST_H
+#define OV7670_OV7670FAST_H
+
+#include "OV7670.h"
+
+#define OV7670_GPIO_PORTS (5)
+
+// compile-time pin set for the FIFO read path
+// LPC1768: PinName is the GPIO port base address + bit number
+template <PinName D7, PinName D6, PinName D5, PinName D4, PinName D3, PinName D2, PinName D1, PinName D0, PinName RCLK>
+struct OV7670Pins {
+
+    static inline LPC_GPIO_TypeDef *Gpio(int port)
+    {
+        return (LPC_GPIO_TypeDef *) (LPC_GPIO0_BASE + (port << 5));
+    }
+
+    static inline int Port(PinName pin)
+    {
+        return ((uint32_t) pin - LPC_GPIO0_BASE) >> 5;
+    }
+
+    static inline int Bit(const uint32_t *ports, PinName pin, int bit)
+    {
+        return ((ports[Port(pin)] >> ((uint32_t) pin & 0x1F)) & 1) << bit;
+    }
+
+    static inline bool Uses(int port)
+    {
+        return Port(D0) == port || Port(D1) == port || Port(D2) == port || Port(D3) == port
+            || Port(D4) == port || Port(D5) == port || Port(D6) == port || Port(D7) == port;
+    }
+
+    // sample D7-D0 with one FIOPIN read per used port
+    static inline int ReadData(void)
+    {
+        uint32_t ports[OV7670_GPIO_PORTS];
+        for (int i = 0; i < OV7670_GPIO_PORTS; i++) {
+            ports[i] = Uses(i) ? Gpio(i)->FIOPIN : 0;
+        }
+        return Bit(ports, D0, 0) | Bit(ports, D1, 1) | Bit(ports, D2, 2) | Bit(ports, D3, 3)
+             | Bit(ports, D4, 4) | Bit(ports, D5, 5) | Bit(ports, D6, 6) | Bit(ports, D7, 7);
+    }
+
+    static inline void RclkHigh(void)
+    {
+        Gpio(Port(RCLK))->FIOSET = 1u << ((uint32_t) RCLK & 0x1F);
+    }
+
+    static inline void RclkLow(void)
+    {
+        Gpio(Port(RCLK))->FIOCLR = 1u << ((uint32_t) RCLK & 0x1F);
+    }
+};
+
+// OV7670 with the FIFO read path bound to a compile-time pin set
+template <class Pins>
+class OV7670Fast : public OV7670 {
+public:
+
+    OV7670Fast (
+            PinName sda, PinName scl,
+            PinName vs, PinName hr, PinName we,
+            PinName d7, PinName d6, PinName d5, PinName d4, PinName d3, PinName d2, PinName d1, PinName d0,
+            PinName rt, PinName o, PinName rc, PinName wrst
+    ) : OV7670(sda, scl, vs, hr, we, d7, d6, d5, d4, d3, d2, d1, d0, rt, o, rc, wrst)
+    {
+    }
+
+    OV7670Fast (
+            I2C &bus, PinName en, int address,
+            PinName vs, PinName hr, PinName we,
+            PinName d7, PinName d6, PinName d5, PinName d4, PinName d3, PinName d2, PinName d1, PinName d0,
+            PinName rt, PinName o, PinName rc, PinName wrst
+    ) : OV7670(bus, en, address, vs, hr, we, d7, d6, d5, d4, d3, d2, d1, d0, rt, o, rc, wrst)
+    {
+    }
+
+    // Data Read
+    virtual int ReadOneByte(void)
+    {
+        int result;
+        Pins::RclkHigh();
+        __NOP(); // AL422B access time after RCK
+        result = Pins::ReadData();
+        Pins::RclkLow();
+        return result;
+    }
+
+    // Data Read (length bytes)
+    virtual void ReadBytes(uint8_t *buffer, int length)
+    {
+        for (int i = 0; i < length; i++) {
+            Pins::RclkHigh();
+            __NOP();
+            buffer[i] = (uint8_t) Pins::ReadData();
+            Pins::RclkLow();
+        }
+    }
+};
+#endif //OV7670_OV7670FAST_H
@@ -0,0 +1,84 @@
+#ifndef OV7670_OV7670GROUP_H
+#define OV7670_OV7670GROUP_H
+
+#include "OV7670.h"
+
+#define OV7670GROUP_MAX (4)
+
+// capture coordinator for several cameras sharing the data bus and the SD writer
+class OV7670Group {
+public:
+
+    OV7670 *cameras[OV7670GROUP_MAX];
+    int count;
+    bool early;
+    int margin;
+
+    OV7670Group() : count(0), early(false), margin(1)
+    {
+    }
+
+    // add camera, returns index (-1: full). The FIFO writes of the cameras added
+    // later follow the VSYNC of the first one
+    int Add(OV7670 *cam)
+    {
+        if (count >= OV7670GROUP_MAX) {
+            return -1;
+        }
+        if (count > 0) {
+            cameras[count - 1]->SyncFollower = cam;
+            cam->SyncedToLeader = true;
+        }
+        cameras[count] = cam;
+        return count++;
+    }
+
+    // arm every camera, the next VSYNC of the first one starts all FIFO writes
+    // and the one after stops them, so all cameras capture the same frame
+    // period (exact line sync needs a common XCLK)
+    void CaptureStart(bool earlyReadout)
+    {
+        early = earlyReadout;
+
+        __disable_irq();
+        for (int i = 0; i < count; i++) {
+            cameras[i]->InitForFIFOWriteReset();
+            cameras[i]->CaptureNext();
+        }
+        __enable_irq();
+
+        for (int i = 0; i < count; i++) {
+            if (early) {
+                cameras[i]->WaitCaptureStart();
+            } else {
+                while (cameras[i]->CaptureDone() == false);
+            }
+            cameras[i]->ReadStart();
+            cameras[i]->SelectOutput(false);
+        }
+    }
+
+    // read one row of a camera, only this FIFO drives the data bus while reading
+    void ReadRow(int index, uint8_t *buffer, int length, int row)
+    {
+        OV7670 *cam = cameras[index];
+
+        if (early) {
+            cam->WaitLinesWritten(row + 1 + margin);
+        }
+        cam->SelectOutput(true);
+        cam->ReadBytes(buffer, length);
+        cam->SelectOutput(false);
+    }
+
+    void CaptureStop(void)
+    {
+        for (int i = 0; i < count; i++) {
+            cameras[i]->ReadStop();
+            if (early) {
+                while (cameras[i]->CaptureDone() == false);
+            }
+        }
+    }
+};
+#endif //OV7670_OV7670GROUP_H
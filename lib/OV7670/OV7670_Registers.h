@@ -33,6 +33,16 @@
 #define SCALING_PCLK_DIV_VGA        0xf0
 #define SCALING_PCLK_DELAY_VGA      0x02
 
+// window geometry (VGA)
+// HSTART/HSTOP: 11 bits, high 8 bits in REG_HSTART/REG_HSTOP, low 3 bits in REG_HREF[2:0]/[5:3]
+// VSTART/VSTOP: 10 bits, high 8 bits in REG_VSTART/REG_VSTOP, low 2 bits in REG_VREF[1:0]/[3:2]
+#define WINDOW_HSTART_VGA           158     /* (HSTART_VGA << 3) | (HREF_VGA & 0x07) */
+#define WINDOW_VSTART_VGA           10      /* (VSTART_VGA << 2) | (VREF_VGA & 0x03) */
+#define WINDOW_HTOTAL               784     /* HSTOP wraps around at this count */
+#define WINDOW_WIDTH_MAX            640
+#define WINDOW_HEIGHT_MAX           480
+#define WINDOW_VTOTAL               510     /* lines per frame incl. vertical blank */
+
 // QVGA setting
 #define COM7_QVGA                   0x00
 #define HSTART_QVGA                 0x16
@@ -165,6 +175,11 @@
 #define REG_GFIX                    0x69    /* Fix gain control */
 #define REG_GGAIN                   0x6a
 #define REG_DBLV                    0x6b
+#define DBLV_PLL_BYPASS             0x00    /* PLL bypass */
+#define DBLV_PLL_4X                 0x40    /* input clock x4 */
+#define DBLV_PLL_6X                 0x80    /* input clock x6 */
+#define DBLV_PLL_8X                 0xc0    /* input clock x8 */
+#define DBLV_PLL_MASK               0xc0
 
 #define REG_COM9        0x14        // Control 9  - gain ceiling
 #define COM9_AGC_2X     0x00
@@ -236,6 +251,10 @@
 #define REG_COM12       0x3c    /* Control 12 */
 #define COM12_HREF      0x80    /* HREF always */
 #define COM14_DCWEN     0x10    /* DCW/PCLK-scale enable */
+#define COM14_MANUAL    0x08    /* Manual scaling enable */
+#define COM14_PCLK_MASK 0x07    /* PCLK divider (0:/1 1:/2 2:/4 3:/8 4:/16) */
+#define DCWCTR_VSHIFT   4       /* Vertical down sampling rate bits [5:4] */
+#define PCLK_DIV_MAGIC  0xf0    /* reserved bits of REG_SCALING_PCLK_DIV */
 #define REG_EDGE        0x3f    /* Edge enhancement factor */
 #define REG_COM16       0x41    /* Control 16 */
 #define COM16_AWBGAIN   0x08    /* AWB gain enable */
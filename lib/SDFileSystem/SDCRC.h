@@ -0,0 +1,20 @@
+/* CRC7 and CRC16 of the SD card protocol
+ */
+#ifndef MBED_SDCRC_H
+#define MBED_SDCRC_H
+
+#include <stdint.h>
+
+/** CRC7 of an SD command frame (x^7 + x^3 + 1)
+ *
+ * @param data   command, argument
+ * @param length number of bytes, 5 for a command
+ * @returns the CRC byte to send: crc[6:0] and the end bit
+ */
+uint8_t sd_crc7(const uint8_t *data, uint32_t length);
+
+/** CRC16 of an SD data block (CCITT, x^16 + x^12 + x^5 + 1, initial 0)
+ */
+uint16_t sd_crc16(const uint8_t *data, uint32_t length);
+
+#endif
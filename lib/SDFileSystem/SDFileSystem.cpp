@@ -60,8 +60,9 @@
  * just always use the Standard Capacity cards with a block size of 512 bytes.
  * This is set with CMD16.
  *
- * You can read and write single blocks (CMD17, CMD25) or multiple blocks
- * (CMD18, CMD25). For simplicity, I'll just use single block accesses. When
+ * You can read and write single blocks (CMD17, CMD24) or multiple blocks
+ * (CMD18, CMD25). Single block accesses are used for one sector, and runs of
+ * contiguous sectors are transferred as one multiple block command. When
  * the card gets a read command, it responds with a response token, and then
  * a data token or an error.
  *
@@ -73,7 +74,8 @@
  * | 01 | cmd[5:0] | arg[31:24] | arg[23:16] | arg[15:8] | arg[7:0] | crc[6:0] | 1 |
  * +---------------+------------+------------+-----------+----------+--------------+
  *
- * As I'm not using CRC, I can fix that byte to what is needed for CMD0 (0x95)
+ * The CRC7 is always computed (CMD0 and CMD8 need it), but the card only
+ * checks it after CRC mode is switched on with CMD59.
  *
  * All Application Specific commands shall be preceded with APP_CMD (CMD55).
  *
@@ -111,21 +113,163 @@
  * +------+---------+---------+- -  - -+---------+-----------+----------+
  * | 0xFE | data[0] | data[1] |        | data[n] | crc[15:8] | crc[7:0] |
  * +------+---------+---------+- -  - -+---------+-----------+----------+
+ *
+ * Multiple Block Read and Write
+ * -----------------------------
+ *
+ * CMD18 streams 0xFE-tokened blocks until CMD12 (STOP_TRANSMISSION) is sent.
+ * CMD25 takes blocks with the 0xFC start token, each acknowledged by a data
+ * response token and busy, and is terminated by the 0xFD stop token. ACMD23
+ * (SET_WR_BLK_ERASE_COUNT) tells the card how many blocks follow so it can
+ * pre-erase them.
  */
 #include "SDFileSystem.h"
 #include "mbed_debug.h"
+#include "SDCRC.h"
+#include "diskio.h"
 
 #define SD_COMMAND_TIMEOUT 5000
+#define SD_CRC_RETRIES     3
+
+// time limits of the waits for the card. The SD spec allows 100ms for a read
+// and 250ms (SDHC) to 500ms (SDXC) of busy after a write; erases without the
+// SD Status timing get SD_ERASE_TIMEOUT_MS per erase unit
+#define SD_READ_TIMEOUT_MS  100
+#define SD_WRITE_TIMEOUT_MS 500
+#define SD_ERASE_TIMEOUT_MS 250
+
+// attempts of a failed transfer, SD_RETRY_DELAY_US apart, doubling
+#define SD_MAX_RETRIES      5
+#define SD_RETRY_DELAY_US   100
+#define SD_RA_MIN_WINDOW   2       // read-ahead window after a wasted prefetch
+
+// card initialisation: the spec gives ACMD41 up to 1s, polled with a delay
+// growing from SD_INIT_POLL_MIN_US to SD_INIT_POLL_MAX_US
+#define SD_INIT_TIMEOUT_MS  1000
+#define SD_INIT_POLL_MIN_US 250
+#define SD_INIT_POLL_MAX_US 8000
+#define SD_CMD0_RETRIES     3
+
+#define SD_BLOCK_SIZE      512
+#define SD_TOKEN_START     0xFE    // single block read/write, multiple block read
+#define SD_TOKEN_START_MBW 0xFC    // multiple block write
+#define SD_TOKEN_STOP_MBW  0xFD    // stop multiple block write
 
 #define SD_DBG             0
 
+// asynchronous write states
+#define SD_ASYNC_IDLE      0
+#define SD_ASYNC_DATA      1   // block data in flight on the transport
+#define SD_ASYNC_SENT      2   // block data sent, data response pending
+#define SD_ASYNC_BUSY      3   // waiting for the card to finish programming
+
+// add one operation that took us to a latency histogram
+static void sd_latency_add(SDLatency &latency, uint32_t us) {
+    latency.count++;
+    latency.total_us += us;
+    if (us > latency.max_us) {
+        latency.max_us = us;
+    }
+    int bucket = (us >> 6) ? 31 - __builtin_clz(us >> 6) : 0;
+    if (bucket >= SD_LATENCY_BUCKETS) {
+        bucket = SD_LATENCY_BUCKETS - 1;
+    }
+    latency.histogram[bucket]++;
+}
+
+// SPI clock rates tried for data transfer, fastest first
+static const uint32_t sd_sck_steps[] = {
+    25000000, 20000000, 12000000, 8000000, 4000000, 1000000, 400000
+};
+#define SD_SCK_STEPS (int)(sizeof(sd_sck_steps) / sizeof(sd_sck_steps[0]))
+
+// transfers without an error at a lowered clock before the negotiated clock
+// is tried again, doubled each time up to the maximum
+#define SD_SCK_RESTORE_TRANSFERS 64
+#define SD_SCK_RESTORE_MAX       4096
+
 SDFileSystem::SDFileSystem(PinName mosi, PinName miso, PinName sclk, PinName cs, const char* name) :
-    FATFileSystem(name), _spi(mosi, miso, sclk), _cs(cs), _is_initialized(0) {
-    _cs = 1;
+    FATFileSystem(name), _is_initialized(0) {
+    _transport = new SDSPITransport(mosi, miso, sclk, cs);
+    _own_transport = true;
+    _init();
+}
+
+SDFileSystem::SDFileSystem(SDTransport &transport, const char* name) :
+    FATFileSystem(name), _is_initialized(0) {
+    _transport = &transport;
+    _own_transport = false;
+    _init();
+}
+
+SDFileSystem::~SDFileSystem() {
+    free(_ra_pool);
+    if (_own_transport) {
+        delete _transport;
+    }
+}
+
+void SDFileSystem::_init() {
+    _transport->select(false);
+    _transport->attach(&SDFileSystem::_async_done, this);
+
+    // Set default to 400kHz (the most the spec allows) for initialisation and
+    // up to 25MHz for data transfer, lowered to what the card and the wiring
+    // can do by _negotiate_sck()
+    _init_sck = 400000;
+    _transfer_sck = 25000000;
+    _sck = _init_sck;
+    _sck_step = 0;
+    _good_sck = _init_sck;
+    _good_step = 0;
+    _clean_transfers = 0;
+    _restore_after = SD_SCK_RESTORE_TRANSFERS;
+    memset(_csd, 0, sizeof(_csd));
+    memset(_cid, 0, sizeof(_cid));
+    memset(_ssr, 0, sizeof(_ssr));
+    memset(&_info, 0, sizeof(_info));
+    _ocr = 0;
+    _erase_on = true;
+    _erased = 0;
+    _init_us = 0;
+    _init_polls = 0;
+
+    _streaming = false;
+    _stream_open = false;
+    _stream_first = 0;
+    _stream_next = 0;
+    _uncommitted = 0;
+    _lost_error = 0;
+
+    _async_state = SD_ASYNC_IDLE;
+    _async_result = 0;
+
+    _crc_on = false;
+
+    _card_busy = false;
+    _busy_timeout_ms = SD_WRITE_TIMEOUT_MS;
+    _async_busy_us = 0;
+    _last_error = 0;
+    reset_stats();
+    _stats_timer.start();
 
-    // Set default to 100kHz for initialisation and 1MHz for data transfer
-    _init_sck = 100000;
-    _transfer_sck = 1000000;
+    _ra_pool = NULL;
+    _ra_max = 0;
+    _ra_window = 0;
+    _ra_start = 0;
+    _ra_count = 0;
+    _ra_offset = 0;
+    _ra_next = 0;
+    _ra_last = 0;
+    reset_readahead_stats();
+}
+
+void SDFileSystem::set_streaming(bool enable) {
+    _async_wait();
+    if (!enable) {
+        _stream_stop();
+    }
+    _streaming = enable;
 }
 
 #define R1_IDLE_STATE           (1 << 0)
@@ -136,32 +280,34 @@ SDFileSystem::SDFileSystem(PinName mosi, PinName miso, PinName sclk, PinName cs,
 #define R1_ADDRESS_ERROR        (1 << 5)
 #define R1_PARAMETER_ERROR      (1 << 6)
 
-// Types
-//  - v1.x Standard Capacity
-//  - v2.x Standard Capacity
-//  - v2.x High Capacity
-//  - Not recognised as an SD Card
-#define SDCARD_FAIL 0
-#define SDCARD_V1   1
-#define SDCARD_V2   2
-#define SDCARD_V2HC 3
+#define OCR_CCS                 (1 << 30)   // card capacity status: block addressed
+
+// card type flags of MMC_GET_TYPE, as in ChaN's MMC drivers
+#define SD_CT_SD1               0x02
+#define SD_CT_SD2               0x04
+#define SD_CT_BLOCK             0x08
 
 int SDFileSystem::initialise_card() {
     // Set to SCK for initialisation, and clock card with cs = 1
-    _spi.frequency(_init_sck);
-    _cs = 1;
+    _transport->frequency(_init_sck);
+    _transport->select(false);
     for (int i = 0; i < 16; i++) {
-        _spi.write(0xFF);
+        _transport->write(0xFF);
     }
 
-    // send CMD0, should return with all zeros except IDLE STATE set (bit 0)
-    if (_cmd(0, 0) != R1_IDLE_STATE) {
+    // send CMD0, should return with all zeros except IDLE STATE set (bit 0).
+    // A card still finishing a previous transfer may need it more than once
+    int r = -1;
+    for (int i = 0; i < SD_CMD0_RETRIES && r != R1_IDLE_STATE; i++) {
+        r = _cmd(0, 0);
+    }
+    if (r != R1_IDLE_STATE) {
         debug("No disk, or could not put SD card in to SPI idle state\n");
         return SDCARD_FAIL;
     }
 
     // send CMD8 to determine whther it is ver 2.x
-    int r = _cmd8();
+    r = _cmd8();
     if (r == R1_IDLE_STATE) {
         return initialise_card_v2();
     } else if (r == (R1_IDLE_STATE | R1_ILLEGAL_COMMAND)) {
@@ -173,13 +319,10 @@ int SDFileSystem::initialise_card() {
 }
 
 int SDFileSystem::initialise_card_v1() {
-    for (int i = 0; i < SD_COMMAND_TIMEOUT; i++) {
-        _cmd(55, 0);
-        if (_cmd(41, 0) == 0) {
-            cdv = 512;
-            debug_if(SD_DBG, "\n\rInit: SEDCARD_V1\n\r");
-            return SDCARD_V1;
-        }
+    if (_acmd41(0) == 0) {
+        cdv = 512;
+        debug_if(SD_DBG, "\n\rInit: SEDCARD_V1\n\r");
+        return SDCARD_V1;
     }
 
     debug("Timeout waiting for v1.x card\n");
@@ -187,23 +330,72 @@ int SDFileSystem::initialise_card_v1() {
 }
 
 int SDFileSystem::initialise_card_v2() {
-    for (int i = 0; i < SD_COMMAND_TIMEOUT; i++) {
-        wait_ms(50);
+    // HCS: the host supports high capacity cards
+    if (_acmd41(0x40000000) == 0) {
+        // the OCR is valid once the card is ready: CCS tells SDHC/SDXC
         _cmd58();
-        _cmd(55, 0);
-        if (_cmd(41, 0x40000000) == 0) {
-            _cmd58();
-            debug_if(SD_DBG, "\n\rInit: SDCARD_V2\n\r");
+        if (_ocr & OCR_CCS) {
+            debug_if(SD_DBG, "\n\rInit: SDCARD_V2HC\n\r");
             cdv = 1;
-            return SDCARD_V2;
+            return SDCARD_V2HC;
         }
+        debug_if(SD_DBG, "\n\rInit: SDCARD_V2\n\r");
+        cdv = 512;
+        return SDCARD_V2;
     }
 
     debug("Timeout waiting for v2.x card\n");
     return SDCARD_FAIL;
 }
 
+// poll ACMD41 until the card leaves the idle state. The first polls follow
+// each other directly, most cards are ready within a few ms, then the delay
+// doubles up to SD_INIT_POLL_MAX_US until SD_INIT_TIMEOUT_MS
+int SDFileSystem::_acmd41(int arg) {
+    Timer timer;
+    timer.start();
+    int delay_us = 0;
+    for (int polls = 1; ; polls++) {
+        _init_polls++;
+        _cmd(55, 0);
+        int r = _cmd(41, arg);
+        if (r == 0) {
+            return 0;
+        }
+        if (r != R1_IDLE_STATE || timer.read_ms() > SD_INIT_TIMEOUT_MS) {
+            return -1;
+        }
+        if (delay_us > 0) {
+            wait_us(delay_us);
+        }
+        if (polls >= 2) {
+            delay_us = delay_us == 0 ? SD_INIT_POLL_MIN_US : delay_us * 2;
+            if (delay_us > SD_INIT_POLL_MAX_US) {
+                delay_us = SD_INIT_POLL_MAX_US;
+            }
+        }
+    }
+}
+
 int SDFileSystem::disk_initialize() {
+    Timer timer;
+    timer.start();
+    _init_polls = 0;
+
+    // a transfer left open is discarded by the reset (CMD0), with the
+    // blocks the card had not programmed yet
+    _async_wait();
+    _stream_open = false;
+    _card_busy = false;
+    if (_uncommitted > 0) {
+        debug("SD card reset in a multiple block write, blocks %u to %u may be lost\n",
+              (unsigned)_stream_first, (unsigned)(_stream_first + _uncommitted - 1));
+        _stats.lost_sectors += _uncommitted;
+        _uncommitted = 0;
+        _lost_error = SD_ERROR;
+    }
+    _ra_drop();
+    _erased = 0;
     _is_initialized = initialise_card();
     if (_is_initialized == 0) {
         debug("Fail to initialize card\n");
@@ -212,14 +404,26 @@ int SDFileSystem::disk_initialize() {
     debug_if(SD_DBG, "init card = %d\n", _is_initialized);
     _sectors = _sd_sectors();
 
+    // Switch CRC checking on or off (CMD59)
+    if (_cmd(59, _crc_on ? 1 : 0) != 0) {
+        debug("CRC mode not accepted\n");
+        _crc_on = false;
+    }
+
     // Set block length to 512 (CMD16)
     if (_cmd(16, 512) != 0) {
         debug("Set 512-byte block timed out\n");
+        _is_initialized = 0;
         return 1;
     }
 
     // Set SCK for data transfer
-    _spi.frequency(_transfer_sck);
+    _negotiate_sck();
+    _sck_keep();
+
+    _read_card_info();
+    _init_us = timer.read_us();
+    debug_if(SD_DBG, "init %d us, %d ACMD41 polls\n", _init_us, _init_polls);
     return 0;
 }
 
@@ -227,38 +431,186 @@ int SDFileSystem::disk_write(const uint8_t* buffer, uint32_t block_number, uint3
     if (!_is_initialized) {
         return -1;
     }
-    
-    for (uint32_t b = block_number; b < block_number + count; b++) {
-        // set write address for single block (CMD24)
-        if (_cmd(24, b * cdv) != 0) {
-            return 1;
+    uint32_t start_us = _stats_timer.read_us();
+    uint32_t busy_us = _stats.busy.total_us;
+    _stats.written_sectors += count;
+
+    _async_wait();
+    _ra_update(buffer, block_number, count);
+
+    int result;
+    for (int attempt = 0; ; attempt++) {
+        _last_error = SD_ERROR;
+        if (_disk_write(buffer, block_number, count) == 0) {
+            if (attempt == 0) {
+                _sck_clean();
+            }
+            result = 0;
+            break;
+        }
+        result = _last_error;
+        if (_recover(result, attempt) != 0) {
+            break;
         }
-        
-        // send the data block
-        _write(buffer, 512);
-        buffer += 512;
     }
-    
-    return 0;
+    _account(_stats.write, start_us, busy_us);
+    return result;
 }
 
 int SDFileSystem::disk_read(uint8_t* buffer, uint32_t block_number, uint32_t count) {
     if (!_is_initialized) {
         return -1;
     }
-    
-    for (uint32_t b = block_number; b < block_number + count; b++) {
+    uint32_t start_us = _stats_timer.read_us();
+    uint32_t busy_us = _stats.busy.total_us;
+    _stats.read_sectors += count;
+
+    _async_wait();
+
+    int result;
+    if (_ra_pool) {
+        result = _ra_read(buffer, block_number, count);
+    } else {
+        result = _read_retry(buffer, block_number, count);
+    }
+    _account(_stats.read, start_us, busy_us);
+    return result;
+}
+
+int SDFileSystem::_read_retry(uint8_t* buffer, uint32_t block_number, uint32_t count) {
+    for (int attempt = 0; ; attempt++) {
+        _last_error = SD_ERROR;
+        if (_disk_read(buffer, block_number, count) == 0) {
+            if (attempt == 0) {
+                _sck_clean();
+            }
+            return 0;
+        }
+        int result = _last_error;
+        if (_recover(result, attempt) != 0) {
+            return result;
+        }
+    }
+}
+
+// decide whether a failed transfer gets another attempt. CRC errors and
+// garbled data tokens are retried at the same clock first and then at the
+// next slower SPI clock, other bus errors at the same clock, and a card that
+// stopped answering or reset itself is initialised again. A command or block
+// the card refused is tried once more only
+// returns 0 to try again, 1 to give up
+int SDFileSystem::_recover(int error, int attempt) {
+    int give_up = attempt + 1 >= SD_MAX_RETRIES;
+    if (!give_up) {
+        switch (error) {
+            case SD_ERROR_CRC:
+            case SD_ERROR_TOKEN:
+                give_up = attempt >= SD_CRC_RETRIES && _sck_backoff() != 0;
+                break;
+            case SD_ERROR_TIMEOUT:
+            case SD_ERROR_RESET:
+                give_up = _reinitialize() != 0;
+                break;
+            case SD_ERROR_CARD:
+                give_up = attempt > 0;
+                break;
+            default:
+                break;
+        }
+    }
+    if (give_up) {
+        _stats.failures++;
+        debug("SD transfer failed, error %d after %d attempts\n", error, attempt + 1);
+        return 1;
+    }
+    _stats.retries++;
+    wait_us(SD_RETRY_DELAY_US << attempt);
+    return 0;
+}
+
+// initialise the card again in place, keeping the CRC mode. On failure the
+// card stays uninitialised, so FatFs initialises and remounts it on the next
+// access
+int SDFileSystem::_reinitialize() {
+    _stats.reinits++;
+    debug("SD card not responding, initialising it again\n");
+    return disk_initialize() != 0;
+}
+
+int SDFileSystem::_disk_write(const uint8_t* buffer, uint32_t block_number, uint32_t count) {
+    if (_streaming) {
+        // continue the open transfer only when the write is contiguous
+        if (_stream_open && block_number != _stream_next) {
+            _stream_stop();
+        }
+        if (!_stream_open && _stream_start(block_number) != 0) {
+            return 1;
+        }
+        if (_write_blocks(buffer, count) != 0) {
+            _stream_stop();
+            return 1;
+        }
+        _stream_next = block_number + count;
+        _uncommitted = _stream_next - _stream_first;
+        return 0;
+    }
+
+    if (count == 1) {
+        // set write address for single block (CMD24)
+        if (_cmd(24, block_number * cdv) != 0) {
+            return 1;
+        }
+
+        // send the data block
+        return _write(buffer, SD_BLOCK_SIZE);
+    }
+
+    // pre-erase the blocks to be written (ACMD23), optional for the card
+    _cmd(55, 0);
+    _cmd(23, count);
+
+    if (_stream_start(block_number) != 0) {
+        return 1;
+    }
+    int result = _write_blocks(buffer, count);
+    if (_stream_stop() != 0) {
+        result = 1;
+    }
+    return result;
+}
+
+int SDFileSystem::_disk_read(uint8_t* buffer, uint32_t block_number, uint32_t count) {
+    _stream_stop();
+
+    if (count == 1) {
         // set read address for single block (CMD17)
-        if (_cmd(17, b * cdv) != 0) {
+        if (_cmd(17, block_number * cdv) != 0) {
             return 1;
         }
-        
+
         // receive the data
-        _read(buffer, 512);
-        buffer += 512;
+        return _read(buffer, SD_BLOCK_SIZE);
     }
 
-    return 0;
+    // set read address for multiple blocks (CMD18), keeps cs asserted
+    if (_cmdx(18, block_number * cdv) != 0) {
+        return 1;
+    }
+
+    int result = 0;
+    for (uint32_t b = 0; b < count; b++) {
+        if (_read_block(buffer, SD_BLOCK_SIZE) != 0) {
+            result = 1;
+            break;
+        }
+        buffer += SD_BLOCK_SIZE;
+    }
+
+    // stop transmission (CMD12)
+    if (_cmd12() != 0) {
+        result = 1;
+    }
+    return result;
 }
 
 int SDFileSystem::disk_status() {
@@ -270,172 +622,626 @@ int SDFileSystem::disk_status() {
     }
 }
 
-int SDFileSystem::disk_sync() { return 0; }
+int SDFileSystem::disk_sync() {
+    // finish the asynchronous and the open streaming write, and wait for
+    // the card to program the last block
+    uint32_t start_us = _stats_timer.read_us();
+    uint32_t busy_us = _stats.busy.total_us;
+    int result = disk_async_wait();
+    if (_stream_stop() != 0 && result == 0) {
+        result = _last_error;
+    }
+    if (_card_busy) {
+        _transport->select(true);
+        if (_wait_ready() != 0 && result == 0) {
+            result = _last_error;
+        }
+        _transport->select(false);
+        _transport->write(0xFF);
+    }
+    if (result != 0) {
+        // the caller knows about the blocks of the transfer now
+        _uncommitted = 0;
+    } else {
+        result = _lost_error;
+    }
+    _lost_error = 0;
+    _account(_stats.sync, start_us, busy_us);
+    return result;
+}
+
 uint32_t SDFileSystem::disk_sectors() { return _sectors; }
+uint32_t SDFileSystem::transfer_sck() { return _sck; }
+uint32_t SDFileSystem::crc_errors() { return _stats.crc_errors; }
+uint32_t SDFileSystem::init_us() { return _init_us; }
+uint32_t SDFileSystem::init_polls() { return _init_polls; }
+uint32_t SDFileSystem::busy_waits() { return _stats.busy.count; }
+uint32_t SDFileSystem::busy_total_us() { return _stats.busy.total_us; }
+uint32_t SDFileSystem::busy_max_us() { return _stats.busy.max_us; }
+const SDStats &SDFileSystem::stats() { return _stats; }
+
+void SDFileSystem::reset_busy_stats() {
+    memset(&_stats.busy, 0, sizeof(_stats.busy));
+}
+
+void SDFileSystem::reset_stats() {
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+// time of an operation since start_us, without the busy waits in it
+void SDFileSystem::_account(SDLatency &latency, uint32_t start_us, uint32_t busy_us) {
+    uint32_t us = (uint32_t)_stats_timer.read_us() - start_us;
+    sd_latency_add(latency, us - (_stats.busy.total_us - busy_us));
+}
+
+uint32_t SDFileSystem::readahead_window() { return _ra_window; }
+uint32_t SDFileSystem::readahead_hits() { return _ra_hits; }
+uint32_t SDFileSystem::readahead_waste() { return _ra_waste; }
+
+void SDFileSystem::reset_readahead_stats() {
+    _ra_hits = 0;
+    _ra_waste = 0;
+}
+
+int SDFileSystem::set_crc(bool enable) {
+    _async_wait();
+    _crc_on = enable;
+    if (!_is_initialized) {
+        // applied by disk_initialize()
+        return 0;
+    }
+    _stream_stop();
+    if (_cmd(59, enable ? 1 : 0) != 0) {
+        _crc_on = false;
+        return 1;
+    }
+    return 0;
+}
+
+void SDFileSystem::force_transfer_sck(uint32_t sck) {
+    _async_wait();
+    _sck = sck;
+    _transport->frequency(_sck);
+
+    // back off from the table entry below the forced clock
+    _sck_step = 0;
+    while (_sck_step < SD_SCK_STEPS && sd_sck_steps[_sck_step] > _sck) {
+        _sck_step++;
+    }
+    _sck_keep();
+}
+
+int SDFileSystem::disk_write_async(const uint8_t* buffer, uint32_t block_number, uint32_t count) {
+    if (!_is_initialized) {
+        return -1;
+    }
+    _async_wait();
+    _ra_update(buffer, block_number, count);
+    _stats.written_sectors += count;
+
+    // continue the open transfer only when the write is contiguous
+    if (_stream_open && block_number != _stream_next) {
+        _stream_stop();
+    }
+    if (!_stream_open) {
+        if (!_streaming) {
+            // pre-erase the blocks to be written (ACMD23)
+            _cmd(55, 0);
+            _cmd(23, count);
+        }
+        if (_stream_start(block_number) != 0) {
+            return 1;
+        }
+    }
+    _stream_next = block_number + count;
+
+    _async_buffer = buffer;
+    _async_remaining = count;
+    _async_result = 0;
+
+    // the first block goes out as soon as the card is ready
+    _transport->select(true);
+    _async_busy_us = _stats_timer.read_us();
+    _async_state = SD_ASYNC_BUSY;
+    _async_run();
+    return 0;
+}
+
+bool SDFileSystem::disk_async_busy() {
+    if (_async_state == SD_ASYNC_DATA) {
+        _transport->poll();
+    } else if (_async_state == SD_ASYNC_BUSY) {
+        _async_run();
+    }
+    return _async_state != SD_ASYNC_IDLE;
+}
+
+int SDFileSystem::disk_async_wait() {
+    int result = _async_wait();
+    _async_result = 0;
+    return result;
+}
+
+// wait for the asynchronous write, leaving its result to disk_async_wait()
+int SDFileSystem::_async_wait() {
+    while (disk_async_busy());
+    return _async_result;
+}
 
 
 // PRIVATE FUNCTIONS
+void SDFileSystem::_send_cmd(int cmd, int arg) {
+    uint8_t frame[6];
+    frame[0] = 0x40 | cmd;
+    frame[1] = arg >> 24;
+    frame[2] = arg >> 16;
+    frame[3] = arg >> 8;
+    frame[4] = arg >> 0;
+    frame[5] = sd_crc7(frame, 5);
+    _transport->block(frame, NULL, sizeof(frame));
+    _stats.commands++;
+}
+
+// note the error an R1 response reports, for _recover()
+void SDFileSystem::_r1_error(int response) {
+    if (response & R1_COM_CRC_ERROR) {
+        _stats.crc_errors++;
+        _last_error = SD_ERROR_CRC;
+    } else if (response & (R1_ADDRESS_ERROR | R1_PARAMETER_ERROR)) {
+        _last_error = SD_ERROR_CARD;
+    } else if (response & R1_IDLE_STATE) {
+        _last_error = SD_ERROR_RESET;
+    }
+}
+
 int SDFileSystem::_cmd(int cmd, int arg) {
-    _cs = 0;
+    _transport->select(true);
+    if (_wait_ready() != 0) {
+        _transport->select(false);
+        _transport->write(0xFF);
+        return -1;
+    }
 
     // send a command
-    _spi.write(0x40 | cmd);
-    _spi.write(arg >> 24);
-    _spi.write(arg >> 16);
-    _spi.write(arg >> 8);
-    _spi.write(arg >> 0);
-    _spi.write(0x95);
+    _send_cmd(cmd, arg);
 
     // wait for the repsonse (response[7] == 0)
     for (int i = 0; i < SD_COMMAND_TIMEOUT; i++) {
-        int response = _spi.write(0xFF);
+        int response = _transport->write(0xFF);
         if (!(response & 0x80)) {
-            _cs = 1;
-            _spi.write(0xFF);
+            _r1_error(response);
+            _transport->select(false);
+            _transport->write(0xFF);
             return response;
         }
     }
-    _cs = 1;
-    _spi.write(0xFF);
+    _transport->select(false);
+    _transport->write(0xFF);
+    _stats.timeouts++;
+    _last_error = SD_ERROR_TIMEOUT;
     return -1; // timeout
 }
 int SDFileSystem::_cmdx(int cmd, int arg) {
-    _cs = 0;
+    _transport->select(true);
+    if (_wait_ready() != 0) {
+        _transport->select(false);
+        _transport->write(0xFF);
+        return -1;
+    }
 
     // send a command
-    _spi.write(0x40 | cmd);
-    _spi.write(arg >> 24);
-    _spi.write(arg >> 16);
-    _spi.write(arg >> 8);
-    _spi.write(arg >> 0);
-    _spi.write(0x95);
+    _send_cmd(cmd, arg);
 
     // wait for the repsonse (response[7] == 0)
     for (int i = 0; i < SD_COMMAND_TIMEOUT; i++) {
-        int response = _spi.write(0xFF);
+        int response = _transport->write(0xFF);
         if (!(response & 0x80)) {
+            // cs stays asserted for the data block that follows
+            _r1_error(response);
+            if (response != 0) {
+                _transport->select(false);
+                _transport->write(0xFF);
+            }
             return response;
         }
     }
-    _cs = 1;
-    _spi.write(0xFF);
+    _transport->select(false);
+    _transport->write(0xFF);
+    _stats.timeouts++;
+    _last_error = SD_ERROR_TIMEOUT;
     return -1; // timeout
 }
 
 
 int SDFileSystem::_cmd58() {
-    _cs = 0;
-    int arg = 0;
+    _transport->select(true);
+    if (_wait_ready() != 0) {
+        _transport->select(false);
+        _transport->write(0xFF);
+        return -1;
+    }
 
     // send a command
-    _spi.write(0x40 | 58);
-    _spi.write(arg >> 24);
-    _spi.write(arg >> 16);
-    _spi.write(arg >> 8);
-    _spi.write(arg >> 0);
-    _spi.write(0x95);
+    _send_cmd(58, 0);
 
     // wait for the repsonse (response[7] == 0)
     for (int i = 0; i < SD_COMMAND_TIMEOUT; i++) {
-        int response = _spi.write(0xFF);
+        int response = _transport->write(0xFF);
         if (!(response & 0x80)) {
-            int ocr = _spi.write(0xFF) << 24;
-            ocr |= _spi.write(0xFF) << 16;
-            ocr |= _spi.write(0xFF) << 8;
-            ocr |= _spi.write(0xFF) << 0;
-            _cs = 1;
-            _spi.write(0xFF);
+            uint32_t ocr = _transport->write(0xFF) << 24;
+            ocr |= _transport->write(0xFF) << 16;
+            ocr |= _transport->write(0xFF) << 8;
+            ocr |= _transport->write(0xFF) << 0;
+            if (response == 0 || response == R1_IDLE_STATE) {
+                _ocr = ocr;
+            }
+            _transport->select(false);
+            _transport->write(0xFF);
             return response;
         }
     }
-    _cs = 1;
-    _spi.write(0xFF);
+    _transport->select(false);
+    _transport->write(0xFF);
+    _stats.timeouts++;
+    _last_error = SD_ERROR_TIMEOUT;
     return -1; // timeout
 }
 
 int SDFileSystem::_cmd8() {
-    _cs = 0;
+    _transport->select(true);
+    if (_wait_ready() != 0) {
+        _transport->select(false);
+        _transport->write(0xFF);
+        return -1;
+    }
 
     // send a command
-    _spi.write(0x40 | 8); // CMD8
-    _spi.write(0x00);     // reserved
-    _spi.write(0x00);     // reserved
-    _spi.write(0x01);     // 3.3v
-    _spi.write(0xAA);     // check pattern
-    _spi.write(0x87);     // crc
+    _send_cmd(8, 0x1AA);         // 3.3v, check pattern
 
     // wait for the repsonse (response[7] == 0)
-    for (int i = 0; i < SD_COMMAND_TIMEOUT * 1000; i++) {
-        char response[5];
-        response[0] = _spi.write(0xFF);
+    for (int i = 0; i < SD_COMMAND_TIMEOUT; i++) {
+        uint8_t response[5];
+        response[0] = _transport->write(0xFF);
         if (!(response[0] & 0x80)) {
             for (int j = 1; j < 5; j++) {
-                response[i] = _spi.write(0xFF);
+                response[j] = _transport->write(0xFF);
+            }
+            _transport->select(false);
+            _transport->write(0xFF);
+
+            // a v2 card echoes the voltage range and the check pattern
+            if (response[0] == R1_IDLE_STATE && ((response[3] & 0x0F) != 0x01 || response[4] != 0xAA)) {
+                debug("CMD8 echo mismatch (%02x %02x)\n", response[3], response[4]);
+                return -1;
             }
-            _cs = 1;
-            _spi.write(0xFF);
             return response[0];
         }
     }
-    _cs = 1;
-    _spi.write(0xFF);
+    _transport->select(false);
+    _transport->write(0xFF);
+    _stats.timeouts++;
+    _last_error = SD_ERROR_TIMEOUT;
+    return -1; // timeout
+}
+
+int SDFileSystem::_cmd12() {
+    _transport->select(true);
+
+    // send a command
+    _send_cmd(12, 0);
+
+    // skip the stuff byte, then wait for the response (response[7] == 0)
+    _transport->write(0xFF);
+    for (int i = 0; i < SD_COMMAND_TIMEOUT; i++) {
+        int response = _transport->write(0xFF);
+        if (!(response & 0x80)) {
+            // R1b: busy is checked before the next command
+            _card_busy = true;
+            _transport->select(false);
+            _transport->write(0xFF);
+            return response;
+        }
+    }
+    _transport->select(false);
+    _transport->write(0xFF);
+    _stats.timeouts++;
+    _last_error = SD_ERROR_TIMEOUT;
     return -1; // timeout
 }
 
 int SDFileSystem::_read(uint8_t *buffer, uint32_t length) {
-    _cs = 0;
+    _transport->select(true);
 
-    // read until start byte (0xFF)
-    while (_spi.write(0xFF) != 0xFE);
+    int result = _read_block(buffer, length);
 
-    // read data
-    for (uint32_t i = 0; i < length; i++) {
-        buffer[i] = _spi.write(0xFF);
+    _transport->select(false);
+    _transport->write(0xFF);
+    return result;
+}
+
+int SDFileSystem::_write(const uint8_t*buffer, uint32_t length) {
+    _transport->select(true);
+
+    int result = _write_block(SD_TOKEN_START, buffer, length);
+
+    _transport->select(false);
+    _transport->write(0xFF);
+    return result;
+}
+
+// completion of a transport block_async(), from interrupt context
+void SDFileSystem::_async_done(void *context, int result) {
+    SDFileSystem *sd = (SDFileSystem *)context;
+    if (sd->_async_state != SD_ASYNC_DATA) {
+        return;
     }
-    _spi.write(0xFF); // checksum
-    _spi.write(0xFF);
+    if (result != 0) {
+        // the transfer stopped somewhere in the block: clock out the rest
+        // until the data response token, so the card is between blocks again
+        for (int i = 0; i < SD_BLOCK_SIZE + 3; i++) {
+            int response = sd->_transport->write(0xFF);
+            if (response != 0xFF && (response & 0x11) == 0x01) {
+                sd->_card_busy = (response & 0x1F) == 0x05;
+                break;
+            }
+        }
+        sd->_last_error = SD_ERROR;
+        sd->_async_finish(SD_ERROR);
+        return;
+    }
+    sd->_async_state = SD_ASYNC_SENT;
+    sd->_async_run();
+}
+
+// advance the asynchronous write as far as possible without waiting. Runs
+// from the transport interrupt while a block is in flight (SD_ASYNC_DATA) and
+// from disk_async_busy() otherwise, never from both at the same time
+void SDFileSystem::_async_run() {
+    for (;;) {
+        switch (_async_state) {
+            case SD_ASYNC_SENT: {
+                // write the checksum and check the response token
+                uint16_t crc = _crc_on ? sd_crc16(_async_buffer, SD_BLOCK_SIZE) : 0xFFFF;
+                _transport->write(crc >> 8);
+                _transport->write(crc & 0xFF);
+                if (_data_response(_transport->write(0xFF)) != 0) {
+                    _async_finish(_last_error);
+                    return;
+                }
+                _async_buffer += SD_BLOCK_SIZE;
+                _async_remaining--;
+                _card_busy = true;
+                _async_busy_us = _stats_timer.read_us();
+                _async_state = SD_ASYNC_BUSY;
+                break;
+            }
+
+            case SD_ASYNC_BUSY:
+                // come back later while the card is programming, up to
+                // the write time limit
+                if (_transport->write(0xFF) == 0) {
+                    if ((uint32_t)_stats_timer.read_us() - _async_busy_us > SD_WRITE_TIMEOUT_MS * 1000) {
+                        _card_busy = false;
+                        _stats.timeouts++;
+                        _last_error = SD_ERROR_TIMEOUT;
+                        _async_finish(_last_error);
+                    }
+                    return;
+                }
+                _card_busy = false;
+                if (_async_remaining == 0) {
+                    _async_finish(0);
+                    return;
+                }
+                _transport->write(SD_TOKEN_START_MBW);
+                _async_state = SD_ASYNC_DATA;
+                if (_transport->block_async(_async_buffer, NULL, SD_BLOCK_SIZE) != 0) {
+                    // no asynchronous path, send the block in place
+                    _transport->block(_async_buffer, NULL, SD_BLOCK_SIZE);
+                    _async_state = SD_ASYNC_SENT;
+                }
+                break;
+
+            default:
+                return;
+        }
+    }
+}
 
-    _cs = 1;
-    _spi.write(0xFF);
+void SDFileSystem::_async_finish(int result) {
+    _transport->select(false);
+    _transport->write(0xFF);
+    if (result == 0 && _streaming) {
+        _uncommitted = _stream_next - _stream_first;
+    } else if (_stream_stop() != 0 && result == 0) {
+        result = _last_error;
+    }
+    _async_result = result;
+    _async_state = SD_ASYNC_IDLE;
+}
+
+// open a multiple block write (CMD25) at block_number
+int SDFileSystem::_stream_start(uint32_t block_number) {
+    if (_cmd(25, block_number * cdv) != 0) {
+        return 1;
+    }
+    _stream_open = true;
+    _stream_first = block_number;
+    _stream_next = block_number;
     return 0;
 }
 
-int SDFileSystem::_write(const uint8_t*buffer, uint32_t length) {
-    _cs = 0;
+// send the stop token to the open multiple block write, if any
+int SDFileSystem::_stream_stop() {
+    if (!_stream_open) {
+        return 0;
+    }
+
+    // the last block must be programmed, the transfer is not finished yet
+    _transport->select(true);
+    int busy = _wait_ready();
+    _stream_open = false;
+    if (busy != 0) {
+        _transport->select(false);
+        _transport->write(0xFF);
+        return 1;
+    }
+
+    // stop transmission, the card programs the last block while the
+    // firmware carries on
+    _transport->write(SD_TOKEN_STOP_MBW);
+    _transport->write(0xFF);
+    _card_busy = true;
+
+    _transport->select(false);
+    _transport->write(0xFF);
+    return 0;
+}
+
+// send count blocks to the open multiple block write. cs is released after
+// the blocks, the card keeps the transfer open until the stop token
+int SDFileSystem::_write_blocks(const uint8_t *buffer, uint32_t count) {
+    _transport->select(true);
+
+    int result = 0;
+    for (uint32_t b = 0; b < count; b++) {
+        if (_write_block(SD_TOKEN_START_MBW, buffer, SD_BLOCK_SIZE) != 0) {
+            result = 1;
+            break;
+        }
+        buffer += SD_BLOCK_SIZE;
+    }
+
+    _transport->select(false);
+    _transport->write(0xFF);
+    return result;
+}
+
+// receive one data block, cs must be asserted
+int SDFileSystem::_read_block(uint8_t *buffer, uint32_t length) {
+    // read until start byte (0xFE), or a data error token (0000xxxx)
+    uint32_t start_us = _stats_timer.read_us();
+    int token;
+    while ((token = _transport->write(0xFF)) == 0xFF) {
+        if ((uint32_t)_stats_timer.read_us() - start_us > SD_READ_TIMEOUT_MS * 1000) {
+            _stats.timeouts++;
+            _last_error = SD_ERROR_TIMEOUT;
+            return 1;
+        }
+    }
+    if (token != SD_TOKEN_START) {
+        _last_error = (token & 0xF0) == 0 ? SD_ERROR_CARD : SD_ERROR_TOKEN;
+        return 1;
+    }
+
+    // read data
+    _transport->block(NULL, buffer, length);
+    uint16_t crc = _transport->write(0xFF) << 8; // checksum
+    crc |= _transport->write(0xFF);
+    if (_crc_on && crc != sd_crc16(buffer, length)) {
+        _stats.crc_errors++;
+        _last_error = SD_ERROR_CRC;
+        return 1;
+    }
+    return 0;
+}
+
+// send one data block with the given start token, cs must be asserted
+int SDFileSystem::_write_block(int token, const uint8_t *buffer, uint32_t length) {
+    // the previous block of a multiple block write must be programmed
+    if (_wait_ready() != 0) {
+        return 1;
+    }
 
     // indicate start of block
-    _spi.write(0xFE);
+    _transport->write(token);
 
     // write the data
-    for (uint32_t i = 0; i < length; i++) {
-        _spi.write(buffer[i]);
-    }
+    _transport->block(buffer, NULL, length);
 
     // write the checksum
-    _spi.write(0xFF);
-    _spi.write(0xFF);
+    uint16_t crc = _crc_on ? sd_crc16(buffer, length) : 0xFFFF;
+    _transport->write(crc >> 8);
+    _transport->write(crc & 0xFF);
 
     // check the response token
-    if ((_spi.write(0xFF) & 0x1F) != 0x05) {
-        _cs = 1;
-        _spi.write(0xFF);
+    if (_data_response(_transport->write(0xFF)) != 0) {
         return 1;
     }
 
-    // wait for write to finish
-    while (_spi.write(0xFF) == 0);
+    // the card is programming now, wait for it before the next command
+    _card_busy = true;
+    return 0;
+}
 
-    _cs = 1;
-    _spi.write(0xFF);
+// note the error of a data response token other than data accepted, for
+// _recover(). Tokens are xxx0sss1, anything else was garbled on the bus
+// returns 0 when the card accepted the block
+int SDFileSystem::_data_response(int response) {
+    switch (response & 0x1F) {
+        case 0x05:
+            return 0;
+        case 0x0B:
+            _stats.crc_errors++;
+            _last_error = SD_ERROR_CRC;
+            break;
+        case 0x0D:
+            _last_error = SD_ERROR_CARD;
+            break;
+        default:
+            _last_error = response != 0xFF && (response & 0x11) != 0x01 ? SD_ERROR_TOKEN : SD_ERROR;
+            break;
+    }
+    return 1;
+}
+
+// wait for the card to finish programming the last block, cs must be
+// asserted. Busy time is collected to make card internal stalls visible
+// returns 0 when ready, 1 when still busy after the time limit
+int SDFileSystem::_wait_ready() {
+    if (!_card_busy) {
+        return 0;
+    }
+    _card_busy = false;
+    uint32_t timeout_ms = _busy_timeout_ms;
+    _busy_timeout_ms = SD_WRITE_TIMEOUT_MS;
+    if (_transport->write(0xFF) != 0) {
+        _committed();
+        return 0;
+    }
+
+    uint32_t start_us = _stats_timer.read_us();
+    while (_transport->write(0xFF) == 0) {
+        uint32_t elapsed_us = (uint32_t)_stats_timer.read_us() - start_us;
+        if (elapsed_us > timeout_ms * 1000) {
+            sd_latency_add(_stats.busy, elapsed_us);
+            _stats.timeouts++;
+            _last_error = SD_ERROR_TIMEOUT;
+            debug("SD card busy for more than %d ms\n", timeout_ms);
+            return 1;
+        }
+    }
+    sd_latency_add(_stats.busy, (uint32_t)_stats_timer.read_us() - start_us);
+    _committed();
     return 0;
 }
 
-static uint32_t ext_bits(unsigned char *data, int msb, int lsb) {
+// the card finished programming: after the stop token that is the whole
+// multiple block write
+void SDFileSystem::_committed() {
+    if (!_stream_open) {
+        _uncommitted = 0;
+    }
+}
+
+// bits [msb:lsb] of a register sent most significant byte first (16 bytes
+// for CSD and CID, 64 for the SD Status)
+static uint32_t ext_bits(unsigned char *data, int msb, int lsb, int bytes = 16) {
     uint32_t bits = 0;
     uint32_t size = 1 + msb - lsb;
     for (uint32_t i = 0; i < size; i++) {
         uint32_t position = lsb + i;
-        uint32_t byte = 15 - (position >> 3);
+        uint32_t byte = bytes - 1 - (position >> 3);
         uint32_t bit = position & 0x7;
         uint32_t value = (data[byte] >> bit) & 1;
         bits |= value << i;
@@ -450,13 +1256,8 @@ uint32_t SDFileSystem::_sd_sectors() {
     uint32_t blocks;
 
     // CMD9, Response R2 (R1 byte + 16-byte block read)
-    if (_cmdx(9, 0) != 0) {
-        debug("Didn't get a response from the disk\n");
-        return 0;
-    }
-
-    uint8_t csd[16];
-    if (_read(csd, 16) != 0) {
+    uint8_t *csd = _csd;
+    if (_read_register(9, csd, 16) != 0) {
         debug("Couldn't read csd response from disk\n");
         return 0;
     }
@@ -495,4 +1296,374 @@ uint32_t SDFileSystem::_sd_sectors() {
             return 0;
     };
     return blocks;
+}
+// maximum data transfer rate from the CSD, in Hz (0 when not decodable)
+uint32_t SDFileSystem::_tran_speed() {
+    // tran_speed : csd[103:96], time value [6:3] x transfer rate unit [2:0]
+    static const uint8_t time_value[16] = {  // x10
+        0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80
+    };
+    static const uint32_t rate_unit[4] = {   // 100kbit/s .. 100Mbit/s, /10
+        10000, 100000, 1000000, 10000000
+    };
+    uint32_t tran_speed = ext_bits(_csd, 103, 96);
+    if ((tran_speed & 0x7) > 3) {
+        return 0;
+    }
+    return rate_unit[tran_speed & 0x7] * time_value[(tran_speed >> 3) & 0xF];
+}
+
+// step the SPI clock up to the fastest rate allowed by TRAN_SPEED and
+// _transfer_sck at which sector 0 reads back the same as at _init_sck
+int SDFileSystem::_negotiate_sck() {
+    uint32_t limit = _tran_speed();
+    if (limit == 0 || limit > _transfer_sck) {
+        limit = _transfer_sck;
+    }
+
+    uint32_t reference[SD_BLOCK_SIZE / 4];
+    uint32_t verify[SD_BLOCK_SIZE / 4];
+    _sck = _init_sck;
+    _sck_step = SD_SCK_STEPS;
+    _transport->frequency(_sck);
+    if (_cmd(17, 0) != 0 || _read((uint8_t *)reference, SD_BLOCK_SIZE) != 0) {
+        debug("Couldn't read sector 0, staying at %d Hz\n", _sck);
+        return 1;
+    }
+
+    for (int step = 0; step < SD_SCK_STEPS; step++) {
+        if (sd_sck_steps[step] > limit || sd_sck_steps[step] < _init_sck) {
+            continue;
+        }
+        _transport->frequency(sd_sck_steps[step]);
+        if (_cmd(17, 0) == 0 && _read((uint8_t *)verify, SD_BLOCK_SIZE) == 0
+                && memcmp(reference, verify, SD_BLOCK_SIZE) == 0) {
+            _sck = sd_sck_steps[step];
+            _sck_step = step;
+            debug_if(SD_DBG, "SPI clock %d Hz (card max %d Hz)\n", _sck, _tran_speed());
+            return 0;
+        }
+        debug_if(SD_DBG, "SPI clock %d Hz failed verification\n", sd_sck_steps[step]);
+    }
+
+    debug("No SPI clock passed verification, staying at %d Hz\n", _sck);
+    _transport->frequency(_sck);
+    return 1;
+}
+
+// the clock a back off returns to
+void SDFileSystem::_sck_keep() {
+    _good_sck = _sck;
+    _good_step = _sck_step;
+    _clean_transfers = 0;
+    _restore_after = SD_SCK_RESTORE_TRANSFERS;
+}
+
+// a transfer without any error. After enough of them at a lowered clock the
+// negotiated clock is tried again, a card that fails there again waits
+// longer for the next try
+void SDFileSystem::_sck_clean() {
+    if (_sck == _good_sck || ++_clean_transfers < _restore_after) {
+        return;
+    }
+    _sck = _good_sck;
+    _sck_step = _good_step;
+    _transport->frequency(_sck);
+    _clean_transfers = 0;
+    if (_restore_after < SD_SCK_RESTORE_MAX) {
+        _restore_after *= 2;
+    }
+    debug("SD SPI clock back up to %d Hz\n", _sck);
+}
+
+// drop the SPI clock one step after a transfer error
+// returns 1 when already at the slowest rate
+int SDFileSystem::_sck_backoff() {
+    _clean_transfers = 0;
+    for (int step = _sck_step + 1; step < SD_SCK_STEPS; step++) {
+        if (sd_sck_steps[step] < _sck && sd_sck_steps[step] >= _init_sck) {
+            _sck = sd_sck_steps[step];
+            _sck_step = step;
+            _transport->frequency(_sck);
+            debug("SD transfer error, SPI clock lowered to %d Hz\n", _sck);
+            return 0;
+        }
+    }
+    _sck_step = SD_SCK_STEPS;
+    return 1;
+}
+
+
+int SDFileSystem::set_readahead(uint32_t sectors) {
+    _ra_drop();
+    free(_ra_pool);
+    _ra_pool = NULL;
+    _ra_max = 0;
+    _ra_window = 0;
+    if (sectors == 0) {
+        return 0;
+    }
+    // malloc() returns word aligned memory, as the block transfers want
+    _ra_pool = (uint8_t *)malloc(sectors * SD_BLOCK_SIZE);
+    if (_ra_pool == NULL) {
+        debug("No memory for %d sectors of read-ahead\n", sectors);
+        return 1;
+    }
+    _ra_max = sectors;
+    _ra_window = sectors < SD_RA_MIN_WINDOW ? sectors : SD_RA_MIN_WINDOW;
+    return 0;
+}
+
+// serve a read from the prefetched sectors and prefetch the next window when
+// the read continues the stream. Reads elsewhere (FAT, directory) pass
+// through and leave the stream alone, until a second read follows one of
+// them: then that is the new stream
+int SDFileSystem::_ra_read(uint8_t* buffer, uint32_t block_number, uint32_t count) {
+    bool buffered = _ra_count > 0 && block_number >= _ra_start && block_number < _ra_start + _ra_count;
+    if (block_number != _ra_next && !buffered) {
+        if (block_number != _ra_last) {
+            _ra_last = block_number + count;
+            return _read_retry(buffer, block_number, count);
+        }
+        _ra_drop();
+    }
+
+    // sectors skipped over are not read any more
+    if (buffered && block_number > _ra_start) {
+        uint32_t skipped = block_number - _ra_start;
+        _ra_waste += skipped;
+        _ra_offset += skipped;
+        _ra_count -= skipped;
+        _ra_start = block_number;
+    }
+
+    uint32_t n = 0;
+    if (_ra_count > 0 && block_number == _ra_start) {
+        n = count < _ra_count ? count : _ra_count;
+        memcpy(buffer, _ra_pool + _ra_offset * SD_BLOCK_SIZE, n * SD_BLOCK_SIZE);
+        _ra_start += n;
+        _ra_offset += n;
+        _ra_count -= n;
+        _ra_hits += n;
+        if (_ra_count == 0) {
+            // the whole window was used: fetch more next time
+            _ra_window = _ra_window * 2 < _ra_max ? _ra_window * 2 : _ra_max;
+        }
+    }
+    _ra_next = block_number + count;
+    _ra_last = _ra_next;
+    if (_ra_count > 0) {
+        return 0;
+    }
+
+    uint32_t rest = count - n;
+    block_number += n;
+    buffer += n * SD_BLOCK_SIZE;
+    if (rest > 0 && rest + _ra_window <= _ra_max
+            && _ra_fill(block_number, rest + _ra_window) == 0 && _ra_count >= rest) {
+        // the rest of the read and the next window came in one transfer
+        memcpy(buffer, _ra_pool, rest * SD_BLOCK_SIZE);
+        _ra_start += rest;
+        _ra_offset = rest;
+        _ra_count -= rest;
+        return 0;
+    }
+    if (rest > 0 && _read_retry(buffer, block_number, rest) != 0) {
+        return 1;
+    }
+    // a failed prefetch is not an error of this read
+    _ra_fill(block_number + rest, _ra_window);
+    return 0;
+}
+
+// read count sectors from block_number into the pool, clipped to the card
+int SDFileSystem::_ra_fill(uint32_t block_number, uint32_t count) {
+    _ra_count = 0;
+    if (block_number >= _sectors) {
+        return 1;
+    }
+    if (count > _sectors - block_number) {
+        count = _sectors - block_number;
+    }
+    if (_read_retry(_ra_pool, block_number, count) != 0) {
+        return 1;
+    }
+    _ra_start = block_number;
+    _ra_offset = 0;
+    _ra_count = count;
+    return 0;
+}
+
+// give up the prefetched sectors, a smaller window wastes less next time
+void SDFileSystem::_ra_drop() {
+    if (_ra_count > 0) {
+        _ra_waste += _ra_count;
+        _ra_count = 0;
+        _ra_window = _ra_window / 2 > SD_RA_MIN_WINDOW ? _ra_window / 2 : SD_RA_MIN_WINDOW;
+        if (_ra_window > _ra_max) {
+            _ra_window = _ra_max;
+        }
+    }
+}
+
+// keep prefetched sectors in step with a write
+void SDFileSystem::_ra_update(const uint8_t* buffer, uint32_t block_number, uint32_t count) {
+    uint32_t first = block_number > _ra_start ? block_number : _ra_start;
+    uint32_t end = block_number + count < _ra_start + _ra_count ? block_number + count : _ra_start + _ra_count;
+    if (_ra_count > 0 && first < end) {
+        memcpy(_ra_pool + (_ra_offset + first - _ra_start) * SD_BLOCK_SIZE,
+               buffer + (first - block_number) * SD_BLOCK_SIZE, (end - first) * SD_BLOCK_SIZE);
+    }
+}
+
+// read a register sent as a data block: CMD9 (CSD), CMD10 (CID) or
+// ACMD13 (SD Status, R2 response)
+int SDFileSystem::_read_register(int cmd, uint8_t *buffer, uint32_t length) {
+    if (cmd == 13) {
+        _cmd(55, 0);
+    }
+    if (_cmdx(cmd, 0) != 0) {
+        return 1;
+    }
+    if (cmd == 13) {
+        _transport->write(0xFF);    // second byte of R2
+    }
+    return _read(buffer, length);
+}
+
+void SDFileSystem::_read_card_info() {
+    memset(&_info, 0, sizeof(_info));
+    _info.type = _is_initialized;
+    _info.ocr = _ocr;
+    _info.sectors = _sectors;
+    _info.max_hz = _tran_speed();
+
+    if (_read_register(10, _cid, sizeof(_cid)) == 0) {
+        _info.manufacturer = ext_bits(_cid, 127, 120);
+        memcpy(_info.oem, _cid + 1, 2);
+        memcpy(_info.product, _cid + 3, 5);
+        _info.revision = ext_bits(_cid, 63, 56);
+        _info.serial = ext_bits(_cid, 55, 24);
+        _info.year = 2000 + ext_bits(_cid, 19, 12);
+        _info.month = ext_bits(_cid, 11, 8);
+    } else {
+        debug("Couldn't read the CID\n");
+        memset(_cid, 0, sizeof(_cid));
+    }
+
+    // AU_SIZE 1-9: 16KB << (n - 1), then 8, 12, 16, 24, 32 and 64MB
+    static const uint32_t au_large[6] = { 16384, 24576, 32768, 49152, 65536, 131072 };
+    static const int speed_class[5] = { 0, 2, 4, 6, 10 };
+    if (_read_register(13, _ssr, sizeof(_ssr)) == 0) {
+        uint32_t au = ext_bits(_ssr, 431, 428, 64);
+        if (au > 0) {
+            _info.au_sectors = au <= 9 ? 32 << (au - 1) : au_large[au - 10];
+        }
+        uint32_t sc = ext_bits(_ssr, 447, 440, 64);
+        _info.speed_class = sc < 5 ? speed_class[sc] : 0;
+        _info.erase_size = ext_bits(_ssr, 423, 408, 64);
+        _info.erase_timeout = ext_bits(_ssr, 407, 402, 64);
+        _info.erase_offset = ext_bits(_ssr, 401, 400, 64);
+    } else {
+        debug("Couldn't read the SD Status\n");
+        memset(_ssr, 0, sizeof(_ssr));
+    }
+
+    // without an AU, the erase sector of the CSD: sector_size [45:39] + 1
+    // write blocks of write_bl_len [25:22]
+    _info.erase_sectors = _info.au_sectors;
+    uint32_t write_bl_len = ext_bits(_csd, 25, 22);
+    if (_info.erase_sectors == 0 && write_bl_len >= 9) {
+        _info.erase_sectors = (ext_bits(_csd, 45, 39) + 1) << (write_bl_len - 9);
+    }
+    debug_if(SD_DBG, "card %.5s, AU %d sectors, class %d\n", _info.product, _info.au_sectors, _info.speed_class);
+}
+
+const SDCardInfo &SDFileSystem::card_info() { return _info; }
+uint32_t SDFileSystem::erase_sectors() { return _info.erase_sectors; }
+
+int SDFileSystem::disk_ioctl(int cmd, void *buffer) {
+    if (cmd == SD_GET_STATS) {
+        memcpy(buffer, &_stats, sizeof(_stats));
+        return 0;
+    }
+    if (!_is_initialized) {
+        return -1;
+    }
+    switch (cmd) {
+        case GET_BLOCK_SIZE:
+            if (_info.erase_sectors == 0) {
+                return -1;
+            }
+            *((DWORD *)buffer) = _info.erase_sectors;
+            return 0;
+        case MMC_GET_TYPE:
+            *((BYTE *)buffer) = (_is_initialized == SDCARD_V1 ? SD_CT_SD1 : SD_CT_SD2)
+                    | (_is_initialized == SDCARD_V2HC ? SD_CT_BLOCK : 0);
+            return 0;
+        case MMC_GET_CSD:
+            memcpy(buffer, _csd, sizeof(_csd));
+            return 0;
+        case MMC_GET_CID:
+            memcpy(buffer, _cid, sizeof(_cid));
+            return 0;
+        case MMC_GET_OCR:
+            for (int i = 0; i < 4; i++) {
+                ((BYTE *)buffer)[i] = _ocr >> (24 - 8 * i);
+            }
+            return 0;
+        case MMC_GET_SDSTAT:
+            memcpy(buffer, _ssr, sizeof(_ssr));
+            return 0;
+    }
+    return -1;
+}
+
+void SDFileSystem::set_erase(bool enable) { _erase_on = enable; }
+uint32_t SDFileSystem::erased_blocks() { return _erased; }
+
+int SDFileSystem::disk_erase(uint32_t block_number, uint32_t count) {
+    if (!_is_initialized) {
+        return -1;
+    }
+    if (!_erase_on || count == 0) {
+        return 0;
+    }
+    // erase commands are command class 5 of ccc [95:84]
+    if (!(ext_bits(_csd, 95, 84) & (1 << 5))) {
+        return 1;
+    }
+
+    _async_wait();
+    _stream_stop();
+    if (_ra_count > 0 && block_number < _ra_start + _ra_count && _ra_start < block_number + count) {
+        _ra_drop();
+    }
+
+    uint32_t start_us = _stats_timer.read_us();
+    uint32_t busy_us = _stats.busy.total_us;
+    if (_cmd(32, block_number * cdv) != 0 || _cmd(33, (block_number + count - 1) * cdv) != 0) {
+        debug("Erase range %d, %d not accepted\n", block_number, count);
+        return 1;
+    }
+    if (_cmd(38, 0) != 0) {
+        debug("Erase failed\n");
+        return 1;
+    }
+    // R1b: busy until the erase is done, checked before the next command.
+    // The SD Status gives the time for erase_size AUs plus an offset
+    uint32_t units = 1;
+    if (_info.erase_sectors > 0) {
+        units = (count + _info.erase_sectors - 1) / _info.erase_sectors;
+    }
+    uint32_t timeout_ms = units * SD_ERASE_TIMEOUT_MS;
+    if (_info.erase_size > 0 && _info.erase_timeout > 0) {
+        timeout_ms = units * _info.erase_timeout * 1000 / _info.erase_size + _info.erase_offset * 1000;
+    }
+    _busy_timeout_ms = timeout_ms > SD_WRITE_TIMEOUT_MS ? timeout_ms : SD_WRITE_TIMEOUT_MS;
+    _card_busy = true;
+    _erased += count;
+    _account(_stats.erase, start_us, busy_us);
+    debug_if(SD_DBG, "erased %d blocks at %d\n", count, block_number);
+    return 0;
 }
\ No newline at end of file
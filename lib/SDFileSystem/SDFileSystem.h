@@ -24,8 +24,91 @@
 
 #include "mbed.h"
 #include "FATFileSystem.h"
+#include "SDTransport.h"
+#include "SDSPITransport.h"
 #include <stdint.h>
 
+// Types
+//  - v1.x Standard Capacity
+//  - v2.x Standard Capacity
+//  - v2.x High Capacity
+//  - Not recognised as an SD Card
+#define SDCARD_FAIL 0
+#define SDCARD_V1   1
+#define SDCARD_V2   2
+#define SDCARD_V2HC 3
+
+/** What the card reports about itself, read by disk_initialize()
+ *
+ * From the OCR (CMD58), CID (CMD10), CSD (CMD9) and the SD Status (ACMD13).
+ */
+struct SDCardInfo {
+    int type;               // SDCARD_V1, SDCARD_V2 or SDCARD_V2HC
+    uint32_t ocr;
+    uint8_t manufacturer;   // CID MID
+    char oem[3];            // CID OID, 2 characters
+    char product[6];        // CID PNM, 5 characters
+    uint8_t revision;       // CID PRV, BCD n.m
+    uint32_t serial;        // CID PSN
+    uint16_t year;          // CID MDT
+    uint8_t month;
+    uint32_t sectors;       // capacity in 512 byte sectors
+    uint32_t max_hz;        // CSD TRAN_SPEED
+    uint32_t au_sectors;    // allocation unit, SSR AU_SIZE (0: not reported)
+    uint32_t erase_sectors; // erase unit, the AU or else the CSD SECTOR_SIZE
+    int speed_class;        // SSR SPEED_CLASS as 0, 2, 4, 6 or 10
+    uint16_t erase_size;    // SSR ERASE_SIZE, AUs erased in erase_timeout
+    uint8_t erase_timeout;  // SSR ERASE_TIMEOUT in s
+    uint8_t erase_offset;   // SSR ERASE_OFFSET in s
+};
+
+// disk_read and disk_write results besides 0 (ok) and -1 (not initialised)
+#define SD_ERROR           1   // bus or protocol error
+#define SD_ERROR_CRC       2   // CRC errors that the retries did not clear
+#define SD_ERROR_TIMEOUT   3   // the card did not answer or stayed busy
+#define SD_ERROR_CARD      4   // the card refused the command or the data
+#define SD_ERROR_RESET     5   // the card fell back to the idle state
+#define SD_ERROR_TOKEN     6   // a data token garbled on the bus
+
+#define SD_LATENCY_BUCKETS 12
+
+// disk_ioctl code that copies the SDStats of the drive into the buffer
+#define SD_GET_STATS       60
+
+/** Latency of one kind of operation
+ *
+ * histogram[0] counts the operations under 128us, histogram[i] those from
+ * 64us << i to 128us << i and the last one everything from 131ms up.
+ */
+struct SDLatency {
+    uint32_t count;
+    uint32_t total_us;
+    uint32_t max_us;
+    uint32_t histogram[SD_LATENCY_BUCKETS];
+};
+
+/** Counters of an SDFileSystem, see stats()
+ *
+ * The read, write, sync and erase latencies leave out the time spent waiting
+ * for the card to finish programming, which is counted in busy instead.
+ */
+struct SDStats {
+    uint32_t commands;          // commands sent to the card
+    uint32_t read_sectors;      // sectors asked for by disk_read
+    uint32_t written_sectors;   // sectors given to disk_write(_async)
+    uint32_t retries;           // transfers repeated after an error
+    uint32_t failures;          // transfers given up after the retries
+    uint32_t reinits;           // card initialised again to recover
+    uint32_t timeouts;          // commands, data and busy waits timed out
+    uint32_t crc_errors;        // command, read and write CRC errors
+    uint32_t lost_sectors;      // streamed sectors a reset may have lost
+    SDLatency read;             // disk_read
+    SDLatency write;            // disk_write
+    SDLatency sync;             // disk_sync
+    SDLatency erase;            // disk_erase
+    SDLatency busy;             // waits for the card to finish programming
+};
+
 /** Access the filesystem on an SD Card using SPI
  *
  * @code
@@ -49,41 +132,302 @@ public:
      * @param miso SPI miso pin conencted to SD Card
      * @param sclk SPI sclk pin connected to SD Card
      * @param cs   DigitalOut pin used as SD Card chip select
-     * @param name The name used to access the virtual filesystem
+     * @param name The name used to access the virtual filesystem, NULL for a
+     *             card used only as a disk of SDRaidFileSystem
      */
     SDFileSystem(PinName mosi, PinName miso, PinName sclk, PinName cs, const char* name);
+
+    /** Create the File System for accessing an SD Card through a transport
+     *
+     * @param transport The transport to the card, e.g. SDSimTransport on the host
+     * @param name      The name used to access the virtual filesystem, or NULL
+     */
+    SDFileSystem(SDTransport &transport, const char* name);
+    virtual ~SDFileSystem();
+
     virtual int disk_initialize();
     virtual int disk_status();
+
+    /** Read or write blocks
+     *
+     * Every wait for the card is bounded in time. A failed transfer is
+     * repeated up to SD_MAX_RETRIES times with a doubling delay: CRC errors
+     * at the same clock first, then at a slower SPI clock, other bus errors
+     * at the same clock, and a card that timed out or reset itself is
+     * initialised again. When that
+     * fails too, disk_status() reports the card as not initialised and FatFs
+     * initialises and mounts it again on the next file access.
+     *
+     * @returns 0 on success, -1 when not initialised, else an SD_ERROR code
+     */
     virtual int disk_read(uint8_t* buffer, uint32_t block_number, uint32_t count);
     virtual int disk_write(const uint8_t* buffer, uint32_t block_number, uint32_t count);
     virtual int disk_sync();
     virtual uint32_t disk_sectors();
 
+    /** Erase blocks (CMD32, CMD33, CMD38), used for CTRL_TRIM
+     *
+     * The card erases in the background like after a write, the busy wait
+     * happens before the next command.
+     */
+    virtual int disk_erase(uint32_t block_number, uint32_t count);
+
+    /** Switch erasing on or off, off accepts disk_erase() and does nothing
+     */
+    void set_erase(bool enable);
+
+    /** Blocks erased since disk_initialize()
+     */
+    uint32_t erased_blocks();
+
+    /** GET_BLOCK_SIZE reports the erase unit (the allocation unit when the
+     * card has one), so f_mkfs aligns the data area to it. MMC_GET_TYPE,
+     * MMC_GET_CSD, MMC_GET_CID, MMC_GET_OCR and MMC_GET_SDSTAT return the
+     * raw card registers, SD_GET_STATS the SDStats
+     */
+    virtual int disk_ioctl(int cmd, void *buffer);
+
+    /** Card registers decoded at the last disk_initialize()
+     */
+    const SDCardInfo &card_info();
+
+    /** Erase unit of the card in sectors, the size to align files and
+     * flushes to so the card does not have to read-modify-write
+     */
+    uint32_t erase_sectors();
+
+    /** Time the last disk_initialize() took in us, from CMD0 to the card
+     * registers, and the ACMD41 polls it needed
+     */
+    uint32_t init_us();
+    uint32_t init_polls();
+
+    /** Keep one multiple block write open across disk_write calls
+     *
+     * Contiguous writes continue the same CMD25 transfer. A non-contiguous
+     * write, a read or disk_sync() sends the stop token first. The card may
+     * not have programmed the blocks until it finished the transfer: when a
+     * reset comes first, the next disk_sync() fails and stats() counts the
+     * blocks of the earlier calls in lost_sectors.
+     *
+     * @param enable true to start streaming, false to close the transfer
+     */
+    void set_streaming(bool enable);
+
+    /** SPI clock used for data transfer
+     *
+     * Negotiated at disk_initialize() from the CSD TRAN_SPEED and a read-back
+     * check. Lowered after CRC errors and garbled data tokens, and back up
+     * to the negotiated clock after a run of transfers without errors.
+     *
+     * @returns the SPI clock in Hz
+     */
+    uint32_t transfer_sck();
+
+    /** Use a fixed SPI clock for data transfer. A back off after errors
+     * returns to it after enough clean transfers
+     *
+     * @param sck the SPI clock in Hz
+     */
+    void force_transfer_sck(uint32_t sck);
+
+    /** Start writing blocks without waiting for the transfer
+     *
+     * The data goes out through the transport's DMA while the caller carries
+     * on, e.g. reading the next rows from the camera. buffer must stay
+     * untouched until disk_async_busy() returns false. Contiguous writes join
+     * the open multiple block write like in streaming mode.
+     *
+     * @returns 0 when the transfer was started
+     */
+    int disk_write_async(const uint8_t* buffer, uint32_t block_number, uint32_t count);
+
+    /** Advance the asynchronous write
+     *
+     * @returns true while it is running
+     */
+    bool disk_async_busy();
+
+    /** Wait for the asynchronous write to finish
+     *
+     * The result is returned once. A failed write that was not collected here
+     * is returned by the next disk_sync() instead
+     *
+     * @returns its result, 0 on success, else an SD_ERROR code
+     */
+    int disk_async_wait();
+
+    /** Switch CRC protected transfers on or off (CMD59)
+     *
+     * Commands always carry a real CRC7. With CRC on, data blocks carry a
+     * CRC16 that the card checks on writes and the driver checks on reads,
+     * and failed transfers are retried.
+     *
+     * @returns 0 on success, 1 if the card did not accept CMD59
+     */
+    int set_crc(bool enable);
+
+    /** Number of CRC errors seen (command, read and write)
+     */
+    uint32_t crc_errors();
+
+    /** Programming (busy) waits
+     *
+     * disk_write() returns once the card has accepted the data, and the wait
+     * for programming to finish happens before the next command or in
+     * disk_sync(). These count the waits that found the card still busy, so
+     * latency spikes from card internal garbage collection become visible.
+     */
+    uint32_t busy_waits();
+    uint32_t busy_total_us();
+    uint32_t busy_max_us();
+    void reset_busy_stats();
+
+    /** Command, sector, error and latency counters
+     *
+     * Kept all the time, each operation costs two timer reads. Also available
+     * through disk_ioctl(SD_GET_STATS).
+     */
+    const SDStats &stats();
+    void reset_stats();
+
+    /** Prefetch sequential reads
+     *
+     * Once two reads follow each other, the next sectors are fetched with one
+     * multiple block read into a buffer and later disk_read calls are served
+     * from it. The window starts small, doubles each time the prefetched
+     * sectors are all used and halves when they are dropped unread.
+     *
+     * @param sectors the largest window in 512 byte sectors, 0 to switch off
+     * @returns 0 on success, 1 if the buffer could not be allocated
+     */
+    int set_readahead(uint32_t sectors);
+
+    /** Read-ahead window currently used, in sectors
+     */
+    uint32_t readahead_window();
+
+    /** Sectors served from the read-ahead buffer
+     */
+    uint32_t readahead_hits();
+
+    /** Prefetched sectors dropped without being read
+     */
+    uint32_t readahead_waste();
+    void reset_readahead_stats();
+
 protected:
 
+    void _init();
+    void _send_cmd(int cmd, int arg);
+    int _wait_ready();
+
     int _cmd(int cmd, int arg);
     int _cmdx(int cmd, int arg);
+    void _r1_error(int response);
     int _cmd8();
     int _cmd58();
+    int _read_register(int cmd, uint8_t *buffer, uint32_t length);
+    void _read_card_info();
+    int _cmd12();
     int initialise_card();
     int initialise_card_v1();
     int initialise_card_v2();
+    int _acmd41(int arg);
+
+    int _disk_read(uint8_t* buffer, uint32_t block_number, uint32_t count);
+    int _read_retry(uint8_t* buffer, uint32_t block_number, uint32_t count);
+    int _recover(int error, int attempt);
+    int _reinitialize();
+    int _disk_write(const uint8_t* buffer, uint32_t block_number, uint32_t count);
 
     int _read(uint8_t * buffer, uint32_t length);
     int _write(const uint8_t *buffer, uint32_t length);
+    int _read_block(uint8_t *buffer, uint32_t length);
+    int _write_block(int token, const uint8_t *buffer, uint32_t length);
+    int _write_blocks(const uint8_t *buffer, uint32_t count);
+    int _stream_start(uint32_t block_number);
+    int _stream_stop();
     uint32_t _sd_sectors();
     uint32_t _sectors;
+    uint8_t _csd[16];
+    uint8_t _cid[16];
+    uint8_t _ssr[64];
+    uint32_t _ocr;
+    SDCardInfo _info;
+
+    bool _erase_on;
+    uint32_t _erased;
+
+    uint32_t _init_us;
+    uint32_t _init_polls;
+
+    uint32_t _tran_speed();
+    int _negotiate_sck();
+    int _sck_backoff();
+    void _sck_keep();
+    void _sck_clean();
+    int _data_response(int response);
 
     void set_init_sck(uint32_t sck) { _init_sck = sck; }
     // Note: The highest SPI clock rate is 20 MHz for MMC and 25 MHz for SD
     void set_transfer_sck(uint32_t sck) { _transfer_sck = sck; }
     uint32_t _init_sck;
     uint32_t _transfer_sck;
+    uint32_t _sck;
+    int _sck_step;
+    uint32_t _good_sck;         // negotiated or forced, see _sck_clean()
+    int _good_step;
+    uint32_t _clean_transfers;
+    uint32_t _restore_after;
 
-    SPI _spi;
-    DigitalOut _cs;
+    SDTransport *_transport;
+    bool _own_transport;
     int cdv;
     int _is_initialized;
+
+    bool _streaming;
+    bool _stream_open;
+    uint32_t _stream_first;
+    uint32_t _stream_next;
+    uint32_t _uncommitted;      // blocks of earlier calls until the transfer is finished
+    void _committed();
+    int _lost_error;            // for the next disk_sync() after they were reset
+
+    static void _async_done(void *context, int result);
+    void _async_run();
+    void _async_finish(int result);
+    int _async_wait();
+    volatile int _async_state;
+    volatile int _async_result;
+    const uint8_t *_async_buffer;
+    uint32_t _async_remaining;
+
+    bool _crc_on;
+
+    bool _card_busy;
+    uint32_t _busy_timeout_ms;  // limit of the next busy wait
+    uint32_t _async_busy_us;    // start of the asynchronous busy wait
+    int _last_error;            // SD_ERROR code of the last failure
+
+    void _account(SDLatency &latency, uint32_t start_us, uint32_t busy_us);
+    Timer _stats_timer;     // free running, for the latencies
+    SDStats _stats;
+
+    int _ra_read(uint8_t* buffer, uint32_t block_number, uint32_t count);
+    int _ra_fill(uint32_t block_number, uint32_t count);
+    void _ra_drop();
+    void _ra_update(const uint8_t* buffer, uint32_t block_number, uint32_t count);
+    uint8_t *_ra_pool;      // _ra_max sectors, word aligned
+    uint32_t _ra_max;
+    uint32_t _ra_window;
+    uint32_t _ra_start;     // first buffered sector
+    uint32_t _ra_count;     // buffered sectors not read yet
+    uint32_t _ra_offset;    // sector index of _ra_start in the pool
+    uint32_t _ra_next;      // sector after the last read of the stream
+    uint32_t _ra_last;      // sector after the last read outside the stream
+    uint32_t _ra_hits;
+    uint32_t _ra_waste;
 };
 
 #endif
\ No newline at end of file
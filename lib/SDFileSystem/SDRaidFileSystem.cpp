@@ -0,0 +1,408 @@
+/* Two SD cards striped or mirrored as one FAT volume
+ */
+#include "SDRaidFileSystem.h"
+#include "mbed_debug.h"
+#include "diskio.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define SD_BLOCK_SIZE      512
+#define SD_RAID_DBG        0
+
+// mirror label: magic, generation (little endian)
+static const char sd_raid_magic[8] = { 'S', 'D', 'M', 'I', 'R', 'R', 'O', 'R' };
+
+SDRaidFileSystem::SDRaidFileSystem(SDFileSystem &disk0, SDFileSystem &disk1, const char* name,
+        int mode, uint32_t stripe_sectors) :
+    FATFileSystem(name), _mode(mode), _stripe(stripe_sectors > 0 ? stripe_sectors : 1), _failed(0),
+    _generation(0) {
+    _disk[0] = &disk0;
+    _disk[1] = &disk1;
+}
+
+int SDRaidFileSystem::disk_initialize() {
+    int result[2];
+    result[0] = _disk[0]->disk_initialize();
+    result[1] = _disk[1]->disk_initialize();
+    if (_mode != SD_RAID_MIRROR) {
+        return result[0] != 0 || result[1] != 0 ? 1 : 0;
+    }
+
+    // a card that left the mirror stays out. When both did, nothing was
+    // written since and the labels tell which card left last
+    if (_failed == 3) {
+        _failed = 0;
+    }
+    uint32_t generation[2] = { 0, 0 };
+    _generation = 0;
+    for (int i = 0; i < 2; i++) {
+        if (result[i] == 0) {
+            result[i] = _read_label(i, &generation[i]);
+        }
+        if (result[i] == 0 && generation[i] > _generation) {
+            _generation = generation[i];
+        }
+    }
+    if (_generation == 0) {
+        // new cards, the mirror starts with the ones that are there
+        _generation = 1;
+        for (int i = 0; i < 2; i++) {
+            if (result[i] == 0 && !(_failed & (1 << i))) {
+                result[i] = _write_label(i, _generation);
+                generation[i] = _generation;
+            }
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        if (result[i] == 0 && generation[i] != _generation && !(_failed & (1 << i))) {
+            debug("SD card %d missed writes to the mirror (generation %u of %u), rebuild it\n",
+                  i, (unsigned)generation[i], (unsigned)_generation);
+            _failed |= 1 << i;
+        }
+    }
+
+    // one card is enough to carry on
+    for (int i = 0; i < 2; i++) {
+        if (result[i] != 0) {
+            _fail(i, result[i]);
+        }
+    }
+    return _failed == 3 ? 1 : 0;
+}
+
+int SDRaidFileSystem::disk_status() {
+    int status = 1;
+    for (int i = 0; i < 2; i++) {
+        if (_mode == SD_RAID_MIRROR && (_failed & (1 << i))) {
+            continue;
+        }
+        if (_disk[i]->disk_status() != 0) {
+            if (_mode == SD_RAID_STRIPE) {
+                return 1;
+            }
+        } else {
+            status = 0;
+        }
+    }
+    return status;
+}
+
+uint32_t SDRaidFileSystem::disk_sectors() {
+    uint32_t s0 = _disk[0]->disk_sectors();
+    uint32_t s1 = _disk[1]->disk_sectors();
+    if (_mode == SD_RAID_MIRROR) {
+        // the smaller card that was seen, less its label
+        uint32_t sectors = s0 > 1 && (s1 <= 1 || s0 < s1) ? s0 : s1;
+        return sectors > 1 ? sectors - 1 : 0;
+    }
+    uint32_t sectors = s0 < s1 ? s0 : s1;
+    return 2 * (sectors / _stripe * _stripe);
+}
+
+int SDRaidFileSystem::disk_read(uint8_t* buffer, uint32_t block_number, uint32_t count) {
+    if (_mode == SD_RAID_MIRROR) {
+        // from the first card still in the mirror, the other one on error
+        int result = 1;
+        for (int i = 0; i < 2; i++) {
+            if (_failed & (1 << i)) {
+                continue;
+            }
+            result = _disk[i]->disk_read(buffer, block_number, count);
+            if (result == 0) {
+                return 0;
+            }
+            _fail(i, result);
+        }
+        return result;
+    }
+
+    for (uint32_t done = 0; done < count; ) {
+        uint32_t physical;
+        int index = _map(block_number + done, &physical);
+        uint32_t n = _stripe - (block_number + done) % _stripe;
+        if (n > count - done) {
+            n = count - done;
+        }
+        int result = _disk[index]->disk_read(buffer + done * SD_BLOCK_SIZE, physical, n);
+        if (result != 0) {
+            return result;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+int SDRaidFileSystem::disk_write(const uint8_t* buffer, uint32_t block_number, uint32_t count) {
+    if (_mode == SD_RAID_MIRROR) {
+        return _mirror_write(buffer, block_number, count);
+    }
+    return _stripe_write(buffer, block_number, count);
+}
+
+int SDRaidFileSystem::_stripe_write(const uint8_t* buffer, uint32_t block_number, uint32_t count) {
+    // hand the stripe units to the cards in turn. A card waits only for its
+    // own previous unit, so with DMA both cards transfer at the same time
+    bool started[2] = { false, false };
+    int result = 0;
+    for (uint32_t done = 0; done < count && result == 0; ) {
+        uint32_t physical;
+        int index = _map(block_number + done, &physical);
+        uint32_t n = _stripe - (block_number + done) % _stripe;
+        if (n > count - done) {
+            n = count - done;
+        }
+        if (started[index]) {
+            result = _wait(index);
+        }
+        if (result == 0) {
+            result = _disk[index]->disk_write_async(buffer + done * SD_BLOCK_SIZE, physical, n);
+            started[index] = result == 0;
+        }
+        done += n;
+    }
+
+    // FatFs reuses the buffer once this returns
+    for (int i = 0; i < 2; i++) {
+        if (started[i]) {
+            int r = _wait(i);
+            if (result == 0) {
+                result = r;
+            }
+        }
+    }
+    if (result == 0) {
+        return 0;
+    }
+
+    // the asynchronous writes have no retries, write the units again with them
+    debug_if(SD_RAID_DBG, "striped write at %d failed (%d), writing again\n", block_number, result);
+    for (uint32_t done = 0; done < count; ) {
+        uint32_t physical;
+        int index = _map(block_number + done, &physical);
+        uint32_t n = _stripe - (block_number + done) % _stripe;
+        if (n > count - done) {
+            n = count - done;
+        }
+        result = _disk[index]->disk_write(buffer + done * SD_BLOCK_SIZE, physical, n);
+        if (result != 0) {
+            return result;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+int SDRaidFileSystem::_mirror_write(const uint8_t* buffer, uint32_t block_number, uint32_t count) {
+    // both cards get the whole write at the same time
+    int result[2] = { 0, 0 };
+    bool started[2] = { false, false };
+    for (int i = 0; i < 2; i++) {
+        if (!(_failed & (1 << i))) {
+            result[i] = _disk[i]->disk_write_async(buffer, block_number, count);
+            started[i] = result[i] == 0;
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        if (started[i]) {
+            result[i] = _wait(i);
+        }
+    }
+
+    // write again with retries, a card that still fails leaves the mirror
+    for (int i = 0; i < 2; i++) {
+        if (!(_failed & (1 << i)) && result[i] != 0) {
+            result[i] = _disk[i]->disk_write(buffer, block_number, count);
+            if (result[i] != 0) {
+                _fail(i, result[i]);
+            }
+        }
+    }
+    if (_failed == 3) {
+        return result[0] != 0 ? result[0] : result[1];
+    }
+    return 0;
+}
+
+int SDRaidFileSystem::disk_sync() {
+    int result = 0;
+    for (int i = 0; i < 2; i++) {
+        if (_mode == SD_RAID_MIRROR && (_failed & (1 << i))) {
+            continue;
+        }
+        int r = _disk[i]->disk_sync();
+        if (r != 0 && _mode == SD_RAID_MIRROR) {
+            _fail(i, r);
+            r = _failed == 3 ? r : 0;
+        }
+        if (result == 0) {
+            result = r;
+        }
+    }
+    return result;
+}
+
+int SDRaidFileSystem::disk_erase(uint32_t block_number, uint32_t count) {
+    if (count == 0) {
+        return 0;
+    }
+
+    // the part of a sector range on one card is contiguous there
+    uint32_t first[2] = { 0, 0 };
+    uint32_t end[2] = { 0, 0 };
+    if (_mode == SD_RAID_MIRROR) {
+        first[0] = first[1] = block_number;
+        end[0] = end[1] = block_number + count;
+    } else {
+        for (uint32_t done = 0; done < count; ) {
+            uint32_t physical;
+            int index = _map(block_number + done, &physical);
+            uint32_t n = _stripe - (block_number + done) % _stripe;
+            if (n > count - done) {
+                n = count - done;
+            }
+            if (end[index] == 0) {
+                first[index] = physical;
+            }
+            end[index] = physical + n;
+            done += n;
+        }
+    }
+
+    int result = 0;
+    for (int i = 0; i < 2; i++) {
+        if (end[i] == 0 || (_mode == SD_RAID_MIRROR && (_failed & (1 << i)))) {
+            continue;
+        }
+        int r = _disk[i]->disk_erase(first[i], end[i] - first[i]);
+        if (result == 0) {
+            result = r;
+        }
+    }
+    return result;
+}
+
+int SDRaidFileSystem::disk_ioctl(int cmd, void *buffer) {
+    if (cmd != GET_BLOCK_SIZE) {
+        return -1;
+    }
+    // the larger erase unit of the two cards, at least one stripe unit
+    DWORD block = _mode == SD_RAID_STRIPE ? _stripe : 1;
+    for (int i = 0; i < 2; i++) {
+        DWORD size;
+        if (_disk[i]->disk_ioctl(GET_BLOCK_SIZE, &size) == 0 && size > block) {
+            block = size;
+        }
+    }
+    *((DWORD *)buffer) = _mode == SD_RAID_STRIPE ? 2 * block : block;
+    return 0;
+}
+
+int SDRaidFileSystem::rebuild(int index) {
+    index &= 1;
+    int from = 1 - index;
+    if (_mode != SD_RAID_MIRROR || !(_failed & (1 << index)) || (_failed & (1 << from))) {
+        return -1;
+    }
+    int result = _disk[index]->disk_initialize();
+    if (result != 0) {
+        return result;
+    }
+    uint32_t sectors = disk_sectors();
+    if (_disk[index]->disk_sectors() <= sectors) {
+        debug("SD card %d is too small for the mirror\n", index);
+        return SD_ERROR;
+    }
+    uint8_t *buffer = (uint8_t *)malloc(SD_RAID_REBUILD_SECTORS * SD_BLOCK_SIZE);
+    if (buffer == NULL) {
+        return SD_ERROR;
+    }
+
+    debug("SD card %d: rebuilding %u sectors\n", index, (unsigned)sectors);
+    for (uint32_t sector = 0; sector < sectors && result == 0; sector += SD_RAID_REBUILD_SECTORS) {
+        uint32_t n = sectors - sector < SD_RAID_REBUILD_SECTORS ? sectors - sector : SD_RAID_REBUILD_SECTORS;
+        result = _disk[from]->disk_read(buffer, sector, n);
+        if (result == 0) {
+            result = _disk[index]->disk_write(buffer, sector, n);
+        }
+    }
+    free(buffer);
+    if (result == 0) {
+        result = _disk[index]->disk_sync();
+    }
+    if (result == 0) {
+        result = _write_label(index, _generation);
+    }
+    if (result != 0) {
+        debug("SD card %d: rebuild failed (error %d)\n", index, result);
+        return result;
+    }
+    _failed &= ~(1 << index);
+    debug("SD card %d is back in the mirror\n", index);
+    return 0;
+}
+
+int SDRaidFileSystem::mode() { return _mode; }
+uint32_t SDRaidFileSystem::stripe_sectors() { return _stripe; }
+int SDRaidFileSystem::failed() { return _failed; }
+SDFileSystem *SDRaidFileSystem::disk(int index) { return _disk[index & 1]; }
+
+// card and sector on it of a striped sector
+int SDRaidFileSystem::_map(uint32_t block_number, uint32_t *physical) {
+    uint32_t unit = block_number / _stripe;
+    *physical = (unit / 2) * _stripe + block_number % _stripe;
+    return unit % 2;
+}
+
+// wait for the asynchronous write of one card. The programming wait of the
+// other card only advances when polled, so it is kept going meanwhile
+int SDRaidFileSystem::_wait(int index) {
+    while (_disk[index]->disk_async_busy()) {
+        _disk[1 - index]->disk_async_busy();
+    }
+    return _disk[index]->disk_async_wait();
+}
+
+void SDRaidFileSystem::_fail(int index, int result) {
+    if (_failed & (1 << index)) {
+        return;
+    }
+    debug("SD card %d left the mirror (error %d)\n", index, result);
+    _failed |= 1 << index;
+
+    // the other card goes on alone: a new generation tells it from this one
+    int other = 1 - index;
+    if (!(_failed & (1 << other))) {
+        int r = _write_label(other, _generation + 1);
+        if (r != 0) {
+            _fail(other, r);
+        } else {
+            _generation++;
+        }
+    }
+}
+
+// generation in the label of a card, 0 when it has none
+int SDRaidFileSystem::_read_label(int index, uint32_t *generation) {
+    uint8_t label[SD_BLOCK_SIZE];
+    int result = _disk[index]->disk_read(label, _disk[index]->disk_sectors() - 1, 1);
+    if (result != 0) {
+        return result;
+    }
+    *generation = 0;
+    if (memcmp(label, sd_raid_magic, sizeof(sd_raid_magic)) == 0) {
+        *generation = label[8] | (label[9] << 8) | (label[10] << 16) | ((uint32_t)label[11] << 24);
+    }
+    return 0;
+}
+
+int SDRaidFileSystem::_write_label(int index, uint32_t generation) {
+    uint8_t label[SD_BLOCK_SIZE];
+    memset(label, 0, sizeof(label));
+    memcpy(label, sd_raid_magic, sizeof(sd_raid_magic));
+    label[8] = generation & 0xFF;
+    label[9] = (generation >> 8) & 0xFF;
+    label[10] = (generation >> 16) & 0xFF;
+    label[11] = generation >> 24;
+    int result = _disk[index]->disk_write(label, _disk[index]->disk_sectors() - 1, 1);
+    return result == 0 ? _disk[index]->disk_sync() : result;
+}
@@ -0,0 +1,109 @@
+/* Two SD cards striped or mirrored as one FAT volume
+ */
+#ifndef MBED_SDRAIDFILESYSTEM_H
+#define MBED_SDRAIDFILESYSTEM_H
+
+#include "SDFileSystem.h"
+
+// Layouts
+//  - stripe units alternate between the cards (RAID-0), twice the size
+//  - every sector on both cards (RAID-1), the size of the smaller card less
+//    the mirror label in the last sector of each card
+#define SD_RAID_STRIPE 0
+#define SD_RAID_MIRROR 1
+
+// default stripe unit in 512 byte sectors
+#define SD_RAID_STRIPE_SECTORS 64
+
+// sectors copied at a time by rebuild()
+#define SD_RAID_REBUILD_SECTORS 8
+
+/** One filesystem on two SD cards, striped or mirrored
+ *
+ * The cards are SDFileSystems created without a name, so they take no FatFs
+ * drive of their own. Writes go out with disk_write_async() to both cards
+ * before waiting for either, so with each card on its own SSP the transfers
+ * run at the same time. A mirror keeps working on one card when the other
+ * fails, see failed().
+ *
+ * Each card of a mirror has a label in its last sector with a generation
+ * count. When a card leaves the mirror the generation of the other one goes
+ * up, so a card that missed writes is known by its older generation, also
+ * after a restart, and stays out until rebuild() copied the mirror onto it.
+ * A mirror started with only the card that missed writes cannot tell.
+ *
+ * @code
+ * SDFileSystem sd0(p5, p6, p7, p8, NULL);     // SSP1
+ * SDFileSystem sd1(p11, p12, p13, p14, NULL); // SSP0
+ * SDRaidFileSystem raid(sd0, sd1, "sd");
+ * @endcode
+ */
+class SDRaidFileSystem : public FATFileSystem {
+public:
+
+    /** Put the filesystem on two cards
+     *
+     * The layout is fixed once the cards are formatted, the same mode and
+     * stripe unit must be used every time.
+     *
+     * @param disk0          first card
+     * @param disk1          second card
+     * @param name           The name used to access the virtual filesystem
+     * @param mode           SD_RAID_STRIPE or SD_RAID_MIRROR
+     * @param stripe_sectors stripe unit in sectors (SD_RAID_STRIPE)
+     */
+    SDRaidFileSystem(SDFileSystem &disk0, SDFileSystem &disk1, const char* name,
+            int mode = SD_RAID_STRIPE, uint32_t stripe_sectors = SD_RAID_STRIPE_SECTORS);
+
+    virtual int disk_initialize();
+    virtual int disk_status();
+    virtual int disk_read(uint8_t* buffer, uint32_t block_number, uint32_t count);
+    virtual int disk_write(const uint8_t* buffer, uint32_t block_number, uint32_t count);
+    virtual int disk_sync();
+    virtual uint32_t disk_sectors();
+    virtual int disk_erase(uint32_t block_number, uint32_t count);
+
+    /** GET_BLOCK_SIZE covers both cards: a full stripe of erase units
+     */
+    virtual int disk_ioctl(int cmd, void *buffer);
+
+    int mode();
+    uint32_t stripe_sectors();
+
+    /** Cards out of a mirror, bit 0 for disk0 and bit 1 for disk1: dropped
+     * after an error, or behind the mirror by their label. disk_initialize()
+     * keeps them out, only rebuild() brings a card back
+     */
+    int failed();
+
+    /** Copy the mirror onto a card that is out of it and take it back in
+     *
+     * Blocks until every sector is copied, which takes as long as writing
+     * the whole card.
+     *
+     * @param index the card, 0 or 1
+     * @returns 0 when the card is back in the mirror, -1 when there is
+     *          nothing to rebuild from, else an SD_ERROR code
+     */
+    int rebuild(int index);
+
+    SDFileSystem *disk(int index);
+
+protected:
+
+    int _map(uint32_t block_number, uint32_t *physical);
+    int _wait(int index);
+    void _fail(int index, int result);
+    int _read_label(int index, uint32_t *generation);
+    int _write_label(int index, uint32_t generation);
+    int _stripe_write(const uint8_t* buffer, uint32_t block_number, uint32_t count);
+    int _mirror_write(const uint8_t* buffer, uint32_t block_number, uint32_t count);
+
+    SDFileSystem *_disk[2];
+    int _mode;
+    uint32_t _stripe;
+    int _failed;
+    uint32_t _generation;   // of the cards in the mirror
+};
+
+#endif
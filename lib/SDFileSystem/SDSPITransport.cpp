@@ -0,0 +1,225 @@
+/* SD card transport on the LPC1768 SPI, with SSP block transfers and GPDMA
+ */
+#include "SDSPITransport.h"
+
+#if SD_SPI_SSP
+// LPC17xx SSP status and DMA control registers
+#define SSP_SR_TNF         (1 << 1)    // transmit FIFO not full
+#define SSP_SR_RNE         (1 << 2)    // receive FIFO not empty
+#define SSP_FIFO_DEPTH     8
+#define SSP_DMACR_RXDMAE   (1 << 0)
+#define SSP_DMACR_TXDMAE   (1 << 1)
+
+// GPDMA channels used for the first SD card, channel 0 has the highest
+// priority. The transport in slot n uses these plus 2 * n
+#ifndef SD_DMA_TX_CH
+#define SD_DMA_TX_CH       0
+#define SD_DMA_RX_CH       1
+#endif
+#define SD_DMA_CHANNEL(n)  ((LPC_GPDMACH_TypeDef *)((uint32_t)LPC_GPDMACH0 + 0x20 * (n)))
+
+// GPDMA channel control
+#define DMA_CTRL_SB_4      (1 << 12)   // source burst size 4
+#define DMA_CTRL_DB_4      (1 << 15)   // destination burst size 4
+#define DMA_CTRL_SI        (1 << 26)   // source increment
+#define DMA_CTRL_DI        (1 << 27)   // destination increment
+#define DMA_CTRL_I         (1UL << 31) // terminal count interrupt
+
+// GPDMA channel configuration
+#define DMA_CFG_E          (1 << 0)
+#define DMA_CFG_SRC(p)     ((p) << 1)
+#define DMA_CFG_DEST(p)    ((p) << 6)
+#define DMA_CFG_M2P        (1 << 11)
+#define DMA_CFG_P2M        (2 << 11)
+#define DMA_CFG_IE         (1 << 14)   // error interrupt mask
+#define DMA_CFG_ITC        (1 << 15)   // terminal count interrupt mask
+
+// GPDMA request lines
+#define DMA_SSP0_TX        0
+#define DMA_SSP0_RX        1
+#define DMA_SSP1_TX        2
+#define DMA_SSP1_RX        3
+
+#define DMA_MAX_TRANSFER   0xFFF
+#define PCONP_PCGPDMA      (1 << 29)
+
+SDSPITransport *SDSPITransport::_dma_owner[SD_DMA_SLOTS] = { NULL };
+#endif
+
+SDSPITransport::SDSPITransport(PinName mosi, PinName miso, PinName sclk, PinName cs) :
+    _spi(mosi, miso, sclk), _cs(cs) {
+    _cs = 1;
+
+#if SD_SPI_SSP
+    _dma_slot = -1;
+    _dma_tx_ch = SD_DMA_TX_CH;
+    _dma_rx_ch = SD_DMA_RX_CH;
+    _dma_fill = 0xFF;
+    _dma_sink = 0;
+
+    // SSP driven directly by the block transfers (p5-p7: SSP1, p11-p13: SSP0)
+    if (mosi == p5) {
+        _ssp = LPC_SSP1;
+        _dma_tx_peripheral = DMA_SSP1_TX;
+        _dma_rx_peripheral = DMA_SSP1_RX;
+    } else if (mosi == p11) {
+        _ssp = LPC_SSP0;
+        _dma_tx_peripheral = DMA_SSP0_TX;
+        _dma_rx_peripheral = DMA_SSP0_RX;
+    } else {
+        _ssp = NULL;
+    }
+#endif
+}
+
+SDSPITransport::~SDSPITransport() {
+#if SD_SPI_SSP
+    if (_dma_slot < 0) {
+        return;
+    }
+    _dma_owner[_dma_slot] = NULL;
+    for (int slot = 0; slot < SD_DMA_SLOTS; slot++) {
+        if (_dma_owner[slot] != NULL) {
+            return;
+        }
+    }
+    NVIC_DisableIRQ(DMA_IRQn);
+#endif
+}
+
+void SDSPITransport::select(bool selected) {
+    _cs = selected ? 0 : 1;
+}
+
+int SDSPITransport::write(int value) {
+    return _spi.write(value);
+}
+
+void SDSPITransport::frequency(uint32_t hz) {
+    _spi.frequency(hz);
+}
+
+// the SSP FIFO is kept full instead of making one blocking HAL call per byte
+void SDSPITransport::block(const uint8_t *tx, uint8_t *rx, uint32_t length) {
+#if SD_SPI_SSP
+    if (_ssp != NULL) {
+        // the receive FIFO is empty here, _spi.write() drains it. Never have
+        // more than the FIFO depth in flight so the receive FIFO cannot overrun
+        LPC_SSP_TypeDef *ssp = _ssp;
+        uint32_t sent = 0;
+        uint32_t received = 0;
+        while (received < length) {
+            while (sent < length && sent - received < SSP_FIFO_DEPTH && (ssp->SR & SSP_SR_TNF)) {
+                ssp->DR = tx ? tx[sent] : 0xFF;
+                sent++;
+            }
+            while (ssp->SR & SSP_SR_RNE) {
+                uint8_t data = ssp->DR;
+                if (rx) {
+                    rx[received] = data;
+                }
+                received++;
+            }
+        }
+        return;
+    }
+#endif
+
+    for (uint32_t i = 0; i < length; i++) {
+        uint8_t data = _spi.write(tx ? tx[i] : 0xFF);
+        if (rx) {
+            rx[i] = data;
+        }
+    }
+}
+
+int SDSPITransport::block_async(const uint8_t *tx, uint8_t *rx, uint32_t length) {
+#if SD_SPI_SSP
+    if (_ssp == NULL || length == 0 || length > DMA_MAX_TRANSFER) {
+        return 1;
+    }
+
+    if (_dma_slot < 0) {
+        // take a free pair of channels, the first transport powers up the
+        // GPDMA and takes over its interrupt
+        bool first = true;
+        for (int slot = SD_DMA_SLOTS - 1; slot >= 0; slot--) {
+            if (_dma_owner[slot] == NULL) {
+                _dma_slot = slot;
+            } else {
+                first = false;
+            }
+        }
+        if (_dma_slot < 0) {
+            return 1;
+        }
+        _dma_owner[_dma_slot] = this;
+        _dma_tx_ch = SD_DMA_TX_CH + 2 * _dma_slot;
+        _dma_rx_ch = SD_DMA_RX_CH + 2 * _dma_slot;
+        if (first) {
+            LPC_SC->PCONP |= PCONP_PCGPDMA;
+            LPC_GPDMA->DMACConfig = 1;
+            NVIC_SetVector(DMA_IRQn, (uint32_t)&SDSPITransport::_dma_irq);
+            NVIC_EnableIRQ(DMA_IRQn);
+        }
+    }
+
+    uint32_t channels = (1 << _dma_tx_ch) | (1 << _dma_rx_ch);
+    LPC_GPDMA->DMACIntTCClear = channels;
+    LPC_GPDMA->DMACIntErrClr = channels;
+
+    // receive channel: SSP -> buffer, completes last and raises the interrupt
+    LPC_GPDMACH_TypeDef *rx_ch = SD_DMA_CHANNEL(_dma_rx_ch);
+    rx_ch->DMACCSrcAddr = (uint32_t)&_ssp->DR;
+    rx_ch->DMACCDestAddr = rx ? (uint32_t)rx : (uint32_t)&_dma_sink;
+    rx_ch->DMACCLLI = 0;
+    rx_ch->DMACCControl = length | DMA_CTRL_SB_4 | DMA_CTRL_DB_4 | (rx ? DMA_CTRL_DI : 0) | DMA_CTRL_I;
+    rx_ch->DMACCConfig = DMA_CFG_E | DMA_CFG_SRC(_dma_rx_peripheral) | DMA_CFG_P2M | DMA_CFG_IE | DMA_CFG_ITC;
+
+    // transmit channel: buffer (or 0xFF fill) -> SSP
+    LPC_GPDMACH_TypeDef *tx_ch = SD_DMA_CHANNEL(_dma_tx_ch);
+    tx_ch->DMACCSrcAddr = tx ? (uint32_t)tx : (uint32_t)&_dma_fill;
+    tx_ch->DMACCDestAddr = (uint32_t)&_ssp->DR;
+    tx_ch->DMACCLLI = 0;
+    tx_ch->DMACCControl = length | DMA_CTRL_SB_4 | DMA_CTRL_DB_4 | (tx ? DMA_CTRL_SI : 0);
+    tx_ch->DMACCConfig = DMA_CFG_E | DMA_CFG_DEST(_dma_tx_peripheral) | DMA_CFG_M2P | DMA_CFG_IE;
+
+    _ssp->DMACR = SSP_DMACR_RXDMAE | SSP_DMACR_TXDMAE;
+    return 0;
+#else
+    return 1;
+#endif
+}
+
+#if SD_SPI_SSP
+void SDSPITransport::_dma_irq() {
+    for (int slot = 0; slot < SD_DMA_SLOTS; slot++) {
+        if (_dma_owner[slot] != NULL) {
+            _dma_owner[slot]->_dma_done();
+        }
+    }
+}
+
+void SDSPITransport::_dma_done() {
+    uint32_t channels = (1 << _dma_tx_ch) | (1 << _dma_rx_ch);
+    uint32_t tc = LPC_GPDMA->DMACIntTCStat & channels;
+    uint32_t err = LPC_GPDMA->DMACIntErrStat & channels;
+    LPC_GPDMA->DMACIntTCClear = tc;
+    LPC_GPDMA->DMACIntErrClr = err;
+
+    if (!err && !(tc & (1 << _dma_rx_ch))) {
+        return;
+    }
+
+    _ssp->DMACR = 0;
+    if (err) {
+        // stop both channels and drop what is left in the receive FIFO
+        SD_DMA_CHANNEL(_dma_tx_ch)->DMACCConfig = 0;
+        SD_DMA_CHANNEL(_dma_rx_ch)->DMACCConfig = 0;
+        while (_ssp->SR & SSP_SR_RNE) {
+            (void)_ssp->DR;
+        }
+    }
+    complete(err ? 1 : 0);
+}
+#endif
@@ -0,0 +1,71 @@
+/* SD card transport on the LPC1768 SPI, with SSP block transfers and GPDMA
+ */
+#ifndef MBED_SDSPITRANSPORT_H
+#define MBED_SDSPITRANSPORT_H
+
+#include "mbed.h"
+#include "SDTransport.h"
+
+// the SSP FIFO and GPDMA paths need the LPC17xx registers, other targets and
+// the host build use SPI::write() only
+#if defined(LPC_SSP0) && defined(LPC_GPDMA)
+#define SD_SPI_SSP 1
+#else
+#define SD_SPI_SSP 0
+#endif
+
+// transports that can run block_async() at the same time, each on its own
+// pair of GPDMA channels
+#define SD_DMA_SLOTS 2
+
+/** SD transport on the mbed SPI, with the LPC1768 SSP FIFO and GPDMA
+ *
+ * Blocks are moved through the SSP data register without a HAL call per byte,
+ * and block_async() runs them on two GPDMA channels (SD_DMA_TX_CH and
+ * SD_DMA_RX_CH, the next two for a second transport) with a terminal count
+ * interrupt on the receive channel. Pins that are not on SSP0 (p11-p13) or
+ * SSP1 (p5-p7) fall back to SPI::write() and have no asynchronous path.
+ */
+class SDSPITransport : public SDTransport {
+public:
+
+    /** Create the transport
+     *
+     * @param mosi SPI mosi pin connected to SD Card
+     * @param miso SPI miso pin conencted to SD Card
+     * @param sclk SPI sclk pin connected to SD Card
+     * @param cs   DigitalOut pin used as SD Card chip select
+     */
+    SDSPITransport(PinName mosi, PinName miso, PinName sclk, PinName cs);
+    virtual ~SDSPITransport();
+
+    virtual void select(bool selected);
+    virtual int write(int value);
+    virtual void block(const uint8_t *tx, uint8_t *rx, uint32_t length);
+    virtual void frequency(uint32_t hz);
+    virtual int block_async(const uint8_t *tx, uint8_t *rx, uint32_t length);
+
+protected:
+
+    SPI _spi;
+    DigitalOut _cs;
+
+#if SD_SPI_SSP
+    static void _dma_irq();
+    static SDSPITransport *_dma_owner[SD_DMA_SLOTS];
+    void _dma_done();
+
+    LPC_SSP_TypeDef *_ssp;
+    int _dma_tx_peripheral;
+    int _dma_rx_peripheral;
+    int _dma_slot;          // index in _dma_owner, -1 before the first transfer
+    int _dma_tx_ch;
+    int _dma_rx_ch;
+
+    // source and sink of the DMA channel that has no buffer
+    uint8_t _dma_fill;
+    uint8_t _dma_sink;
+#endif
+};
+
+#endif
@@ -0,0 +1,81 @@
+/* Byte transport between SDFileSystem and the card
+ */
+#ifndef MBED_SDTRANSPORT_H
+#define MBED_SDTRANSPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Byte transport between SDFileSystem and the card
+ *
+ * SDFileSystem speaks the SD SPI protocol through this interface only, so the
+ * same driver runs on the LPC1768 SSP (SDSPITransport) and against a simulated
+ * card on the host (SDSimTransport).
+ */
+class SDTransport {
+public:
+
+    SDTransport() : _done(NULL), _done_context(NULL) {}
+    virtual ~SDTransport() {}
+
+    /** Assert (true) or release (false) the card chip select
+     */
+    virtual void select(bool selected) = 0;
+
+    /** Exchange one byte
+     *
+     * @param value the byte to send
+     * @returns the byte received
+     */
+    virtual int write(int value) = 0;
+
+    /** Exchange a block of bytes
+     *
+     * @param tx     bytes to send, NULL to send 0xFF
+     * @param rx     buffer for the received bytes, NULL to discard them
+     * @param length number of bytes
+     */
+    virtual void block(const uint8_t *tx, uint8_t *rx, uint32_t length) = 0;
+
+    /** Set the clock in Hz
+     */
+    virtual void frequency(uint32_t hz) = 0;
+
+    /** Start block() in the background
+     *
+     * The callback given to attach() is called with the result (0 ok) when the
+     * transfer has finished, from interrupt context on the target. The buffers
+     * must stay untouched until then, and no other transfer may be started.
+     *
+     * @returns 0 when the transfer was started, non-zero when the transport has
+     *          no asynchronous path (the caller then uses block())
+     */
+    virtual int block_async(const uint8_t *tx, uint8_t *rx, uint32_t length) {
+        return 1;
+    }
+
+    /** Give a transport without a completion interrupt the chance to finish
+     * block_async(). Called while the caller waits for the transfer
+     */
+    virtual void poll() {}
+
+    /** Set the completion callback of block_async()
+     */
+    void attach(void (*done)(void *context, int result), void *context) {
+        _done = done;
+        _done_context = context;
+    }
+
+protected:
+
+    void complete(int result) {
+        if (_done) {
+            _done(_done_context, result);
+        }
+    }
+
+    void (*_done)(void *context, int result);
+    void *_done_context;
+};
+
+#endif
@@ -2,7 +2,10 @@
 
 #include "mbed.h"
 #include "OV7670.h"
+#include "OV7670Fast.h"
+#include "OV7670Group.h"
 #include "SDFileSystem.h"
+#include "SDCRC.h"
 
 // 画像フォーマット
 enum COLOR_FORMATS {
@@ -20,11 +23,49 @@ enum IMAGE_SIZE {
     VGA_480x360   = 3,
     QVGA_320x240  = 4,
     QQVGA_160x120 = 5,
+    VGA_640x480_SPLIT = 6, // 2バイトカラー、分割キャプチャ
+    WINDOW_CUSTOM     = 7, // 任意の切り出し窓 (windowX/Y/W/H)
 };
 
 uint8_t colorFormat = BAYER;    //MEMO: カラーフォーマット
 uint8_t imageSize = MAX_544x360;//MEMO: 画像サイズ
 
+// WINDOW_CUSTOM の切り出し窓 (VGA 座標)
+int windowX = 0;
+int windowY = 0;
+int windowW = 640;
+int windowH = 480;
+int windowScale = 1; // 縮小率 (1,2,4,8)
+
+// 1フレームの FIFO 書き込みに許す時間 (ms)
+int maxFrameMs = 100;
+
+// センサがフレームを書き込んでいる間に FIFO の読み出しを始める
+uint8_t earlyReadout = 1;
+#define EARLY_READ_MARGIN 1 // 書き込み済み行に対して読み出しを遅らせる行数
+
+// 起動時にカラーバー自己診断を行う
+uint8_t runSelfTest = 1;
+
+// 起動時に BMP 1枚分の連続書き込み速度を計測する
+uint8_t runSdBenchmark = 0;
+
+// SD 転送を CRC で保護する (CMD59)
+uint8_t sdCrc = 1;
+
+// 撮影ごとの SD 統計を sd_stats.txt にも追記する
+uint8_t sdStatsFile = 0;
+
+// FAT・ディレクトリのセクタをキャッシュする数 (512 バイト単位, 0: 使わない)
+#define SD_CACHE_SECTORS 8
+
+// 読み出し時に先読みする最大セクタ数 (ベンチマークの読み出し中のみ確保する)
+#define SD_READAHEAD_SECTORS 16
+
+#define CAMERA_RESET_TIMEOUT   300  // リセット後の応答待ち (ms)
+#define CAMERA_SETTLE_FRAMES   3    // AEC/AGC/AWB が安定とみなす連続フレーム数
+#define CAMERA_SETTLE_TIMEOUT  3000 // AEC/AGC/AWB 安定待ち (ms)
+
 // 状態管理
 enum DeviceState {
     INIT     = 0x00,
@@ -34,6 +75,11 @@ enum DeviceState {
     ERROR    = 0x80
 };
 
+// カメラ台数 (2: ステレオ)
+#ifndef CAMERA_COUNT
+#define CAMERA_COUNT 1
+#endif
+
 uint8_t currentStatus = INIT;
 uint8_t isCameraBusy = 0;
 
@@ -56,11 +102,39 @@ uint8_t isCameraBusy = 0;
  * /WRST    FIFO Write reset        INPUT
  * /RRST    FIFO Read reset         INPUT
  */
-OV7670 camera (
+typedef OV7670Pins<p24,p15,p25,p16,p26,p17,p29,p18, p19> CameraPins; // D7-D0, RCLK
+
+#if CAMERA_COUNT > 1
+/**
+ * 複数カメラ構成
+ * SCCB, D7-D0, /RRST, /WRST は共有し、FIFO の出力は /OE で切り替える。
+ * OV7670 の SCCB アドレスは固定なので、各センサの SIOC はバススイッチ (74CBTLV1G125 など) を通し、
+ * そのイネーブルをカメラの /OE につなぐ。レジスタアクセス中はそのカメラの /OE だけが L になる。
+ */
+I2C sccb(p28,p27); // SDA(SIOD),SCL(SIOC)
+
+OV7670Fast<CameraPins> camera (
+        sccb, p30, OV7670_WRITE, // SCCB, SCCB enable (/OE), address
+        p12,p11,p10,   // VSYNC,HREF,WEN(FIFO)
+        p24,p15,p25,p16,p26,p17,p29,p18, // D7-D0
+        p20,p30,p19,p23); // RRST,OE,RCLK,WRST
+
+typedef OV7670Pins<p24,p15,p25,p16,p26,p17,p29,p18, p22> Camera2Pins; // D7-D0, RCLK
+
+OV7670Fast<Camera2Pins> camera2 (
+        sccb, p21, OV7670_WRITE, // SCCB, SCCB enable (/OE), address
+        p13,NC,p14,    // VSYNC,HREF(未接続),WEN(FIFO)
+        p24,p15,p25,p16,p26,p17,p29,p18, // D7-D0 (共有)
+        p20,p21,p22,p23); // RRST(共有),OE,RCLK,WRST(共有)
+
+OV7670Group cameras;
+#else
+OV7670Fast<CameraPins> camera (
         p28,p27,       // SDA(SIOD),SCL(SIOC)
         p12,p11,p10,   // VSYNC,HREF,WEN(FIFO)
         p24,p15,p25,p16,p26,p17,p29,p18, // D7-D0
         p20,p30,p19,p23); // RRST,OE,RCLK,WRST
+#endif
 
 /**
  * SD Card
@@ -79,10 +153,22 @@ Serial serial(USBTX,USBRX) ;
 int sizex = 0;
 int sizey = 0;
 
+/**
+ * 分割キャプチャの分割数 (1: 分割なし)
+ * AL422B FIFO (384KB) に収まらないフレームを複数フレームに分けて取得する
+ */
+int captureStrips = 1;
+
 /**
  * flags
  */
 uint8_t isActive;
+uint8_t isFirstFrame = 1;
+
+/**
+ * 起動からの経過時間
+ */
+Timer bootTimer;
 
 /**
  * LED
@@ -110,8 +196,29 @@ InterruptIn *enableDevice;    // センサ開始トリガ
 #define HEADERSIZE (FILEHEADERSIZE+INFOHEADERSIZE)
 
 int create_header(FILE *fp, int width, int height);
-uint8_t sdCardWriteTest();
+uint8_t sdCardCheck();
+void sdReportStats();
+uint8_t sdWriteBenchmark();
+uint8_t sdEraseBenchmark();
+int sdWriteBenchmarkFile(unsigned char *bmp_line_data, int real_width);
+uint8_t sdSectorBenchmark();
+uint8_t setupCamera(OV7670 &cam);
+uint8_t initCamera(OV7670 &cam);
+uint32_t configKey();
+uint8_t selfTest(OV7670 &cam, int index);
 uint8_t captureImage();
+#if CAMERA_COUNT > 1
+uint8_t captureMultiImage();
+#endif
+uint8_t captureSingleFrame(FILE *fp, unsigned char *bmp_line_data, int real_width);
+void beginFrameRead();
+void endFrameRead();
+void waitRowWritten(int row);
+void readRawRow(unsigned char *raw_line, int length);
+void decodeRow2Bytes(const unsigned char *raw_line, unsigned char *bmp_line_data);
+void decodeBayerRows(const unsigned char *upper, const unsigned char *lower, int y, unsigned char *bmp_line_data);
+uint8_t readRows2Bytes(FILE *fp, unsigned char *bmp_line_data, int real_width, int rows);
+uint8_t captureSplitFrame(FILE *fp, unsigned char *bmp_line_data, int real_width);
 
 static void startCapture();
 static void stopCapture();
@@ -124,6 +231,8 @@ int main()
     // Init
     //-------------------------------------
 
+    bootTimer.start();
+
     //TODO: get actual time from RTC
     set_time(1546268400);  // 2019-01-01 00:00:00
 
@@ -138,76 +247,86 @@ int main()
     /**
      * Init SD Card
      */
-    DEBUG_PRINT("SD Card Write Test\r\n");
-    sdCardWriteTest();
+    sd.set_crc(sdCrc); // 初回アクセス時の初期化で有効になる
+    sdCardCheck();
+
+    DEBUG_PRINTF("SD SPI clock: %d Hz\r\n", sd.transfer_sck());
+
+    // カードの種類と AU (書き込みを揃える単位) を表示する
+    const SDCardInfo &card = sd.card_info();
+    DEBUG_PRINTF("SD card: %s %d MB, class %d, AU %d KB\r\n",
+            card.product, card.sectors / 2048, card.speed_class, card.au_sectors / 2);
+
+    // 連続するセクタの書き込みを1つの CMD25 転送にまとめる (fclose で閉じる)
+    sd.set_streaming(true);
+
+    // FAT の更新を RAM 上にまとめ、fclose でまとめて書き出す
+    if (sd.set_cache(SD_CACHE_SECTORS) != 0) {
+        DEBUG_PRINT("SD cache disabled\r\n");
+    }
 
     /**
      * Init Camera
      */
-    // カメラリセット（ソフトウェアリセット）
-    DEBUG_PRINT("Camera resetting..\r\n");
-    camera.Reset();
+#if CAMERA_COUNT > 1
+    // 共有の SCCB は1台構成のコンストラクタと同じ速度に設定する
+    sccb.stop();
+    sccb.frequency(OV7670_I2CFREQ);
+#endif
+    if (setupCamera(camera) != 0) {
+        currentStatus = ERROR;
+    }
 
-    // 初期化前のレジスタの値を出力する
-    DEBUG_PRINT("Print Register Before Initialization...\r\n");
-    camera.PrintRegister();
+#if CAMERA_COUNT > 1
+    // SCCB は1台ずつ選択されるので、2台目も同じ手順で設定する
+    if (setupCamera(camera2) != 0) {
+        currentStatus = ERROR;
+    }
+    // 2台目の FIFO 書き込みは1台目の VSYNC で切り替わるので、フレーム周期を1台目に揃える
+    // (ウォームリスタートで片方だけ初期化した場合も揃える)
+    camera2.SetClock(camera.ClockPrescaler, camera.ClockPll);
+    cameras.Add(&camera);
+    cameras.Add(&camera2);
+    cameras.margin = EARLY_READ_MARGIN;
+#endif
 
-    // カラーフォーマット選択
-    switch (colorFormat) {
-        case RGB444:
-            camera.InitRGB444();
-            break;
-        case RGB555:
-            camera.InitRGB555();
-            break;
-        case RGB565:
-            camera.InitRGB565();
-            break;
-        case YUV:
-            camera.InitYUV();
-            break;
-        case BAYER:
-        default:
-            camera.InitBayerRGB();
-            break;
+    // 640x480x2 = 600KB -> 240行 (300KB) x 2回
+    if (imageSize == VGA_640x480_SPLIT && colorFormat != BAYER) {
+        captureStrips = 2;
     }
 
-    // 画像サイズ選択
-    switch (imageSize) {
-        case VGA_640x480:
-            sizex = 640;
-            sizey = 480;
-            camera.InitVGA();
-            break;
-        case MAX_544x360:
-            sizex = 544;
-            sizey = 360;
-            camera.InitFIFO_2bytes_color_nealy_limit_size();
-            break;
-        case VGA_480x360:
-            sizex = 480;
-            sizey = 360;
-            camera.InitVGA_3_4();
-            break;
-        case QVGA_320x240:
-            sizex = 320;
-            sizey = 240;
-            camera.InitQVGA();
-            break;
-        case QQVGA_160x120:
-        default:
-            sizex = 160;
-            sizey = 120;
-            camera.InitQQVGA();
-            break;
+    // 実際に出力されるサイズはカメラ側で決まる
+    sizex = camera.WindowWidth;
+    sizey = camera.WindowHeight;
+    DEBUG_PRINTF("Image size: %dx%d\r\n", sizex, sizey);
+    DEBUG_PRINTF("PCLK: %d Hz, %.1f fps\r\n", camera.GetPclk(), camera.GetFrameRate());
+
+    // AEC/AGC/AWB が落ち着くまで撮影しない
+    if (currentStatus != ERROR && !camera.WaitSettled(CAMERA_SETTLE_FRAMES, CAMERA_SETTLE_TIMEOUT)) {
+        DEBUG_PRINT("AEC/AGC/AWB did not settle\r\n");
+    }
+#if CAMERA_COUNT > 1
+    if (currentStatus != ERROR && !camera2.WaitSettled(CAMERA_SETTLE_FRAMES, CAMERA_SETTLE_TIMEOUT)) {
+        DEBUG_PRINT("AEC/AGC/AWB of camera 2 did not settle\r\n");
     }
+#endif
 
-//    camera.InitForFIFOWriteReset();
-    camera.InitDefaultReg();
+    // 配線・タイミングの自己診断
+    if (currentStatus != ERROR && runSelfTest && selfTest(camera, 1) != 0) {
+        currentStatus = ERROR;
+    }
+#if CAMERA_COUNT > 1
+    if (currentStatus != ERROR && runSelfTest && selfTest(camera2, 2) != 0) {
+        currentStatus = ERROR;
+    }
+#endif
+    DEBUG_PRINTF("Camera ready: %d ms after boot\r\n", bootTimer.read_ms());
 
-    // 初期化後のレジスタの値を出力する
-    DEBUG_PRINT("Print Register After Initialization...\r\n");
-    camera.PrintRegister();
+    if (runSdBenchmark) {
+        sdSectorBenchmark();
+        sdWriteBenchmark();
+        sdEraseBenchmark();
+    }
 
     /**
      * Init Buttons
@@ -224,11 +343,17 @@ int main()
     led1->write(0); // set led off
 
     // CAPTURE and SEND LOOP
-    currentStatus = IDLE;
+    if (currentStatus != ERROR) {
+        currentStatus = IDLE;
+    }
     while(isActive)
     {
         if(currentStatus == ACTIVE && !isCameraBusy) {
+#if CAMERA_COUNT > 1
+            captureMultiImage();
+#else
             captureImage();
+#endif
         }
 
         // blink led
@@ -292,25 +417,334 @@ int create_header(FILE *fp, int width, int height) {
     header_buf[53] = 0;
 
     //ヘッダの書き込み
-    fwrite(header_buf, sizeof(unsigned char), HEADERSIZE, fp);
+    if (fwrite(header_buf, sizeof(unsigned char), HEADERSIZE, fp) != HEADERSIZE) {
+        return 1;
+    }
 
     return 0;
 }
 
-uint8_t sdCardWriteTest() {
+/**
+ * 前回と同じ設定で動作中のセンサならば初期化を省略する (ウォームリスタート)
+ * 複数カメラは同じ設定になるので、シグネチャは1つを共有する
+ */
+uint8_t setupCamera(OV7670 &cam) {
+    if (cam.CheckProductId()
+            && LPC_RTC->GPREG1 == configKey()
+            && LPC_RTC->GPREG0 == cam.ConfigSignature()) {
+        DEBUG_PRINT("Camera already configured, skip initialization\r\n");
+        cam.LoadState();
+        return 0;
+    }
+    if (initCamera(cam) != 0) {
+        return 1;
+    }
+    LPC_RTC->GPREG0 = cam.ConfigSignature();
+    LPC_RTC->GPREG1 = configKey();
+    return 0;
+}
 
-    FILE *fp = fopen("/sd/ov7670_sd_write_test.txt", "w");
+/**
+ * カメラの初期化 (リセット、フォーマット・サイズ・クロック設定)
+ */
+uint8_t initCamera(OV7670 &cam) {
 
-    if (NULL != fp) {
-        DEBUG_PRINT("File opened. Start writing...\r\n");
-        fprintf(fp, "SD card file write test done by OV7670");
+    // カメラリセット（ソフトウェアリセット）
+    DEBUG_PRINT("Camera resetting..\r\n");
+    if (!cam.ResetWait(CAMERA_RESET_TIMEOUT)) {
+        DEBUG_PRINT("Camera not responding\r\n");
+        return 1;
+    }
+
+#ifdef DEBUG_REGISTER
+    // 初期化前のレジスタの値を出力する
+    DEBUG_PRINT("Print Register Before Initialization...\r\n");
+    cam.PrintRegister();
+#endif
+
+    // カラーフォーマット選択
+    switch (colorFormat) {
+        case RGB444:
+            cam.InitRGB444();
+            break;
+        case RGB555:
+            cam.InitRGB555();
+            break;
+        case RGB565:
+            cam.InitRGB565();
+            break;
+        case YUV:
+            cam.InitYUV();
+            break;
+        case BAYER:
+        default:
+            cam.InitBayerRGB();
+            break;
+    }
+
+    // 画像サイズ選択
+    switch (imageSize) {
+        case VGA_640x480:
+            cam.InitVGA();
+            break;
+        case MAX_544x360:
+            cam.InitFIFO_2bytes_color_nealy_limit_size();
+            break;
+        case VGA_480x360:
+            cam.InitVGA_3_4();
+            break;
+        case QVGA_320x240:
+            cam.InitQVGA();
+            break;
+        case VGA_640x480_SPLIT:
+            cam.InitVGA();
+            break;
+        case WINDOW_CUSTOM:
+            cam.InitVGA();
+            cam.SetWindow(windowX, windowY, windowW, windowH);
+            cam.SetScaling(windowScale, windowScale);
+            break;
+        case QQVGA_160x120:
+        default:
+            cam.InitQQVGA();
+            break;
+    }
+
+//    cam.InitForFIFOWriteReset();
+    cam.InitDefaultReg();
+
+    // FIFO から1フレーム読み出す時間を測り、書き込みと読み出しが maxFrameMs 以内に終わるクロックを選ぶ
+    // (earlyReadout では読み出しに追いつく最も遅いクロック)
+    // 2台目以降は1台目の VSYNC で書き込むので、main で1台目と同じクロックにする
+    if (&cam == &camera) {
+        int drainUs = cam.MeasureDrainUs();
+        float fps = cam.AutoClock(OV7670_PCLK_MAX, maxFrameMs, drainUs, earlyReadout);
+        DEBUG_PRINTF("FIFO drain: %d us per frame\r\n", drainUs);
+        if (fps == 0) {
+            DEBUG_PRINTF("No clock setting captures a frame within %d ms\r\n", maxFrameMs);
+        }
+    }
+
+#ifdef DEBUG_REGISTER
+    // 初期化後のレジスタの値を出力する
+    DEBUG_PRINT("Print Register After Initialization...\r\n");
+    cam.PrintRegister();
+#endif
+
+    return 0;
+}
+
+/**
+ * SD ドライバの統計 (コマンド数、エラー、種類ごとの遅延ヒストグラム) を表示し、リセットする
+ */
+void sdReportStats() {
+
+    const SDStats &stats = sd.stats();
+    const SDLatency *latency[] = { &stats.read, &stats.write, &stats.sync, &stats.erase, &stats.busy };
+    const char *names[] = { "read", "write", "sync", "erase", "busy" };
+
+    FILE *fp = sdStatsFile ? fopen("/sd/sd_stats.txt", "a") : NULL;
+
+    char line[160];
+    snprintf(line, sizeof(line), "SD stats: %d cmds, %d read, %d written, %d retries, %d failures, %d reinits, %d timeouts, %d crc errors\r\n",
+            stats.commands, stats.read_sectors, stats.written_sectors,
+            stats.retries, stats.failures, stats.reinits, stats.timeouts, stats.crc_errors);
+    DEBUG_PRINT(line);
+    if (fp) {
+        fputs(line, fp);
+    }
+
+    // 件数, 平均, 最大 (us) と 128us, 256us, ... 131ms 以上のヒストグラム
+    for (int i = 0; i < 5; i++) {
+        const SDLatency *l = latency[i];
+        if (l->count == 0) {
+            continue;
+        }
+        int n = snprintf(line, sizeof(line), "SD %-5s %d, avg %d us, max %d us:",
+                names[i], l->count, l->total_us / l->count, l->max_us);
+        for (int b = 0; b < SD_LATENCY_BUCKETS && n < (int)sizeof(line); b++) {
+            n += snprintf(line + n, sizeof(line) - n, " %d", l->histogram[b]);
+        }
+        DEBUG_PRINTF("%s\r\n", line);
+        if (fp) {
+            fprintf(fp, "%s\r\n", line);
+        }
+    }
+
+    if (fp) {
         fclose(fp);
-    } else {
-        DEBUG_PRINT("Failed to file open. Exiting...\r\n");
-        error("File Open failed.\r\n" );
     }
+    sd.reset_stats();
+}
+
+uint8_t sdCardCheck() {
+
+    Timer timer;
+    timer.start();
 
-    DEBUG_PRINT("SD card file write test completed.\r\n");
+    // マウントでカードを1回だけ初期化し、FAT を読み込んでおく (最初の撮影で待たないように)
+    if (sd.mount() != 0) {
+        DEBUG_PRINT("SD mount failed. Exiting...\r\n");
+        error("SD mount failed.\r\n");
+    }
+
+    // 初期化で読んだカード情報と、セクタ 0 (MBR/ブートセクタ) の署名を確認する (書き込みはしない)
+    uint32_t sector[512 / sizeof(uint32_t)];
+    uint8_t *data = (uint8_t *)sector;
+    if (sd.card_info().sectors == 0 || sd.disk_read(data, 0, 1) != 0
+            || data[510] != 0x55 || data[511] != 0xAA) {
+        DEBUG_PRINT("SD card check failed. Exiting...\r\n");
+        error("SD card check failed.\r\n");
+    }
+
+    DEBUG_PRINTF("SD card ready in %d ms (init %d ms, %d ACMD41 polls)\r\n",
+            timer.read_ms(), sd.init_us() / 1000, sd.init_polls());
+
+    return 0;
+}
+
+/**
+ * 撮影と同じ行単位の書き込みで BMP 1枚分のダミーデータを書き込み、SD の書き込み速度を表示する
+ */
+uint8_t sdWriteBenchmark() {
+
+    int real_width = sizex*3 + sizey%4;
+
+    unsigned char *bmp_line_data;
+    if((bmp_line_data = (unsigned char *)malloc(sizeof(unsigned char)*real_width)) == NULL){
+        return 1;
+    }
+    memset(bmp_line_data, 0x55, real_width);
+
+    int us = sdWriteBenchmarkFile(bmp_line_data, real_width);
+    if (us < 0) {
+        free(bmp_line_data);
+        return 1;
+    }
+    int bytes = HEADERSIZE + real_width * sizey;
+    DEBUG_PRINTF("SD write: %d bytes in %d ms (%d KB/s)\r\n", bytes, us / 1000, us > 0 ? (int)((long long)bytes * 1000 / us) : 0);
+
+    // 書き出し (シリアル転送など) と同じ行単位の読み出し速度を先読みありで計測する
+    FILE *fp;
+    if (sd.set_readahead(SD_READAHEAD_SECTORS) == 0 && (fp = fopen("/sd/sd_benchmark.bmp", "rb")) != NULL) {
+        sd.reset_readahead_stats();
+        Timer timer;
+        timer.start();
+        int read = fread(bmp_line_data, sizeof(unsigned char), HEADERSIZE, fp);
+        for (int y = 0; y < sizey; y++) {
+            read += fread(bmp_line_data, sizeof(unsigned char), real_width, fp);
+        }
+        fclose(fp);
+
+        us = timer.read_us();
+        DEBUG_PRINTF("SD read: %d bytes in %d ms (%d KB/s), read-ahead %d hits %d wasted, window %d\r\n",
+                read, us / 1000, us > 0 ? (int)((long long)read * 1000 / us) : 0,
+                sd.readahead_hits(), sd.readahead_waste(), sd.readahead_window());
+    }
+    sd.set_readahead(0);
+
+    free(bmp_line_data);
+    remove("/sd/sd_benchmark.bmp");
+
+    return 0;
+}
+
+/**
+ * 撮影と同じ行単位で BMP 1枚分を sd_benchmark.bmp に書き込み、かかった時間 (us) を返す
+ */
+int sdWriteBenchmarkFile(unsigned char *bmp_line_data, int real_width) {
+
+    FILE *fp = fopen("/sd/sd_benchmark.bmp", "wb");
+    if (fp == NULL) {
+        DEBUG_PRINT("Failed to open benchmark file\r\n");
+        return -1;
+    }
+
+    Timer timer;
+    timer.start();
+
+    create_header(fp, sizex, sizey);
+    for (int y = 0; y < sizey; y++) {
+        fwrite(bmp_line_data, sizeof(unsigned char), real_width, fp);
+    }
+    fclose(fp);
+
+    return timer.read_us();
+}
+
+/**
+ * 削除したファイルの領域を消去 (TRIM) しない場合とした場合で、上書きの書き込み待ちを比較する
+ */
+uint8_t sdEraseBenchmark() {
+
+    int real_width = sizex*3 + sizey%4;
+
+    unsigned char *bmp_line_data;
+    if((bmp_line_data = (unsigned char *)malloc(sizeof(unsigned char)*real_width)) == NULL){
+        return 1;
+    }
+    memset(bmp_line_data, 0xAA, real_width);
+
+    // 1回目で書き込んだ領域を、消去あり／なしで削除してから書き直す
+    static const bool erase[2] = { false, true };
+    sdWriteBenchmarkFile(bmp_line_data, real_width);
+    for (int i = 0; i < 2; i++) {
+        sd.set_erase(erase[i]);
+        remove("/sd/sd_benchmark.bmp");
+        sd.disk_sync(); // 消去の完了待ちを計測に含めない
+        sd.reset_busy_stats();
+
+        int us = sdWriteBenchmarkFile(bmp_line_data, real_width);
+        DEBUG_PRINTF("SD write %s erase: %d ms, busy %d waits %d ms total, %d us max\r\n",
+                erase[i] ? "after" : "without", us / 1000,
+                sd.busy_waits(), sd.busy_total_us() / 1000, sd.busy_max_us());
+    }
+    sd.set_erase(true);
+    remove("/sd/sd_benchmark.bmp");
+    sd.reset_busy_stats();
+
+    free(bmp_line_data);
+
+    return 0;
+}
+
+/**
+ * SPI クロックごとに 1セクタの読み出しにかかる CPU サイクル数を表示する (SD の内容は変更しない)
+ */
+uint8_t sdSectorBenchmark() {
+
+    static const uint32_t clocks[] = { 1000000, 12000000, 24000000 };
+    const int sectors = 64;
+    uint32_t buffer[512 / 4]; // ワード境界に揃えたセクタバッファ
+
+    uint32_t negotiated = sd.transfer_sck();
+    for (unsigned int i = 0; i < sizeof(clocks) / sizeof(clocks[0]); i++) {
+        sd.force_transfer_sck(clocks[i]);
+
+        Timer timer;
+        timer.start();
+        for (int n = 0; n < sectors; n++) {
+            if (sd.disk_read((uint8_t *)buffer, n, 1) != 0) {
+                DEBUG_PRINTF("SD read failed at %d Hz\r\n", clocks[i]);
+                break;
+            }
+        }
+        int us = timer.read_us();
+        DEBUG_PRINTF("SD %d Hz: %d cycles/sector\r\n", sd.transfer_sck(),
+                (int)((long long)us * (SystemCoreClock / 1000000) / sectors));
+    }
+    sd.force_transfer_sck(negotiated);
+
+    // CRC16 の計算コスト
+    Timer timer;
+    timer.start();
+    volatile uint16_t crc = 0;
+    for (int n = 0; n < sectors; n++) {
+        crc = crc + sd_crc16((uint8_t *)buffer, sizeof(buffer));
+    }
+    int us = timer.read_us();
+    DEBUG_PRINTF("CRC16: %d cycles/sector, %d CRC errors\r\n",
+            (int)((long long)us * (SystemCoreClock / 1000000) / sectors), sd.crc_errors());
 
     return 0;
 }
@@ -343,18 +777,166 @@ uint8_t captureImage () {
     sprintf(filename, "/sd/image_%d%d%d%d%d%d.bmp", tm.tm_year+1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
     DEBUG_PRINTF("Filename:%s\r\n", filename);
 
-    if((fp = fopen(filename, "wb")) == NULL){
+    // ファイルサイズは書き込み前に分かるので、クラスタを連続した領域にまとめて確保する
+    // (書き込み中は FAT を更新せず、データのセクタだけを順に書く)
+    sd.set_preallocate(HEADERSIZE + real_width * sizey);
+    fp = fopen(filename, "wb");
+    sd.set_preallocate(0);
+    if(fp == NULL){
         serial.printf("Error: %s could not open.", filename);
         return 1;
     }
 
     create_header(fp, sizex, sizey);
-    camera.InitForFIFOWriteReset();
-    camera.CaptureNext();
-    while(camera.CaptureDone() == false);
-    camera.ReadStart();
 
-    int r=0, g=0, b=0, d1, d2;
+    uint8_t result;
+    if (captureStrips > 1 && colorFormat != BAYER) {
+        result = captureSplitFrame(fp, bmp_line_data, real_width);
+    } else {
+        result = captureSingleFrame(fp, bmp_line_data, real_width);
+    }
+
+    free(bmp_line_data);
+    fclose(fp);
+
+    // ヘッダは全体のサイズで書いてあるので、途中で終わったファイルは残さない
+    if (result != 0) {
+        remove(filename);
+        isCameraBusy = 0;
+        return result;
+    }
+
+    // カード内部の書き込み待ち (GC などによる遅延の把握用) を含む SD の統計
+    sdReportStats();
+
+    SectorCache *cache = sd.cache();
+    if (cache) {
+        DEBUG_PRINTF("SD cache: %d hits, %d misses, %d writes -> %d flushes\r\n",
+                cache->hits, cache->misses, cache->writes, cache->flushes);
+        cache->reset_stats();
+    }
+
+    if (isFirstFrame) {
+        DEBUG_PRINTF("First frame: %d ms after boot\r\n", bootTimer.read_ms());
+        isFirstFrame = 0;
+    }
+
+    // clear
+    isCameraBusy = 0;
+
+    return 0;
+}
+
+#if CAMERA_COUNT > 1
+/**
+ * 全カメラを同じ VSYNC から撮影し、行単位で交互に読み出して各カメラのファイルへ書き込む
+ * (分割キャプチャには対応しない)
+ */
+uint8_t captureMultiImage() {
+
+    // set flag as busy
+    isCameraBusy = 1;
+
+    int real_width = sizex*3 + sizey%4;
+    int bytesPerLine = sizex * camera.BytesPerPixel;
+    FILE *fp[CAMERA_COUNT];
+    char filename[CAMERA_COUNT][128];
+    unsigned char *raw_line[CAMERA_COUNT][2];
+    unsigned char *bmp_line_data[CAMERA_COUNT];
+    uint8_t result = 0;
+
+    time_t t = time(NULL);
+    struct tm tm = *localtime(&t);
+
+    for (int c = 0; c < CAMERA_COUNT; c++) {
+        sprintf(filename[c], "/sd/image_%d%d%d%d%d%d_%d.bmp", tm.tm_year+1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, c);
+        DEBUG_PRINTF("Filename:%s\r\n", filename[c]);
+
+        raw_line[c][0] = (unsigned char *) malloc(sizeof(unsigned char) * bytesPerLine);
+        raw_line[c][1] = (unsigned char *) malloc(sizeof(unsigned char) * bytesPerLine);
+        bmp_line_data[c] = (unsigned char *) calloc(real_width, sizeof(unsigned char)); // 4バイト境界のパディングは 0
+        if (raw_line[c][0] == NULL || raw_line[c][1] == NULL || bmp_line_data[c] == NULL) {
+            fprintf(stderr, "Error: Allocation error.\n");
+            result = 1;
+        }
+
+        sd.set_preallocate(HEADERSIZE + real_width * sizey); // 連続したクラスタを確保
+        fp[c] = fopen(filename[c], "wb");
+        sd.set_preallocate(0);
+        if (fp[c] == NULL) {
+            serial.printf("Error: %s could not open.", filename[c]);
+            result = 1;
+        } else if (create_header(fp[c], sizex, sizey) != 0) {
+            result = 1;
+        }
+    }
+
+    if (result == 0) {
+        cameras.CaptureStart(earlyReadout);
+
+        for (int y = 0; y < sizey && result == 0; y++) {
+            for (int c = 0; c < CAMERA_COUNT; c++) {
+                unsigned char *raw = raw_line[c][y % 2];
+                cameras.ReadRow(c, raw, bytesPerLine, y);
+
+                if (colorFormat == BAYER) {
+                    if (y == 0) {
+                        continue;
+                    }
+                    decodeBayerRows(raw_line[c][(y - 1) % 2], raw, y, bmp_line_data[c]);
+                } else {
+                    decodeRow2Bytes(raw, bmp_line_data[c]);
+                }
+                if (fwrite(bmp_line_data[c], sizeof(unsigned char), real_width, fp[c]) != (size_t) real_width) {
+                    result = 1;
+                }
+            }
+        }
+
+        // Bayer は最終行を複製して行数を合わせる
+        if (colorFormat == BAYER && result == 0) {
+            for (int c = 0; c < CAMERA_COUNT; c++) {
+                if (fwrite(bmp_line_data[c], sizeof(unsigned char), real_width, fp[c]) != (size_t) real_width) {
+                    result = 1;
+                }
+            }
+        }
+
+        cameras.CaptureStop();
+    }
+
+    for (int c = 0; c < CAMERA_COUNT; c++) {
+        free(raw_line[c][0]);
+        free(raw_line[c][1]);
+        free(bmp_line_data[c]);
+        if (fp[c] != NULL && fclose(fp[c]) != 0) {
+            result = 1;
+        }
+    }
+
+    // ヘッダは全体のサイズで書いてあるので、1枚でも失敗したら途中のファイルは残さない
+    if (result != 0) {
+        for (int c = 0; c < CAMERA_COUNT; c++) {
+            if (fp[c] != NULL) {
+                remove(filename[c]);
+            }
+        }
+    }
+
+    // clear
+    isCameraBusy = 0;
+
+    return result;
+}
+#endif
+
+/**
+ * 1フレームをキャプチャして BMP へ書き込む
+ */
+uint8_t captureSingleFrame(FILE *fp, unsigned char *bmp_line_data, int real_width) {
+
+    uint8_t result = 0;
+    beginFrameRead();
 
     /**
      * - Color Formats -
@@ -365,140 +947,40 @@ uint8_t captureImage () {
         BAYER  = 5,
      */
     switch (colorFormat) {
-        case RGB444: //FIXME: ise emi,
+        case RGB444:
         case RGB555:
         case RGB565:
-            for (int y=0; y<sizey; y++) {
-                for (int x=0; x<sizex; x++) {
-                    d1 = camera.ReadOneByte();
-                    d2 = camera.ReadOneByte();
-
-                    switch (colorFormat) {
-                        case RGB444:
-                            // RGB444 to RGB888
-                            b = (d1 & 0x0F) << 4;
-                            g = (d2 & 0xF0);
-                            r = (d2 & 0x0F) << 4;
-                            break;
-                        case RGB555:
-                            // RGB555 to RGB888
-                            b = (d1 & 0x1F) << 3;
-                            g = (((d1 & 0xE0) >> 2) | ((d2 & 0x03) << 6));
-                            r = (d2 & 0x7c) << 1;
-                            break;
-                        case RGB565:
-                            // RGB565 to RGB888
-                            b = (d1 & 0x1F) << 3;
-                            g = (((d1 & 0xE0) >> 3) | ((d2 & 0x07) << 5));
-                            r = (d2 & 0xF8);
-                            break;
-                        default:
-                            break;
-                    }
-                    bmp_line_data[x*3]     = (unsigned char)b;
-                    bmp_line_data[x*3 + 1] = (unsigned char)g;
-                    bmp_line_data[x*3 + 2] = (unsigned char)r;
-                }
-                fwrite(bmp_line_data, sizeof(unsigned char), real_width, fp);
-            }
-            break;
-
-        case YUV: {
-            int index = 0;
-            for (int y = 0; y < sizey; y++) {
-                int U0 = 0, Y0 = 0, V0 = 0, Y1 = 0;
-                for (int x = 0; x < sizex; x++) {
-                    if (index % 2 == 0) {
-                        U0 = camera.ReadOneByte();
-                        Y0 = camera.ReadOneByte();
-                        V0 = camera.ReadOneByte();
-                        Y1 = camera.ReadOneByte();
-
-                        b = Y0 + 1.77200 * (U0 - 128);
-                        g = Y0 - 0.34414 * (U0 - 128) - 0.71414 * (V0 - 128);
-                        r = Y0 + 1.40200 * (V0 - 128);
-                    } else {
-                        b = Y1 + 1.77200 * (U0 - 128);
-                        g = Y1 - 0.34414 * (U0 - 128) - 0.71414 * (V0 - 128);
-                        r = Y1 + 1.40200 * (V0 - 128);
-                    }
-
-                    b = min(max(b, 0), 255);
-                    g = min(max(g, 0), 255);
-                    r = min(max(r, 0), 255);
-
-                    bmp_line_data[x * 3] = (unsigned char) b;
-                    bmp_line_data[x * 3 + 1] = (unsigned char) g;
-                    bmp_line_data[x * 3 + 2] = (unsigned char) r;
-                    index++;
-                }
-                fwrite(bmp_line_data, sizeof(unsigned char), (size_t) real_width, fp);
-            }
-        }
+        case YUV:
+            result = readRows2Bytes(fp, bmp_line_data, real_width, sizey);
             break;
 
         case BAYER: {
             unsigned char *bayer_line[2];
             unsigned char *bayer_line_data[2]; //画像1行分のRGB情報を格納する2行分
 
-            for (int i = 0; i < 2; i++) {
-                if ((bayer_line_data[i] = (unsigned char *) malloc(sizeof(unsigned char) * sizex)) == NULL) {
-                    fprintf(stderr, "Error: Allocation error.\n");
-                    return 1;
-                }
+            bayer_line_data[0] = (unsigned char *) malloc(sizeof(unsigned char) * sizex);
+            bayer_line_data[1] = (unsigned char *) malloc(sizeof(unsigned char) * sizex);
+            if (bayer_line_data[0] == NULL || bayer_line_data[1] == NULL) {
+                fprintf(stderr, "Error: Allocation error.\n");
+                free(bayer_line_data[0]);
+                free(bayer_line_data[1]);
+                result = 1;
+                break;
             }
 
-            for (int x = 0; x < sizex; x++) {
-                // odd line BGBG... even line GRGR...
-                bayer_line_data[0][x] = (unsigned char) camera.ReadOneByte();
-            }
+            waitRowWritten(0);
+            readRawRow(bayer_line_data[0], sizex);
             bayer_line[1] = bayer_line_data[0];
 
             for (int y = 1; y < sizey; y++) {
                 int line = y % 2;
 
-                for (int x = 0; x < sizex; x++) {
-                    // odd line BGBG... even line GRGR...
-                    bayer_line_data[line][x] = (unsigned char) camera.ReadOneByte();
-                }
+                waitRowWritten(y);
+                readRawRow(bayer_line_data[line], sizex);
                 bayer_line[0] = bayer_line[1];
                 bayer_line[1] = bayer_line_data[line];
 
-                for (int x = 0; x < sizex - 1; x++) {
-                    if (y % 2 == 1) {
-                        if (x % 2 == 0) {
-                            // BG
-                            // GR
-                            b = bayer_line[0][x];
-                            g = ((int) bayer_line[0][x + 1] + bayer_line[1][x]) >> 1;
-                            r = bayer_line[1][x + 1];
-                        } else {
-                            // GB
-                            // RG
-                            b = bayer_line[0][x + 1];
-                            g = ((int) bayer_line[0][x] + bayer_line[1][x + 1]) >> 1;
-                            r = bayer_line[1][x];
-                        }
-                    } else {
-                        if (x % 2 == 0) {
-                            // GR
-                            // BG
-                            b = bayer_line[1][x];
-                            g = ((int) bayer_line[0][x] + bayer_line[1][x + 1]) >> 1;
-                            r = bayer_line[0][x + 1];
-                        } else {
-                            // RG
-                            // GB
-                            b = bayer_line[1][x + 1];
-                            g = ((int) bayer_line[0][x + 1] + bayer_line[1][x]) >> 1;
-                            r = bayer_line[0][x];
-                        }
-                    }
-                    bmp_line_data[x * 3] = (unsigned char) b;
-                    bmp_line_data[x * 3 + 1] = (unsigned char) g;
-                    bmp_line_data[x * 3 + 2] = (unsigned char) r;
-                }
-
+                decodeBayerRows(bayer_line[0], bayer_line[1], y, bmp_line_data);
                 fwrite(bmp_line_data, sizeof(unsigned char), real_width, fp);
             }
 
@@ -513,19 +995,367 @@ uint8_t captureImage () {
             break;
     }
 
+    endFrameRead();
+
+    return result;
+}
+
+/**
+ * キャプチャを要求し、FIFO の読み出しを開始する
+ * earlyReadout の場合はフレーム書き込み開始時点で戻り、各行は waitRowWritten() で書き込みを待つ
+ */
+void beginFrameRead() {
+    camera.InitForFIFOWriteReset();
+    camera.CaptureNext();
+    if (earlyReadout) {
+        camera.WaitCaptureStart();
+    } else {
+        while(camera.CaptureDone() == false);
+    }
+    camera.ReadStart();
+}
+
+/**
+ * FIFO の読み出しを終了する (earlyReadout の場合はフレーム書き込み完了も待つ)
+ */
+void endFrameRead() {
     camera.ReadStop();
+    if (earlyReadout) {
+        while(camera.CaptureDone() == false);
+    }
+}
 
-    free(bmp_line_data);
-    fclose(fp);
+/**
+ * row 行目がセンサから FIFO に書き込まれるまで待つ (読み出しポインタが書き込みを追い越さないように)
+ */
+void waitRowWritten(int row) {
+    if (earlyReadout) {
+        camera.WaitLinesWritten(row + 1 + EARLY_READ_MARGIN);
+    }
+}
 
-    // clear
-    isCameraBusy = 0;
+/**
+ * FIFO から length バイト読み出す
+ */
+void readRawRow(unsigned char *raw_line, int length) {
+    camera.ReadBytes(raw_line, length);
+}
+
+/**
+ * Bayer の2行 (upper: y-1 行目, lower: y 行目) から1行分の RGB888 (BGR順) を作る
+ */
+void decodeBayerRows(const unsigned char *upper, const unsigned char *lower, int y, unsigned char *bmp_line_data) {
+
+    int r, g, b;
+    const unsigned char *bayer_line[2] = {upper, lower};
+
+    for (int x = 0; x < sizex - 1; x++) {
+        if (y % 2 == 1) {
+            if (x % 2 == 0) {
+                // BG
+                // GR
+                b = bayer_line[0][x];
+                g = ((int) bayer_line[0][x + 1] + bayer_line[1][x]) >> 1;
+                r = bayer_line[1][x + 1];
+            } else {
+                // GB
+                // RG
+                b = bayer_line[0][x + 1];
+                g = ((int) bayer_line[0][x] + bayer_line[1][x + 1]) >> 1;
+                r = bayer_line[1][x];
+            }
+        } else {
+            if (x % 2 == 0) {
+                // GR
+                // BG
+                b = bayer_line[1][x];
+                g = ((int) bayer_line[0][x] + bayer_line[1][x + 1]) >> 1;
+                r = bayer_line[0][x + 1];
+            } else {
+                // RG
+                // GB
+                b = bayer_line[1][x + 1];
+                g = ((int) bayer_line[0][x + 1] + bayer_line[1][x]) >> 1;
+                r = bayer_line[0][x];
+            }
+        }
+        bmp_line_data[x * 3] = (unsigned char) b;
+        bmp_line_data[x * 3 + 1] = (unsigned char) g;
+        bmp_line_data[x * 3 + 2] = (unsigned char) r;
+    }
+}
 
+/**
+ * 2バイト/画素フォーマット (RGB444/RGB555/RGB565/YUV) の1行を RGB888 (BGR順) に変換する
+ */
+void decodeRow2Bytes(const unsigned char *raw_line, unsigned char *bmp_line_data) {
+
+    int r=0, g=0, b=0, d1, d2;
+
+    switch (colorFormat) {
+        case RGB444: //FIXME: ise emi,
+        case RGB555:
+        case RGB565:
+            for (int x=0; x<sizex; x++) {
+                d1 = raw_line[x*2];
+                d2 = raw_line[x*2 + 1];
+
+                switch (colorFormat) {
+                    case RGB444:
+                        // RGB444 to RGB888
+                        b = (d1 & 0x0F) << 4;
+                        g = (d2 & 0xF0);
+                        r = (d2 & 0x0F) << 4;
+                        break;
+                    case RGB555:
+                        // RGB555 to RGB888
+                        b = (d1 & 0x1F) << 3;
+                        g = (((d1 & 0xE0) >> 2) | ((d2 & 0x03) << 6));
+                        r = (d2 & 0x7c) << 1;
+                        break;
+                    case RGB565:
+                        // RGB565 to RGB888
+                        b = (d1 & 0x1F) << 3;
+                        g = (((d1 & 0xE0) >> 3) | ((d2 & 0x07) << 5));
+                        r = (d2 & 0xF8);
+                        break;
+                    default:
+                        break;
+                }
+                bmp_line_data[x*3]     = (unsigned char)b;
+                bmp_line_data[x*3 + 1] = (unsigned char)g;
+                bmp_line_data[x*3 + 2] = (unsigned char)r;
+            }
+            break;
+
+        case YUV: {
+            int U0 = 0, Y0 = 0, V0 = 0, Y1 = 0;
+            for (int x = 0; x < sizex; x++) {
+                if (x % 2 == 0) {
+                    U0 = raw_line[x*2];
+                    Y0 = raw_line[x*2 + 1];
+                    V0 = raw_line[x*2 + 2];
+                    Y1 = raw_line[x*2 + 3];
+
+                    b = Y0 + 1.77200 * (U0 - 128);
+                    g = Y0 - 0.34414 * (U0 - 128) - 0.71414 * (V0 - 128);
+                    r = Y0 + 1.40200 * (V0 - 128);
+                } else {
+                    b = Y1 + 1.77200 * (U0 - 128);
+                    g = Y1 - 0.34414 * (U0 - 128) - 0.71414 * (V0 - 128);
+                    r = Y1 + 1.40200 * (V0 - 128);
+                }
+
+                b = min(max(b, 0), 255);
+                g = min(max(g, 0), 255);
+                r = min(max(r, 0), 255);
+
+                bmp_line_data[x * 3] = (unsigned char) b;
+                bmp_line_data[x * 3 + 1] = (unsigned char) g;
+                bmp_line_data[x * 3 + 2] = (unsigned char) r;
+            }
+        }
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * 2バイト/画素フォーマットを rows 行分 FIFO から読み出し、RGB888 に変換して BMP へ書き込む
+ * 行バッファを確保できない場合は何も書かずに 1 を返す
+ */
+uint8_t readRows2Bytes(FILE *fp, unsigned char *bmp_line_data, int real_width, int rows) {
+
+    unsigned char *raw_line;
+    if ((raw_line = (unsigned char *) malloc(sizeof(unsigned char) * sizex * 2)) == NULL) {
+        fprintf(stderr, "Error: Allocation error.\n");
+        return 1;
+    }
+
+    for (int y = 0; y < rows; y++) {
+        waitRowWritten(y);
+        readRawRow(raw_line, sizex * 2);
+        decodeRow2Bytes(raw_line, bmp_line_data);
+        fwrite(bmp_line_data, sizeof(unsigned char), (size_t) real_width, fp);
+    }
+
+    free(raw_line);
     return 0;
 }
 
+/**
+ * カラーバー自己診断
+ * センサのカラーバーを1フレーム撮影し、バーの並びと D7-D0 の各ビットの変化を確認する。
+ * Bayer は2行ずつデモザイクしてから、2バイト/画素フォーマットと同じ閾値でバーの色を判定する。
+ * VSYNC からキャプチャ完了までの時間と FIFO 読み出し速度も出力する。
+ */
+uint8_t selfTest(OV7670 &cam, int index) {
+
+    // 白, 黄, シアン, 緑, マゼンタ, 赤, 青, 黒 (bit2:R bit1:G bit0:B)
+    static const uint8_t barColors[8] = {7, 6, 3, 2, 5, 4, 1, 0};
+
+    bool bayer = cam.BytesPerPixel != 2;
+    int bytesPerLine = sizex * cam.BytesPerPixel;
+    unsigned char *raw_line[2];
+    raw_line[0] = (unsigned char *) malloc(sizeof(unsigned char) * bytesPerLine);
+    raw_line[1] = (unsigned char *) malloc(sizeof(unsigned char) * bytesPerLine);
+    unsigned char *bmp_line_data = (unsigned char *) malloc(sizeof(unsigned char) * sizex * 3);
+    if (raw_line[0] == NULL || raw_line[1] == NULL || bmp_line_data == NULL) {
+        fprintf(stderr, "Error: Allocation error.\n");
+        free(raw_line[0]);
+        free(raw_line[1]);
+        free(bmp_line_data);
+        return 1;
+    }
+
+    long sum[8][3] = {{0}};
+    long count[8] = {0};
+    int bitsOr = 0x00, bitsAnd = 0xff;
+    uint8_t result = 0;
+    Timer timer;
+
+    cam.InitSetColorbar();
+    cam.WaitNextFrame();
+
+    // 書き込み開始 (VSYNC、2台目は1台目の VSYNC) からキャプチャ完了まで
+    cam.InitForFIFOWriteReset();
+    cam.CaptureNext();
+    cam.WaitCaptureStart();
+    timer.start();
+    while (cam.CaptureDone() == false);
+    int captureUs = timer.read_us();
+
+    timer.stop();
+    timer.reset();
+    cam.ReadStart();
+    for (int y = 0; y < sizey; y++) {
+        unsigned char *raw = raw_line[y % 2];
+        timer.start();
+        cam.ReadBytes(raw, bytesPerLine);
+        timer.stop();
+
+        for (int i = 0; i < bytesPerLine; i++) {
+            bitsOr |= raw[i];
+            bitsAnd &= raw[i];
+        }
+
+        if (bayer) {
+            if (y == 0) {
+                continue;
+            }
+            decodeBayerRows(raw_line[(y - 1) % 2], raw, y, bmp_line_data);
+        } else {
+            decodeRow2Bytes(raw, bmp_line_data);
+        }
+        // 各バーの中央付近を集計する
+        for (int bar = 0; bar < 8; bar++) {
+            int center = (2 * bar + 1) * sizex / 16;
+            for (int x = center - sizex / 64; x <= center + sizex / 64; x++) {
+                sum[bar][0] += bmp_line_data[x * 3 + 2];
+                sum[bar][1] += bmp_line_data[x * 3 + 1];
+                sum[bar][2] += bmp_line_data[x * 3];
+                count[bar]++;
+            }
+        }
+    }
+    int readUs = timer.read_us();
+    cam.ReadStop();
+    cam.ClearColorbar();
+
+    // 常に 0 または 1 のビットは断線・短絡
+    int stuckBits = (~bitsOr | bitsAnd) & 0xff;
+    if (stuckBits) {
+        DEBUG_PRINTF("Self test %d: stuck data bits 0x%02X\r\n", index, stuckBits);
+        result = 1;
+    }
+
+    // バーの色が期待と異なる場合はデータ線の入れ替わり
+    for (int bar = 0; bar < 8; bar++) {
+        uint8_t color = 0;
+        for (int c = 0; c < 3; c++) {
+            if (sum[bar][c] / count[bar] >= 128) {
+                color |= 4 >> c;
+            }
+        }
+        if (color != barColors[bar]) {
+            DEBUG_PRINTF("Self test %d: bar %d color %d (expected %d)\r\n", index, bar, color, barColors[bar]);
+            result = 1;
+        }
+    }
+
+    long bytes = (long) bytesPerLine * sizey;
+    DEBUG_PRINTF("Self test %d: VSYNC to done %d us, readout %ld bytes in %d us (%ld bytes/s)\r\n",
+                 index, captureUs, bytes, readUs, readUs > 0 ? (long) (bytes * 1000000LL / readUs) : 0L);
+    DEBUG_PRINTF("Self test %d: %s\r\n", index, result == 0 ? "OK" : "FAILED");
+
+    free(raw_line[0]);
+    free(raw_line[1]);
+    free(bmp_line_data);
+    return result;
+}
+
+/**
+ * 設定値 (フォーマット・サイズ・窓・クロック条件) の識別子
+ * RTC バックアップレジスタに保存し、ウォームリスタート時の比較に使う
+ */
+uint32_t configKey() {
+    uint32_t key = 2166136261u;
+    int values[] = {colorFormat, imageSize, windowX, windowY, windowW, windowH, windowScale, maxFrameMs};
+
+    for (unsigned int i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        key = (key ^ (uint32_t) values[i]) * 16777619u;
+    }
+    return key;
+}
+
+/**
+ * VSTART/VSTOP の窓を縦に分割し、連続するフレームから短冊ごとにキャプチャして
+ * ファイル順に書き込む。各パスの所要時間を出力する。
+ */
+uint8_t captureSplitFrame(FILE *fp, unsigned char *bmp_line_data, int real_width) {
+
+    int vstart, vstop;
+    camera.GetVerticalWindow(&vstart, &vstop);
+
+    int stripHeight = sizey / captureStrips;
+    uint8_t result = 0;
+    Timer timer;
+
+    for (int i = 0; i < captureStrips; i++) {
+        int rows = (i == captureStrips - 1) ? sizey - stripHeight * i : stripHeight;
+        int top = vstart + stripHeight * i;
+
+        timer.reset();
+        timer.start();
+
+        // 窓の変更は次のフレームから有効になるので、1フレーム待ってからキャプチャする
+        camera.SetVerticalWindow(top, top + rows);
+        camera.WaitNextFrame();
+
+        beginFrameRead();
+        int startTime = timer.read_ms();
+
+        result = readRows2Bytes(fp, bmp_line_data, real_width, rows);
+        endFrameRead();
+        if (result != 0) {
+            break;
+        }
+
+        timer.stop();
+        DEBUG_PRINTF("Strip %d/%d: %d lines, read start %d ms, total %d ms\r\n",
+                     i + 1, captureStrips, rows, startTime, timer.read_ms());
+    }
+
+    // 元の窓に戻す
+    camera.SetVerticalWindow(vstart, vstop);
+    return result;
+}
+
 static void startCapture() {
-    currentStatus = ACTIVE;
+    if (currentStatus != ERROR) {
+        currentStatus = ACTIVE;
+    }
 }
 
 static void stopCapture() {